@@ -3,9 +3,22 @@
 //
 
 #include "Connection.h"
+#include "util/lz.h"
+#include <cstring>
+#include <algorithm>
+
+#if !WIN32
+#include<unistd.h>
+#include<cerrno>
+#endif
 
 namespace net {
 
+	//receive buffers of closed connections are reused by new ones
+	static std::mutex readBufferPoolMutex;
+	static std::vector<std::vector<uint8_t>> readBufferPool;
+	static const int readBufferPoolSize = 64;
+
 	Connection::Connection() {
 		thread = nullptr;
 		running = false;
@@ -15,6 +28,9 @@ namespace net {
 		errorCallback = nullptr;
 		packetize = false;
 		outbound = false;
+		lastWriteTime = 0;
+		nextMessageId = 0;
+		chunkCallback = nullptr;
 	}
 
 	Connection::Connection(Connection&& conn) {
@@ -24,6 +40,21 @@ namespace net {
 		disconnectCallback = conn.disconnectCallback;
 		connectCallback = conn.connectCallback;
 		errorCallback = conn.errorCallback;
+		chunkCallback = conn.chunkCallback;
+		maxFrameSize = conn.maxFrameSize;
+		chunkSize = conn.chunkSize;
+		interleaveSize = conn.interleaveSize;
+		readBufferSize = conn.readBufferSize;
+		readBuffer = std::move(conn.readBuffer);
+		readBegin = conn.readBegin;
+		readEnd = conn.readEnd;
+		compression = conn.compression;
+		compressionThreshold = conn.compressionThreshold;
+		zeroCopyThreshold = conn.zeroCopyThreshold;
+		maxZeroCopyBytes = conn.maxZeroCopyBytes;
+		streams = conn.streams;
+		lastWriteTime = conn.lastWriteTime.load();
+		nextMessageId = conn.nextMessageId.load();
 
 		conn.thread = nullptr;
 		conn.socket = nullptr;
@@ -31,10 +62,17 @@ namespace net {
 		conn.disconnectCallback = nullptr;
 		conn.connectCallback = nullptr;
 		conn.errorCallback = nullptr;
+		conn.chunkCallback = nullptr;
 	}
 
 	Connection::~Connection() {
 		close();
+		if (!readBuffer.empty()) {
+			std::unique_lock<std::mutex> lock(readBufferPoolMutex);
+			if (readBufferPool.size() < readBufferPoolSize) {
+				readBufferPool.push_back(std::move(readBuffer));
+			}
+		}
 	}
 
 	ErrorCode Connection::connect(const Endpoint& endpoint) {
@@ -75,6 +113,25 @@ namespace net {
 		return error;
 	}
 
+	ErrorCode Connection::connect(const std::vector<Endpoint>& endpoints, int timeoutMs, int attemptDelayMs) {
+		if (!socket) {
+			socket = std::make_shared<TcpSocket>();
+		}
+		ErrorCode error = socket->connect(endpoints, timeoutMs, attemptDelayMs);
+		if (error) {
+			if (errorCallback) {
+				errorCallback(this, error);
+			}
+		}
+		else {
+			outbound = true;
+			if (connectCallback) {
+				connectCallback(this);
+			}
+		}
+		return error;
+	}
+
 	void Connection::run() {
 		if (running) {
 			return;
@@ -104,20 +161,26 @@ namespace net {
 		return running;
 	}
 
-	ErrorCode Connection::write(Buffer& buffer) {
+	ErrorCode Connection::write(Buffer& buffer, uint16_t stream, CompressedFrame* cache) {
 		if (!socket) {
 			return ErrorCode::DISCONNECTED;
 		}
 
 		ErrorCode error;
 		if (packetize) {
-			int packetSize = buffer.size();
-			error = socket->write(&packetSize, sizeof(packetSize));
-			if (!error) {
-				error = socket->write(buffer.data(), buffer.size());
+			CompressedFrame local;
+			CompressedFrame& frame = cache ? *cache : local;
+			if (compress(stream, buffer.data(), buffer.size(), frame)) {
+				uint32_t packetSize = (uint32_t)frame.data.size() | compressedFrameFlag;
+				error = writeFrame(stream, (uint8_t*)&packetSize, sizeof(packetSize), frame.data.data(), (int)frame.data.size());
+			}
+			else {
+				uint32_t packetSize = buffer.size();
+				error = writeFrame(stream, (uint8_t*)&packetSize, sizeof(packetSize), buffer.data(), buffer.size());
 			}
 		}
 		else {
+			std::unique_lock<std::mutex> lock(writeMutex);
 			error = socket->write(buffer.data(), buffer.size());
 		}
 
@@ -126,9 +189,24 @@ namespace net {
 				errorCallback(this, error);
 			}
 		}
+		else {
+			lastWriteTime = std::chrono::steady_clock::now().time_since_epoch().count();
+		}
 		return error;
 	}
 
+	void Connection::setStreamPriority(uint16_t stream, Priority priority, int weight) {
+		std::unique_lock<std::mutex> lock(scheduleMutex);
+		Stream& entry = streams[stream];
+		entry.priority = priority;
+		entry.weight = weight > 0 ? weight : 1;
+	}
+
+	void Connection::setStreamDictionary(uint16_t stream, std::shared_ptr<const std::vector<uint8_t>> dictionary) {
+		std::unique_lock<std::mutex> lock(scheduleMutex);
+		streams[stream].dictionary = dictionary;
+	}
+
 	ErrorCode Connection::read(Buffer& buffer) {
 		if (!socket) {
 			return ErrorCode::DISCONNECTED;
@@ -136,25 +214,94 @@ namespace net {
 
 		ErrorCode error;
 		if (packetize) {
-			int packetSize = 0;
-			int bytes = sizeof(packetSize);
-			error = socket->read(&packetSize, bytes);
-			if (!error) {
-				if (packetSize <= 1024 * 1024 * 16 && packetSize >= 0) {
-					buffer.reserve(buffer.getWriteIndex() + packetSize);
-
-					while (packetSize > 0) {
-						bytes = packetSize;
-						error = socket->read(buffer.dataWrite(), bytes);
+			while (true) {
+				uint32_t header = 0;
+				error = readBytes(&header, sizeof(header));
+				if (error) {
+					break;
+				}
+				uint32_t packetSize = header & frameSizeMask;
+				if ((int64_t)packetSize > maxFrameSize + fragmentHeaderSize + (int)sizeof(header)) {
+					error = ErrorCode::INVALID_PACKET;
+					break;
+				}
+
+				//regular frames are read directly into the buffer, chunks and pieces are handled here and read returns the next regular frame
+				Buffer frame;
+				bool isChunk;
+				if (header & fragmentFrameFlag) {
+					if (packetSize < fragmentHeaderSize) {
+						error = ErrorCode::INVALID_PACKET;
+						break;
+					}
+					Buffer pieceHeader;
+					error = readBytes(pieceHeader, fragmentHeaderSize);
+					if (error) {
+						break;
+					}
+					uint16_t stream = pieceHeader.read<uint16_t>();
+					bool last = pieceHeader.read<uint8_t>();
+					packetSize -= fragmentHeaderSize;
+
+					//the first piece starts with the header of the original frame, the pieces are read directly into the joined frame
+					Fragment& fragment = fragments[stream];
+					if (!fragment.started) {
+						Buffer frameHeader;
+						error = packetSize < sizeof(header) ? ErrorCode::INVALID_PACKET : readBytes(frameHeader, sizeof(header));
 						if (error) {
 							break;
 						}
-						buffer.skipWrite(bytes);
-						packetSize -= bytes;
+						fragment.header = frameHeader.read<uint32_t>();
+						fragment.started = true;
+						packetSize -= sizeof(header);
+						fragment.data.reserve(std::min((int)(fragment.header & frameSizeMask), maxFrameSize));
+						fragment.data.reset();
+					}
+					if (fragment.data.getWriteIndex() + (int64_t)packetSize > maxFrameSize) {
+						error = ErrorCode::INVALID_PACKET;
+						break;
 					}
+					error = readBytes(fragment.data, packetSize);
+					if (error) {
+						break;
+					}
+					if (!last) {
+						continue;
+					}
+
+					//the joined frame is swapped out, so the memory of the last frame of the stream is reused for the next one
+					header = fragment.header;
+					isChunk = header & chunkFrameFlag;
+					std::swap(isChunk ? frame : buffer, fragment.data);
+					fragment.started = false;
 				}
 				else {
+					isChunk = header & chunkFrameFlag;
+					error = readBytes(isChunk ? frame : buffer, packetSize);
+					if (error) {
+						break;
+					}
+				}
+
+				if (header & compressedFrameFlag) {
+					error = decompress(isChunk ? frame : buffer);
+					if (error) {
+						break;
+					}
+				}
+				if (!isChunk) {
+					break;
+				}
+
+				if (frame.size() < chunkHeaderSize) {
 					error = ErrorCode::INVALID_PACKET;
+					break;
+				}
+				uint64_t messageId = frame.read<uint64_t>();
+				int64_t offset = frame.read<int64_t>();
+				bool last = frame.read<uint8_t>();
+				if (chunkCallback) {
+					chunkCallback(this, messageId, offset, frame, last);
 				}
 			}
 		}
@@ -174,13 +321,429 @@ namespace net {
 		return error;
 	}
 
+	std::shared_ptr<MessageWriter> Connection::writeMessage(uint16_t stream) {
+		return std::make_shared<MessageWriter>(++nextMessageId, chunkSize, [this, stream](uint64_t messageId, int64_t offset, Buffer& chunk, bool last) {
+			return writeChunk(messageId, offset, chunk, last, stream);
+		});
+	}
+
+	ErrorCode Connection::writeChunk(uint64_t messageId, int64_t offset, Buffer& chunk, bool last, uint16_t stream) {
+		if (!socket) {
+			return ErrorCode::DISCONNECTED;
+		}
+		if (!packetize) {
+			return ErrorCode::GENERAL_ERROR;
+		}
+
+		uint8_t header[sizeof(uint32_t) + chunkHeaderSize];
+		createChunkHeader(header, messageId, offset, chunk.size(), last);
+
+		//the chunk header is compressed together with the data
+		ErrorCode error;
+		CompressedFrame frame;
+		std::vector<uint8_t> payload;
+		if (compression && chunkHeaderSize + chunk.size() >= compressionThreshold) {
+			payload.resize(chunkHeaderSize + chunk.size());
+			memcpy(payload.data(), header + sizeof(uint32_t), chunkHeaderSize);
+			memcpy(payload.data() + chunkHeaderSize, chunk.data(), chunk.size());
+		}
+		if (!payload.empty() && compress(stream, payload.data(), (int)payload.size(), frame)) {
+			uint32_t frameSize = (uint32_t)frame.data.size() | chunkFrameFlag | compressedFrameFlag;
+			error = writeFrame(stream, (uint8_t*)&frameSize, sizeof(frameSize), frame.data.data(), (int)frame.data.size());
+		}
+		else {
+			error = writeFrame(stream, header, sizeof(header), chunk.data(), chunk.size());
+		}
+		if (error) {
+			if (errorCallback) {
+				errorCallback(this, error);
+			}
+		}
+		else {
+			lastWriteTime = std::chrono::steady_clock::now().time_since_epoch().count();
+		}
+		return error;
+	}
+
+	ErrorCode Connection::write(std::shared_ptr<const std::vector<uint8_t>> payload, uint16_t stream) {
+		if (!socket) {
+			return ErrorCode::DISCONNECTED;
+		}
+		int size = payload ? (int)payload->size() : 0;
+		bool zeroCopy = zeroCopyThreshold >= 0 && size >= zeroCopyThreshold;
+		if (zeroCopy) {
+			std::unique_lock<std::mutex> lock(writeMutex);
+			zeroCopy = socket->enableZeroCopy() && socket->isZeroCopyEffective();
+		}
+
+		//payloads that compress are not sent with zero copy
+		CompressedFrame frame;
+		if (!zeroCopy || (packetize && compress(stream, payload->data(), size, frame))) {
+			Buffer buffer(size > 0 ? (void*)payload->data() : nullptr, size);
+			return write(buffer, stream, &frame);
+		}
+
+		ErrorCode error;
+		if (packetize) {
+			uint32_t packetSize = size;
+			error = writeFrame(stream, (uint8_t*)&packetSize, sizeof(packetSize), payload->data(), size, -1, 0, true);
+		}
+		else {
+			std::unique_lock<std::mutex> lock(writeMutex);
+			error = socket->writeZeroCopy(payload->data(), size);
+		}
+
+		if (error) {
+			if (errorCallback) {
+				errorCallback(this, error);
+			}
+		}
+		else {
+			lastWriteTime = std::chrono::steady_clock::now().time_since_epoch().count();
+		}
+
+		//the payload is kept until the kernel does not reference its memory anymore
+		std::unique_lock<std::mutex> lock(writeMutex);
+		ZeroCopyPayload entry;
+		entry.sequence = socket->getZeroCopySequence();
+		entry.data = payload;
+		zeroCopyPayloads.push_back(entry);
+		zeroCopyBytes += size;
+		releaseZeroCopyPayloads(0);
+		while (!error && zeroCopyBytes > maxZeroCopyBytes && socket->isConnected()) {
+			releaseZeroCopyPayloads(100);
+		}
+		return error;
+	}
+
+	ErrorCode Connection::sendFile(int file, int64_t offset, int64_t bytes, uint16_t stream, uint64_t* messageId) {
+		if (!socket) {
+			return ErrorCode::DISCONNECTED;
+		}
+
+		ErrorCode error = ErrorCode::NO_ERROR;
+		if (packetize) {
+			uint64_t id = ++nextMessageId;
+			if (messageId) {
+				*messageId = id;
+			}
+			int64_t position = 0;
+			do {
+				int count = (int)std::min<int64_t>(chunkSize, bytes - position);
+				uint8_t header[sizeof(uint32_t) + chunkHeaderSize];
+				createChunkHeader(header, id, position, count, position + count == bytes);
+				error = writeFrame(stream, header, sizeof(header), nullptr, count, file, offset + position);
+				position += count;
+			} while (!error && position < bytes);
+			//a file that ended early leaves a partial frame on the socket
+			if (error) {
+				disconnect();
+			}
+		}
+		else {
+			std::unique_lock<std::mutex> lock(writeMutex);
+			while (!error && bytes > 0) {
+				int count = (int)std::min<int64_t>(bytes, 1 << 30);
+				error = socket->sendFile(file, offset, count);
+				offset += count;
+				bytes -= count;
+			}
+		}
+
+		if (error) {
+			if (errorCallback) {
+				errorCallback(this, error);
+			}
+		}
+		else {
+			lastWriteTime = std::chrono::steady_clock::now().time_since_epoch().count();
+		}
+		return error;
+	}
+
+	void Connection::createChunkHeader(uint8_t* header, uint64_t messageId, int64_t offset, int size, bool last) {
+		uint32_t frameSize = (uint32_t)(chunkHeaderSize + size) | chunkFrameFlag;
+		memcpy(header, &frameSize, sizeof(frameSize));
+		memcpy(header + sizeof(uint32_t), &messageId, sizeof(messageId));
+		memcpy(header + sizeof(uint32_t) + sizeof(messageId), &offset, sizeof(offset));
+		header[sizeof(uint32_t) + chunkHeaderSize - 1] = last;
+	}
+
+	void Connection::releaseZeroCopyPayloads(int timeoutMs) {
+		if (zeroCopyPayloads.empty()) {
+			return;
+		}
+		uint32_t completed = socket->getZeroCopyCompleted(timeoutMs);
+		while (!zeroCopyPayloads.empty() && (int32_t)(completed - zeroCopyPayloads.front().sequence) >= 0) {
+			zeroCopyBytes -= zeroCopyPayloads.front().data->size();
+			zeroCopyPayloads.pop_front();
+		}
+	}
+
+	ErrorCode Connection::writeFrame(uint16_t stream, const uint8_t* header, int headerSize, const uint8_t* payload, int payloadSize, int file, int64_t fileOffset, bool zeroCopy) {
+		std::unique_lock<std::mutex> lock(scheduleMutex);
+		Stream& entry = streams[stream];
+		if (socket->hasStreams()) {
+			//the transport schedules the streams itself and a loss only delays its own stream, so frames are written whole
+			int priority = entry.priority;
+			int weight = entry.weight;
+			lock.unlock();
+			std::vector<uint8_t> filePayload;
+			if (file != -1) {
+				filePayload.resize(payloadSize);
+				ErrorCode error = readFile(file, fileOffset, filePayload.data(), payloadSize);
+				if (error) {
+					return error;
+				}
+				payload = filePayload.data();
+			}
+			return socket->writeMessage(stream, priority, weight, header, headerSize, payload, payloadSize);
+		}
+		uint64_t ticket = ++nextTicket;
+		entry.waiting.push_back(ticket);
+
+		//the first piece always holds the whole frame header
+		int pieceSize = std::max(interleaveSize, headerSize);
+		bool fragmented = payloadSize > pieceSize;
+		int total = headerSize + payloadSize;
+		int written = 0;
+		ErrorCode error = ErrorCode::NO_ERROR;
+		do {
+			scheduleCondition.wait(lock, [&]() {
+				return !writing && getNextTicket() == ticket;
+			});
+			writing = true;
+			int bytes = fragmented ? std::min(pieceSize, total - written) : total;
+			lock.unlock();
+
+			//frames from different threads must not interleave on the socket
+			std::unique_lock<std::mutex> writeLock(writeMutex);
+			if (fragmented) {
+				uint8_t pieceHeader[sizeof(uint32_t) + fragmentHeaderSize];
+				uint32_t pieceSize = (uint32_t)(fragmentHeaderSize + bytes) | fragmentFrameFlag;
+				memcpy(pieceHeader, &pieceSize, sizeof(pieceSize));
+				memcpy(pieceHeader + sizeof(uint32_t), &stream, sizeof(stream));
+				pieceHeader[sizeof(pieceHeader) - 1] = written + bytes == total;
+				error = socket->write(pieceHeader, sizeof(pieceHeader));
+			}
+			int begin = written;
+			int end = written + bytes;
+			if (!error && begin < headerSize) {
+				int count = std::min(end, headerSize) - begin;
+				error = socket->write(header + begin, count);
+				begin += count;
+			}
+			if (!error && begin < end) {
+				if (file != -1) {
+					error = socket->sendFile(file, fileOffset + begin - headerSize, end - begin);
+				}
+				else if (zeroCopy) {
+					error = socket->writeZeroCopy(payload + begin - headerSize, end - begin);
+				}
+				else {
+					error = socket->write(payload + begin - headerSize, end - begin);
+				}
+			}
+			writeLock.unlock();
+			written += bytes;
+
+			lock.lock();
+			writing = false;
+			entry.virtualTime = std::max(entry.virtualTime, virtualClock);
+			virtualClock = entry.virtualTime;
+			entry.virtualTime += (double)bytes / entry.weight;
+			if (error || written == total) {
+				entry.waiting.pop_front();
+			}
+			scheduleCondition.notify_all();
+		} while (!error && written < total);
+		return error;
+	}
+
+	ErrorCode Connection::readFile(int file, int64_t offset, uint8_t* data, int bytes) {
+#if WIN32
+		return ErrorCode::GENERAL_ERROR;
+#else
+		bool pipe = false;
+		while (bytes > 0) {
+			ssize_t code = pipe ? -1 : ::pread(file, data, bytes, offset);
+			if (code < 0 && (pipe || errno == ESPIPE)) {
+				pipe = true;
+				code = ::read(file, data, bytes);
+			}
+			if (code < 0 && errno == EINTR) {
+				continue;
+			}
+			if (code <= 0) {
+				return code == 0 ? ErrorCode::DISCONNECTED : getLastError();
+			}
+			data += code;
+			offset += code;
+			bytes -= (int)code;
+		}
+		return ErrorCode::NO_ERROR;
+#endif
+	}
+
+	uint64_t Connection::getNextTicket() {
+		Stream* next = nullptr;
+		for (auto& i : streams) {
+			Stream& stream = i.second;
+			if (stream.waiting.empty()) {
+				continue;
+			}
+			if (!next || stream.priority < next->priority || (stream.priority == next->priority && stream.virtualTime < next->virtualTime)) {
+				next = &stream;
+			}
+		}
+		return next ? next->waiting.front() : 0;
+	}
+
+	ErrorCode Connection::readBytes(Buffer& buffer, int bytes) {
+		buffer.reserve(buffer.getWriteIndex() + bytes);
+		ErrorCode error = readBytes(buffer.dataWrite(), bytes);
+		if (!error) {
+			buffer.skipWrite(bytes);
+		}
+		return error;
+	}
+
+	ErrorCode Connection::readBytes(void* data, int bytes) {
+		uint8_t* ptr = (uint8_t*)data;
+		while (bytes > 0) {
+			if (readBegin < readEnd) {
+				int count = std::min(bytes, readEnd - readBegin);
+				memcpy(ptr, readBuffer.data() + readBegin, count);
+				readBegin += count;
+				ptr += count;
+				bytes -= count;
+				continue;
+			}
+
+			//the buffer is only refilled when it is empty, so the unparsed tail never has to be moved
+			int count = bytes;
+			if (bytes < readBufferSize) {
+				if ((int)readBuffer.size() != readBufferSize) {
+					std::unique_lock<std::mutex> lock(readBufferPoolMutex);
+					if (!readBufferPool.empty() && (int)readBufferPool.back().size() == readBufferSize) {
+						readBuffer = std::move(readBufferPool.back());
+						readBufferPool.pop_back();
+					}
+					else {
+						readBuffer.resize(readBufferSize);
+					}
+				}
+				readBegin = 0;
+				readEnd = 0;
+				count = readBufferSize;
+				ErrorCode error = socket->read(readBuffer.data(), count);
+				if (error) {
+					return error;
+				}
+				readEnd = count;
+			}
+			else {
+				ErrorCode error = socket->read(ptr, count);
+				if (error) {
+					return error;
+				}
+				ptr += count;
+				bytes -= count;
+			}
+		}
+		return ErrorCode::NO_ERROR;
+	}
+
+	bool Connection::compress(uint16_t stream, const uint8_t* data, int bytes, CompressedFrame& frame) {
+		if (!compression || bytes < compressionThreshold) {
+			return false;
+		}
+		std::shared_ptr<const std::vector<uint8_t>> dictionary;
+		{
+			std::unique_lock<std::mutex> lock(scheduleMutex);
+			auto entry = streams.find(stream);
+			if (entry != streams.end()) {
+				dictionary = entry->second.dictionary;
+			}
+		}
+		if (frame.valid && frame.dictionary == dictionary.get() && (!dictionary || frame.stream == stream)) {
+			return frame.compressed;
+		}
+
+		frame.valid = true;
+		frame.compressed = false;
+		frame.stream = stream;
+		frame.dictionary = dictionary.get();
+		//frames that do not shrink are written uncompressed
+		int capacity = bytes - compressedHeaderSize - 1;
+		if (capacity <= 0) {
+			return false;
+		}
+		frame.data.resize(compressedHeaderSize + capacity);
+		uint32_t size = bytes;
+		uint8_t hasDictionary = dictionary != nullptr;
+		memcpy(frame.data.data(), &size, sizeof(size));
+		frame.data[sizeof(size)] = hasDictionary;
+		memcpy(frame.data.data() + sizeof(size) + 1, &stream, sizeof(stream));
+		int compressed = lzCompress(data, bytes, frame.data.data() + compressedHeaderSize, capacity,
+			dictionary ? dictionary->data() : nullptr, dictionary ? (int)dictionary->size() : 0);
+		if (compressed <= 0) {
+			frame.data.clear();
+			return false;
+		}
+		frame.data.resize(compressedHeaderSize + compressed);
+		frame.compressed = true;
+		return true;
+	}
+
+	ErrorCode Connection::decompress(Buffer& buffer) {
+		if (buffer.size() < compressedHeaderSize) {
+			return ErrorCode::INVALID_PACKET;
+		}
+		uint32_t size = buffer.read<uint32_t>();
+		bool hasDictionary = buffer.read<uint8_t>();
+		uint16_t stream = buffer.read<uint16_t>();
+		if ((int64_t)size > maxFrameSize) {
+			return ErrorCode::INVALID_PACKET;
+		}
+
+		std::shared_ptr<const std::vector<uint8_t>> dictionary;
+		if (hasDictionary) {
+			std::unique_lock<std::mutex> lock(scheduleMutex);
+			auto entry = streams.find(stream);
+			if (entry != streams.end()) {
+				dictionary = entry->second.dictionary;
+			}
+			if (!dictionary) {
+				return ErrorCode::INVALID_PACKET;
+			}
+		}
+
+		Buffer data;
+		data.reserve(size);
+		int bytes = lzDecompress(buffer.data(), buffer.size(), data.dataWrite(), size,
+			dictionary ? dictionary->data() : nullptr, dictionary ? (int)dictionary->size() : 0);
+		if (bytes != (int)size) {
+			return ErrorCode::INVALID_PACKET;
+		}
+		data.skipWrite(bytes);
+		std::swap(buffer, data);
+		return ErrorCode::NO_ERROR;
+	}
+
 	void Connection::close() {
 		if (socket) {
 			socket->disconnect();
 		}
 		running = false;
 		if (thread) {
-			thread->join();
+			//the last reference can be released by a callback on the reading thread itself
+			if (thread->get_id() == std::this_thread::get_id()) {
+				thread->detach();
+			}
+			else {
+				thread->join();
+			}
 			delete thread;
 			thread = nullptr;
 		}
@@ -193,4 +756,28 @@ namespace net {
 		running = false;
 	}
 
+	void Connection::shutdown() {
+		std::unique_lock<std::mutex> lock(writeMutex);
+		if (socket) {
+			socket->shutdownWrite();
+		}
+	}
+
+	std::chrono::steady_clock::time_point Connection::getLastWriteTime() {
+		return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(lastWriteTime.load()));
+	}
+
+	bool Connection::isWriteQueueEmpty() {
+		std::unique_lock<std::mutex> lock(scheduleMutex);
+		if (writing) {
+			return false;
+		}
+		for (auto& i : streams) {
+			if (!i.second.waiting.empty()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
 }
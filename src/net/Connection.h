@@ -5,22 +5,66 @@
 #pragma once
 
 #include "TcpSocket.h"
+#include "MessageWriter.h"
 #include "util/Buffer.h"
 #include <thread>
 #include <functional>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <condition_variable>
 
 namespace net {
 
-	class Connection {
+	class Connection : public std::enable_shared_from_this<Connection> {
 	public:
-		std::shared_ptr<TcpSocket> socket;
+		//streams of a higher priority are always written first, streams of the same priority share the socket by weight
+		enum Priority : uint8_t {
+			PRIORITY_CONTROL,
+			PRIORITY_INTERACTIVE,
+			PRIORITY_BULK,
+		};
+
+		std::shared_ptr<StreamSocket> socket;
 		bool outbound;
 		bool packetize;
+		//larger frames are rejected, larger messages have to be streamed in chunks
+		int maxFrameSize = 16 * 1024 * 1024;
+		int chunkSize = 64 * 1024;
+		//packetized frames larger than this are written in pieces, so frames of other streams can be written in between
+		int interleaveSize = 16 * 1024;
+		//packetized connections receive as much as is available into a buffer of this size and parse the frames from it
+		//payloads that do not fit are read directly into the frame
+		int readBufferSize = 64 * 1024;
+		//packetized frames of at least compressionThreshold bytes are compressed, only enable it when the remote can decompress
+		bool compression = false;
+		int compressionThreshold = 256;
+		//shared payloads of at least this size are sent with MSG_ZEROCOPY, -1 disables it, linux only
+		int zeroCopyThreshold = 64 * 1024;
+		//writes wait for completions while more bytes are referenced by zero copy sends
+		int64_t maxZeroCopyBytes = 64 * 1024 * 1024;
 
 		std::function<void(Connection*, Buffer&)> readCallback;
 		std::function<void(Connection*)> disconnectCallback;
 		std::function<void(Connection*)> connectCallback;
 		std::function<void(Connection*, ErrorCode)> errorCallback;
+		//chunks of streamed messages in order, last is set for the final chunk of a message
+		std::function<void(Connection*, uint64_t messageId, int64_t offset, Buffer& chunk, bool last)> chunkCallback;
+
+		//the compressed form of a frame, so a frame written to several connections is only compressed once
+		class CompressedFrame {
+		public:
+			bool valid = false;
+			bool compressed = false;
+			uint16_t stream = 0;
+			const std::vector<uint8_t>* dictionary = nullptr;
+			std::vector<uint8_t> data;
+		};
 
 		Connection();
 		Connection(Connection &&conn);
@@ -28,16 +72,112 @@ namespace net {
 
 		ErrorCode connect(const Endpoint& endpoint);
 		ErrorCode connect(const std::string& address, uint16_t port, bool resolve = true, bool prefereIpv4 = false);
+		ErrorCode connect(const std::vector<Endpoint>& endpoints, int timeoutMs, int attemptDelayMs = 250);
 		void run();
 		bool isRunning();
-		ErrorCode write(Buffer& buffer);
+		//frames of one stream are received in order, frames of different streams can overtake each other
+		//the frame is compressed into the cache on first use and the cached form is written by later calls
+		ErrorCode write(Buffer& buffer, uint16_t stream = 0, CompressedFrame* cache = nullptr);
+		//the payload is referenced until the kernel released it, so large payloads are sent without copying them
+		ErrorCode write(std::shared_ptr<const std::vector<uint8_t>> payload, uint16_t stream = 0);
+		//streams a region of a file as a message in chunk frames without copying it through user space, offset is ignored for pipes
+		//the remote receives the chunks in chunkCallback, unpacketized connections send the plain bytes
+		ErrorCode sendFile(int file, int64_t offset, int64_t bytes, uint16_t stream = 0, uint64_t* messageId = nullptr);
+		//streams have control priority and a weight of 1 until set otherwise
+		void setStreamPriority(uint16_t stream, Priority priority, int weight = 1);
+		//both sides have to set the same dictionary for a stream, it helps to compress small frames of a known structure
+		void setStreamDictionary(uint16_t stream, std::shared_ptr<const std::vector<uint8_t>> dictionary);
 		ErrorCode read(Buffer &buffer);
+		//streams a message in chunk frames, only for packetized connections
+		//chunk frames end at the remote of this connection, PeerNetwork::openMessage streams over routed packets instead
+		std::shared_ptr<MessageWriter> writeMessage(uint16_t stream = 0);
+		ErrorCode writeChunk(uint64_t messageId, int64_t offset, Buffer& chunk, bool last, uint16_t stream = 0);
 		void close();
 		void disconnect();
+		//graceful close, frames that were already written are delivered and the connection reads until the remote closes
+		void shutdown();
+		//time of the last successful write
+		std::chrono::steady_clock::time_point getLastWriteTime();
+		//true when no frame is queued or being written by the stream scheduler
+		bool isWriteQueueEmpty();
 	
 	private:
+		class Stream {
+		public:
+			Priority priority = PRIORITY_CONTROL;
+			int weight = 1;
+			//advances by the written bytes divided by the weight, the stream with the lowest time is written next
+			double virtualTime = 0;
+			//writers waiting for the socket, the front keeps its place until all pieces of its frame are written
+			std::deque<uint64_t> waiting;
+			std::shared_ptr<const std::vector<uint8_t>> dictionary;
+		};
+
 		std::thread *thread;
 		bool running;
+		std::mutex writeMutex;
+		std::atomic<std::chrono::steady_clock::rep> lastWriteTime;
+		std::atomic<uint64_t> nextMessageId;
+
+		//the high bit of the frame size marks a chunk frame
+		static const uint32_t chunkFrameFlag = 0x80000000;
+		//message id, offset and last flag in front of the chunk data
+		static const int chunkHeaderSize = sizeof(uint64_t) + sizeof(int64_t) + 1;
+		//marks a piece of a larger frame, the pieces of a stream are joined to the original frame
+		static const uint32_t fragmentFrameFlag = 0x40000000;
+		//stream id and last flag in front of the piece
+		static const int fragmentHeaderSize = sizeof(uint16_t) + 1;
+		//marks a compressed payload, the original size and the stream of the dictionary are in front of the compressed data
+		static const uint32_t compressedFrameFlag = 0x20000000;
+		static const int compressedHeaderSize = sizeof(uint32_t) + 1 + sizeof(uint16_t);
+		static const uint32_t frameSizeMask = 0x1FFFFFFF;
+
+		std::map<uint16_t, Stream> streams;
+		double virtualClock = 0;
+		bool writing = false;
+		uint64_t nextTicket = 0;
+		std::mutex scheduleMutex;
+		std::condition_variable scheduleCondition;
+		class Fragment {
+		public:
+			bool started = false;
+			//header of the original frame
+			uint32_t header = 0;
+			Buffer data;
+		};
+		//partially received frames by stream, only used by the reading thread
+		std::unordered_map<uint16_t, Fragment> fragments;
+
+		class ZeroCopyPayload {
+		public:
+			//released once the socket completed this many zero copy sends
+			uint32_t sequence = 0;
+			std::shared_ptr<const std::vector<uint8_t>> data;
+		};
+		//guarded by writeMutex
+		std::deque<ZeroCopyPayload> zeroCopyPayloads;
+		int64_t zeroCopyBytes = 0;
+
+		//writes the frame header and payload, in pieces when the frame is larger than interleaveSize
+		//the payload is read from the file instead when one is given
+		ErrorCode writeFrame(uint16_t stream, const uint8_t* header, int headerSize, const uint8_t* payload, int payloadSize, int file = -1, int64_t fileOffset = 0, bool zeroCopy = false);
+		static void createChunkHeader(uint8_t* header, uint64_t messageId, int64_t offset, int size, bool last);
+		//reads the payload of a frame for transports that take frames as whole messages
+		static ErrorCode readFile(int file, int64_t offset, uint8_t* data, int bytes);
+		//writeMutex must be locked by the caller
+		void releaseZeroCopyPayloads(int timeoutMs);
+		//scheduleMutex must be locked by the caller
+		uint64_t getNextTicket();
+		//received bytes that were not parsed yet, only used by the reading thread
+		std::vector<uint8_t> readBuffer;
+		int readBegin = 0;
+		int readEnd = 0;
+
+		ErrorCode readBytes(Buffer& buffer, int bytes);
+		ErrorCode readBytes(void* data, int bytes);
+		//returns false when the frame is written uncompressed
+		bool compress(uint16_t stream, const uint8_t* data, int bytes, CompressedFrame& frame);
+		ErrorCode decompress(Buffer& buffer);
 	};
 
 }
@@ -3,6 +3,7 @@
 //
 
 #include "Endpoint.h"
+#include "Resolver.h"
 #include <cstring>
 
 #if WIN32
@@ -71,23 +72,9 @@ namespace net {
 			}
 		}
 		if (resolve && addr6.sin6_family == 0) {
-			struct addrinfo* info;
-			if (getaddrinfo(address.c_str(), nullptr, nullptr, &info) == 0) {
-				for (addrinfo* i = info; i != nullptr; i = i->ai_next) {
-					if (i->ai_family == AF_INET) {
-						addr4 = *(sockaddr_in*)i->ai_addr;
-						if (prefereIpv4) {
-							break;
-						}
-					}
-					else if (i->ai_family == AF_INET6) {
-						addr6 = *(sockaddr_in6*)i->ai_addr;
-						if (!prefereIpv4) {
-							break;
-						}
-					}
-				}
-				freeaddrinfo(info);
+			std::vector<Endpoint> endpoints;
+			if (Resolver::getDefault().resolve(address, 0, endpoints, prefereIpv4) == ErrorCode::NO_ERROR) {
+				memcpy(data, endpoints[0].data, sizeof(data));
 			}
 		}
 
@@ -99,6 +86,24 @@ namespace net {
 		setAddress(address, resolve, prefereIpv4);
 	}
 
+	void Endpoint::setAddressBytes(const void* bytes, int size) {
+		struct sockaddr_in6& addr6 = *(sockaddr_in6*)data;
+		struct sockaddr_in& addr4 = *(sockaddr_in*)data;
+		uint16_t port = addr6.sin6_port;
+		memset(data, 0, sizeof(data));
+
+		if (size == sizeof(addr4.sin_addr)) {
+			addr4.sin_family = AF_INET;
+			memcpy(&addr4.sin_addr, bytes, size);
+		}
+		else if (size == sizeof(addr6.sin6_addr)) {
+			addr6.sin6_family = AF_INET6;
+			memcpy(&addr6.sin6_addr, bytes, size);
+		}
+
+		addr6.sin6_port = port;
+	}
+
 	uint16_t Endpoint::getPort() const {
 		struct sockaddr_in6& addr6 = *(sockaddr_in6*)data;
 		return htons(addr6.sin6_port);
@@ -116,6 +121,20 @@ namespace net {
 		}
 	}
 
+	int Endpoint::getAddressBytes(void* bytes) const {
+		struct sockaddr_in6& addr6 = *(sockaddr_in6*)data;
+		struct sockaddr_in& addr4 = *(sockaddr_in*)data;
+		if (isIpv4()) {
+			memcpy(bytes, &addr4.sin_addr, sizeof(addr4.sin_addr));
+			return sizeof(addr4.sin_addr);
+		}
+		else if (isIpv6()) {
+			memcpy(bytes, &addr6.sin6_addr, sizeof(addr6.sin6_addr));
+			return sizeof(addr6.sin6_addr);
+		}
+		return 0;
+	}
+
 	bool Endpoint::isIpv4() const {
 		struct sockaddr_in6& addr6 = *(sockaddr_in6*)data;
 		return addr6.sin6_family == AF_INET;
@@ -139,4 +158,14 @@ namespace net {
 		return (void*)data;
 	}
 
+	std::vector<Endpoint> Endpoint::resolve(const std::string& address, uint16_t port) {
+		std::vector<Endpoint> endpoints;
+		Resolver::getDefault().resolve(address, port, endpoints);
+		return endpoints;
+	}
+
+	void Endpoint::resolve(const std::string& address, uint16_t port, const std::function<void(ErrorCode error, std::vector<Endpoint>& endpoints)>& callback, bool prefereIpv4) {
+		Resolver::getDefault().resolve(address, port, callback, prefereIpv4);
+	}
+
 }
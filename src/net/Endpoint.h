@@ -4,8 +4,11 @@
 
 #pragma once
 
+#include "ErrorCode.h"
 #include <cstdint>
 #include <string>
+#include <vector>
+#include <functional>
 
 namespace net {
 
@@ -18,9 +21,13 @@ namespace net {
 		void setPort(uint16_t port);
 		void setAddress(const std::string& address, bool resolve = true, bool prefereIpv4 = false);
 		void set(const std::string& address, uint16_t port, bool resolve = true, bool prefereIpv4 = false);
+		//raw address bytes in network order, 4 for ipv4 and 16 for ipv6
+		void setAddressBytes(const void* bytes, int size);
 
 		uint16_t getPort() const;
 		std::string getAddress() const;
+		//returns the number of bytes written (4, 16 or 0 for an invalid endpoint), bytes needs space for 16 bytes
+		int getAddressBytes(void* bytes) const;
 
 		bool isIpv4() const;
 		bool isIpv6() const;
@@ -28,6 +35,12 @@ namespace net {
 
 		void* getHandle();
 		const void* getHandle() const;
+
+		//all addresses of a host, ipv6 and ipv4 addresses alternate starting with ipv6
+		//host names are resolved by the default Resolver and cached
+		static std::vector<Endpoint> resolve(const std::string& address, uint16_t port);
+		//the callback is invoked on a resolver thread, or before the function returns for literals and cached host names
+		static void resolve(const std::string& address, uint16_t port, const std::function<void(ErrorCode error, std::vector<Endpoint>& endpoints)>& callback, bool prefereIpv4 = false);
 	private:
 		uint8_t data[28];
 	};
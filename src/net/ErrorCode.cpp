@@ -39,6 +39,10 @@ namespace net {
 			return "ENDPOINT_IN_USE";
 		case ErrorCode::INVALID_PACKET:
 			return "INVALID_PACKET";
+		case ErrorCode::LIMIT_REACHED:
+			return "LIMIT_REACHED";
+		case ErrorCode::NOT_FOUND:
+			return "NOT_FOUND";
 		default:
 			return "UNDEFINED";
 		}
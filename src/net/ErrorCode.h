@@ -16,6 +16,8 @@ namespace net {
 		INVALID_ENDPOINT,
 		ENDPOINT_IN_USE,
 		INVALID_PACKET,
+		LIMIT_REACHED,
+		NOT_FOUND,
 	};
 
 	const char* getErrorString(ErrorCode error);
@@ -0,0 +1,64 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include "MessageWriter.h"
+#include <algorithm>
+
+namespace net {
+
+	MessageWriter::MessageWriter(uint64_t messageId, int chunkSize, const ChunkSink& sink) {
+		this->messageId = messageId;
+		this->chunkSize = chunkSize > 0 ? chunkSize : 1;
+		this->sink = sink;
+	}
+
+	ErrorCode MessageWriter::write(const void* data, int bytes) {
+		if (finished) {
+			return ErrorCode::DISCONNECTED;
+		}
+		while (bytes > 0 && !error) {
+			//a full chunk is only send once more data follows, so the last chunk is never empty
+			if (chunk.getWriteIndex() == chunkSize) {
+				error = flush(false);
+				continue;
+			}
+			int count = std::min(bytes, chunkSize - chunk.getWriteIndex());
+			chunk.writeBytes(data, count);
+			data = (const uint8_t*)data + count;
+			bytes -= count;
+		}
+		return error;
+	}
+
+	ErrorCode MessageWriter::write(Buffer& data) {
+		return write(data.data(), data.size());
+	}
+
+	ErrorCode MessageWriter::finish() {
+		if (finished) {
+			return error;
+		}
+		if (!error) {
+			error = flush(true);
+		}
+		finished = true;
+		return error;
+	}
+
+	uint64_t MessageWriter::getMessageId() {
+		return messageId;
+	}
+
+	int64_t MessageWriter::getSize() {
+		return offset + chunk.getWriteIndex();
+	}
+
+	ErrorCode MessageWriter::flush(bool last) {
+		ErrorCode result = sink(messageId, offset, chunk, last);
+		offset += chunk.getWriteIndex();
+		chunk.clear();
+		return result;
+	}
+
+}
@@ -0,0 +1,41 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#pragma once
+
+#include "ErrorCode.h"
+#include "util/Buffer.h"
+#include <functional>
+
+namespace net {
+
+	//splits a message of any size into chunks, only one chunk of the message is held in memory
+	class MessageWriter {
+	public:
+		//sends one chunk, last is set for the final chunk of the message
+		typedef std::function<ErrorCode(uint64_t messageId, int64_t offset, Buffer& chunk, bool last)> ChunkSink;
+
+		MessageWriter(uint64_t messageId, int chunkSize, const ChunkSink& sink);
+
+		ErrorCode write(const void* data, int bytes);
+		ErrorCode write(Buffer& data);
+		//sends the remaining bytes as the last chunk, the writer can not be used afterwards
+		ErrorCode finish();
+		uint64_t getMessageId();
+		//number of bytes written so far
+		int64_t getSize();
+
+	private:
+		uint64_t messageId;
+		int chunkSize;
+		ChunkSink sink;
+		Buffer chunk;
+		int64_t offset = 0;
+		bool finished = false;
+		ErrorCode error = ErrorCode::NO_ERROR;
+
+		ErrorCode flush(bool last);
+	};
+
+}
@@ -0,0 +1,1351 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include "ReliableUdpSocket.h"
+#include "crypto/sha.h"
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+
+#if WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#undef NO_ERROR
+#else
+#include<unistd.h>
+#include<sys/socket.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<cerrno>
+#endif
+
+namespace net {
+
+	typedef std::chrono::steady_clock Clock;
+
+	enum PacketType : uint8_t {
+		PACKET_SYN = 1,
+		PACKET_SYN_ACK,
+		PACKET_DATA,
+		PACKET_FIN,
+		PACKET_ACK,
+		PACKET_PING,
+		PACKET_RESET,
+		//answers a syn without a valid cookie, the remote repeats the syn with it
+		PACKET_COOKIE,
+	};
+
+	//type and link id
+	static constexpr int packetHeaderSize = 1 + 8;
+	static constexpr int packetNumberSize = 8;
+	//a data packet carries fragments of one or more messages, each has its stream, message, message size, offset and length
+	static constexpr int fragmentHeaderSize = 2 + 8 + 4 + 4 + 2;
+	static constexpr int minDatagramSize = 576;
+	//a message is one frame of a Connection, at most its default maxFrameSize and the frame header
+	static constexpr uint32_t maxMessageSize = 16 * 1024 * 1024 + 1024;
+	//fragments of messages further ahead of the next message of their stream are refused, the sender repeats them later
+	static constexpr uint64_t maxMessagesAhead = 1024;
+	//bookkeeping of a partially received message, counted against the receive buffer together with its data
+	static constexpr int partialMessageOverhead = 64;
+	//streams that may receive their next message beyond the receive buffer at the same time
+	static constexpr int maxLargeMessages = 8;
+	static constexpr int maxAckRanges = 32;
+	//older packet numbers are forgotten, duplicates of them are still caught by the streams
+	static constexpr int maxReceivedRanges = 256;
+	static constexpr int maxPendingAccepts = 128;
+	//packets that are sent with one system call
+	static constexpr int maxBatchPackets = 32;
+	static constexpr int ackDelayMs = 1;
+	static constexpr int synIntervalMs = 250;
+	//interval of the driver while links have data in flight, timers and pacing have this resolution
+	static constexpr int tickMs = 1;
+	static constexpr int idleTickMs = 50;
+	static constexpr int lossPacketThreshold = 3;
+	static constexpr int initialWindowPackets = 10;
+	static constexpr int minWindowPackets = 2;
+	static constexpr double initialRttUs = 100000;
+
+	template<typename T>
+	static void put(uint8_t*& ptr, T value) {
+		memcpy(ptr, &value, sizeof(T));
+		ptr += sizeof(T);
+	}
+
+	template<typename T>
+	static bool get(const uint8_t*& ptr, const uint8_t* end, T& value) {
+		if (end - ptr < (int)sizeof(T)) {
+			return false;
+		}
+		memcpy(&value, ptr, sizeof(T));
+		ptr += sizeof(T);
+		return true;
+	}
+
+	static uint64_t createLinkId() {
+		static std::mutex mutex;
+		static std::mt19937_64 random(std::random_device{}());
+		std::unique_lock<std::mutex> lock(mutex);
+		uint64_t id = 0;
+		while (id == 0) {
+			id = random();
+		}
+		return id;
+	}
+
+	class ReliableUdpSocket::Link {
+	public:
+		class Fragment {
+		public:
+			std::shared_ptr<std::vector<uint8_t>> data;
+			uint16_t stream = 0;
+			uint64_t message = 0;
+			uint32_t offset = 0;
+			uint32_t size = 0;
+		};
+
+		class SentPacket {
+		public:
+			std::vector<Fragment> fragments;
+			bool fin = false;
+			Clock::time_point time;
+			int bytes = 0;
+		};
+
+		class SendStream {
+		public:
+			int priority = 0;
+			int weight = 1;
+			//advances by the sent bytes divided by the weight, like the streams of a Connection
+			double virtualTime = 0;
+			uint64_t nextMessage = 0;
+			std::deque<std::pair<uint64_t, std::shared_ptr<std::vector<uint8_t>>>> queue;
+			//sent bytes of the first message in the queue
+			uint32_t offset = 0;
+		};
+
+		class PartialMessage {
+		public:
+			std::vector<uint8_t> data;
+			//offsets of the received fragments, repeated fragments have the same offsets
+			std::set<uint32_t> offsets;
+			uint32_t received = 0;
+		};
+
+		class ReceiveStream {
+		public:
+			uint64_t nextMessage = 0;
+			std::map<uint64_t, PartialMessage> messages;
+		};
+
+		uint64_t id = 0;
+		Endpoint remote;
+		//sent by the listener, the syns echo it
+		uint64_t cookie = 0;
+		bool outbound = false;
+		bool connected = false;
+		//the socket was disconnected, the link delivers the written data and is removed
+		bool released = false;
+		bool writeClosed = false;
+		bool finSent = false;
+		bool readClosed = false;
+		ErrorCode error = ErrorCode::NO_ERROR;
+
+		int maxDatagramSize = 0;
+		int idleTimeoutMs = 0;
+		int sendBufferSize = 0;
+		int receiveBufferSize = 0;
+		int lingerMs = 0;
+		Clock::time_point connectDeadline;
+		Clock::time_point synTime;
+		Clock::time_point releaseTime;
+		Clock::time_point lastReceive;
+		Clock::time_point lastSend;
+		Clock::time_point lastDataSend;
+
+		//sending
+		std::map<uint16_t, SendStream> sendStreams;
+		double virtualClock = 0;
+		int unsentMessages = 0;
+		std::deque<Fragment> retransmits;
+		std::map<uint64_t, SentPacket> inflight;
+		uint64_t nextPacketNumber = 1;
+		uint64_t largestAcked = 0;
+		//written bytes that are not acknowledged
+		int64_t queuedBytes = 0;
+		int64_t bytesInFlight = 0;
+		double window = 0;
+		double threshold = 0;
+		//losses of packets up to this one belong to the last window reduction
+		uint64_t recoveryPacket = 0;
+		double pacingTokens = 0;
+		Clock::time_point pacingTime;
+		double smoothedRttUs = initialRttUs;
+		double rttVarianceUs = initialRttUs / 2;
+		double latestRttUs = initialRttUs;
+		double minRttUs = 0;
+		bool hasRtt = false;
+		int probeCount = 0;
+		int64_t retransmitCount = 0;
+		//packets of one flush, every packet has a slot of maxDatagramSize
+		std::vector<uint8_t> sendBuffer;
+		int sendSizes[maxBatchPackets] = {};
+		std::vector<Datagram> datagrams;
+		std::vector<uint8_t> ackBuffer;
+
+		//receiving, the ranges of received packet numbers are ascending
+		std::vector<std::pair<uint64_t, uint64_t>> received;
+		Clock::time_point largestReceivedTime;
+		int unackedPackets = 0;
+		Clock::time_point ackDeadline;
+		std::map<uint16_t, ReceiveStream> receiveStreams;
+		std::deque<std::vector<uint8_t>> readQueue;
+		size_t readOffset = 0;
+		int64_t readQueueBytes = 0;
+		//memory of partially received messages, it counts against the receive buffer like the read queue
+		int64_t partialBytes = 0;
+
+		std::mutex mutex;
+		//readers and writers wait for data, acks and errors
+		std::condition_variable condition;
+
+		//the driver runs at the tick while the link has timers pending
+		bool isBusy() {
+			if (!connected || error) {
+				return false;
+			}
+			return unsentMessages > 0 || !inflight.empty() || !retransmits.empty() || unackedPackets > 0 || ((released || writeClosed) && !finSent);
+		}
+	};
+
+	//owns the udp socket and the driver thread, that receives, runs the timers and sends what writers could not send right away
+	//lock order is the transport before a link
+	class ReliableUdpSocket::Transport {
+	public:
+		UdpSocket socket;
+		std::mutex mutex;
+		std::unordered_map<uint64_t, std::shared_ptr<Link>> links;
+		std::deque<std::shared_ptr<Link>> pendingAccepts;
+		std::condition_variable acceptCondition;
+		bool listening = false;
+		//the cookies are a hash of the secret, the link id and the endpoint, so the listener keeps no state for syns
+		uint64_t cookieSecret[4] = {};
+		//sockets that use the transport, the driver stops when there are none and all links are drained
+		int users = 0;
+		std::atomic<bool> sleeping = false;
+		//full packets of a flush are passed to the system as one datagram that it segments (gso), until that fails once
+		std::atomic<bool> segmentation = true;
+#if !WIN32
+		int wakePipe[2] = { -1, -1 };
+#endif
+
+		int maxDatagramSize = 0;
+		int connectTimeoutMs = 0;
+		int idleTimeoutMs = 0;
+		int sendBufferSize = 0;
+		int receiveBufferSize = 0;
+		int lingerMs = 0;
+		int maxLinks = 0;
+
+		~Transport();
+		void setup(const ReliableUdpSocket& settings);
+		void configure(Link& link, Clock::time_point now);
+		void start(const std::shared_ptr<Transport>& self);
+		void wake();
+		void run();
+
+		void onPacket(const Endpoint& endpoint, const uint8_t* data, int bytes, Clock::time_point now);
+		void onData(Link& link, uint8_t type, const uint8_t* ptr, const uint8_t* end, Clock::time_point now);
+		void onAck(Link& link, const uint8_t* ptr, const uint8_t* end, Clock::time_point now);
+		//returns true when the link can be removed
+		bool service(Link& link, Clock::time_point now);
+		void flush(Link& link, Clock::time_point now);
+		bool nextFragment(Link& link, Link::Fragment& fragment, int maxSize);
+		//writes the next packet into the buffer and returns its size, 0 when there is nothing to send
+		int buildPacket(Link& link, uint8_t* packet, Clock::time_point now);
+		void sendPackets(Link& link, int count);
+		//returns false when the fragment is refused, delivered is set when a message was completed
+		static bool onFragment(Link& link, uint16_t stream, uint64_t message, uint32_t size, uint32_t offset, const uint8_t* data, uint32_t bytes, bool& delivered);
+		void sendAck(Link& link, Clock::time_point now);
+		//a cookie of 0 is not sent
+		void sendControl(PacketType type, uint64_t id, const Endpoint& endpoint, uint64_t cookie = 0);
+		uint64_t createCookie(uint64_t id, const Endpoint& endpoint);
+		void detectLosses(Link& link, Clock::time_point now);
+		void onLoss(Link& link, uint64_t number, Link::SentPacket& packet, bool congestion);
+
+		static void updateRtt(Link& link, double sampleUs, double ackDelayUs);
+		static Clock::duration getProbeTimeout(Link& link);
+		//returns false for a duplicate
+		static bool recordPacket(Link& link, uint64_t number);
+		static void fail(Link& link, ErrorCode error);
+	};
+
+	ReliableUdpSocket::Transport::~Transport() {
+#if !WIN32
+		if (wakePipe[0] != -1) {
+			::close(wakePipe[0]);
+			::close(wakePipe[1]);
+		}
+#endif
+	}
+
+	void ReliableUdpSocket::Transport::setup(const ReliableUdpSocket& settings) {
+		maxDatagramSize = std::max(settings.maxDatagramSize, minDatagramSize);
+		connectTimeoutMs = settings.connectTimeoutMs;
+		idleTimeoutMs = settings.idleTimeoutMs;
+		sendBufferSize = settings.sendBufferSize;
+		receiveBufferSize = settings.receiveBufferSize;
+		lingerMs = settings.lingerMs;
+		maxLinks = settings.maxLinks;
+		//bursts of all links arrive at the one socket, the default buffers overflow long before the windows are full
+		int size = receiveBufferSize;
+		setsockopt(socket.getHandle(), SOL_SOCKET, SO_RCVBUF, (char*)&size, sizeof(size));
+		size = sendBufferSize;
+		setsockopt(socket.getHandle(), SOL_SOCKET, SO_SNDBUF, (char*)&size, sizeof(size));
+	}
+
+	void ReliableUdpSocket::Transport::configure(Link& link, Clock::time_point now) {
+		link.maxDatagramSize = maxDatagramSize;
+		link.idleTimeoutMs = idleTimeoutMs;
+		link.sendBufferSize = sendBufferSize;
+		link.receiveBufferSize = receiveBufferSize;
+		link.lingerMs = lingerMs;
+		link.window = (double)initialWindowPackets * maxDatagramSize;
+		link.threshold = std::numeric_limits<double>::max();
+		link.pacingTokens = link.window;
+		link.pacingTime = now;
+		link.lastReceive = now;
+		link.lastSend = now;
+		link.lastDataSend = now;
+		link.sendBuffer.resize((size_t)maxDatagramSize * maxBatchPackets);
+		link.ackBuffer.resize(packetHeaderSize + packetNumberSize + 4 + 1 + maxAckRanges * 16);
+	}
+
+	void ReliableUdpSocket::Transport::start(const std::shared_ptr<Transport>& self) {
+#if !WIN32
+		if (pipe(wakePipe) == 0) {
+			fcntl(wakePipe[0], F_SETFL, fcntl(wakePipe[0], F_GETFL, 0) | O_NONBLOCK);
+			fcntl(wakePipe[1], F_SETFL, fcntl(wakePipe[1], F_GETFL, 0) | O_NONBLOCK);
+		}
+		else {
+			wakePipe[0] = -1;
+			wakePipe[1] = -1;
+		}
+#endif
+		//the thread keeps the transport alive until the last link is drained
+		std::thread([self]() {
+			self->run();
+		}).detach();
+	}
+
+	void ReliableUdpSocket::Transport::wake() {
+#if !WIN32
+		if (sleeping.exchange(false) && wakePipe[1] != -1) {
+			uint8_t byte = 0;
+			if (::write(wakePipe[1], &byte, 1) < 0) {
+				return;
+			}
+		}
+#endif
+	}
+
+	void ReliableUdpSocket::Transport::run() {
+		DatagramBatch batch(32, std::max(maxDatagramSize, 2048));
+		std::vector<std::shared_ptr<Link>> active;
+		bool busy = true;
+		while (true) {
+			pollfd fds[2] = {};
+			fds[0].fd = socket.getHandle();
+			fds[0].events = POLLIN;
+#if WIN32
+			//without a wake up the driver stays at the tick
+			WSAPoll(fds, 1, tickMs);
+#else
+			int count = 1;
+			if (wakePipe[0] != -1) {
+				fds[1].fd = wakePipe[0];
+				fds[1].events = POLLIN;
+				count = 2;
+			}
+			poll(fds, count, busy ? tickMs : idleTickMs);
+			sleeping = false;
+			if (fds[1].revents & POLLIN) {
+				uint8_t drain[64];
+				while (::read(wakePipe[0], drain, sizeof(drain)) > 0) {}
+			}
+#endif
+			auto now = Clock::now();
+			if ((fds[0].revents & POLLIN) && !socket.readBatch(batch)) {
+				for (int i = 0; i < batch.count; i++) {
+					onPacket(batch.datagrams[i].endpoint, batch.datagrams[i].data, batch.datagrams[i].bytes, now);
+				}
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+			for (auto& entry : links) {
+				active.push_back(entry.second);
+			}
+			lock.unlock();
+
+			//writers that leave work for the driver wake it up from now on
+			sleeping = true;
+			busy = false;
+			for (auto& link : active) {
+				std::unique_lock<std::mutex> linkLock(link->mutex);
+				bool remove = service(*link, now);
+				busy |= link->isBusy();
+				linkLock.unlock();
+				if (remove) {
+					lock.lock();
+					links.erase(link->id);
+					lock.unlock();
+				}
+			}
+			active.clear();
+
+			lock.lock();
+			if (users == 0 && links.empty()) {
+				break;
+			}
+		}
+	}
+
+	void ReliableUdpSocket::Transport::onPacket(const Endpoint& endpoint, const uint8_t* data, int bytes, Clock::time_point now) {
+		const uint8_t* ptr = data;
+		const uint8_t* end = data + bytes;
+		uint8_t type = 0;
+		uint64_t id = 0;
+		if (!get(ptr, end, type) || !get(ptr, end, id)) {
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		std::shared_ptr<Link> link;
+		auto entry = links.find(id);
+		if (entry != links.end()) {
+			link = entry->second;
+		}
+		else if (type == PACKET_SYN && listening) {
+			//a link is only created once the remote echoed the cookie, so syns from spoofed sources do not create links
+			uint64_t cookie = 0;
+			uint64_t expected = createCookie(id, endpoint);
+			if (!get(ptr, end, cookie) || cookie != expected) {
+				lock.unlock();
+				sendControl(PACKET_COOKIE, id, endpoint, expected);
+				return;
+			}
+			if (pendingAccepts.size() >= maxPendingAccepts) {
+				return;
+			}
+			//a listener with too many links answers with a reset, so the connect fails right away
+			if ((int)links.size() < maxLinks) {
+				link = std::make_shared<Link>();
+				link->id = id;
+				link->remote = endpoint;
+				link->connected = true;
+				configure(*link, now);
+				links[id] = link;
+				pendingAccepts.push_back(link);
+				acceptCondition.notify_one();
+			}
+		}
+		lock.unlock();
+
+		if (!link) {
+			//the link is unknown, like after a restart, the remote fails right away instead of timing out
+			if (type != PACKET_RESET) {
+				sendControl(PACKET_RESET, id, endpoint);
+			}
+			return;
+		}
+
+		std::unique_lock<std::mutex> linkLock(link->mutex);
+		if (link->error) {
+			return;
+		}
+		link->lastReceive = now;
+		if (link->outbound && !link->connected && type != PACKET_RESET && type != PACKET_COOKIE) {
+			//any answer completes the handshake, the syn ack might have been lost
+			link->connected = true;
+			link->lastSend = now;
+			link->condition.notify_all();
+		}
+		switch (type) {
+		case PACKET_SYN:
+			if (!link->outbound) {
+				sendControl(PACKET_SYN_ACK, id, link->remote);
+			}
+			break;
+		case PACKET_DATA:
+		case PACKET_FIN:
+			onData(*link, type, ptr, end, now);
+			break;
+		case PACKET_ACK:
+			onAck(*link, ptr, end, now);
+			break;
+		case PACKET_RESET:
+			fail(*link, link->connected ? ErrorCode::DISCONNECTED : ErrorCode::CONNECTION_REFUSED);
+			break;
+		case PACKET_COOKIE:
+			if (link->outbound && !link->connected && get(ptr, end, link->cookie)) {
+				link->synTime = now;
+				sendControl(PACKET_SYN, id, link->remote, link->cookie);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	void ReliableUdpSocket::Transport::onData(Link& link, uint8_t type, const uint8_t* ptr, const uint8_t* end, Clock::time_point now) {
+		uint64_t number = 0;
+		if (!get(ptr, end, number)) {
+			return;
+		}
+		//the packet is dropped without an ack until the reader catches up
+		if (type == PACKET_DATA && !link.released && link.readQueueBytes >= link.receiveBufferSize) {
+			return;
+		}
+
+		//the fragments are stored before the packet is recorded, a packet with a refused fragment is dropped without an ack and the sender repeats it
+		//stored fragments are not stored again, so a repeated packet only adds the refused ones
+		if (type == PACKET_DATA && !link.released) {
+			bool delivered = false;
+			bool refused = false;
+			const uint8_t* fragment = ptr;
+			while (fragment < end) {
+				uint16_t stream = 0;
+				uint64_t message = 0;
+				uint32_t size = 0;
+				uint32_t offset = 0;
+				uint16_t bytes = 0;
+				if (!get(fragment, end, stream) || !get(fragment, end, message) || !get(fragment, end, size) || !get(fragment, end, offset) || !get(fragment, end, bytes)) {
+					break;
+				}
+				if (bytes > end - fragment || size > maxMessageSize || offset > size || bytes > size - offset) {
+					break;
+				}
+				if (!onFragment(link, stream, message, size, offset, fragment, bytes, delivered)) {
+					refused = true;
+				}
+				fragment += bytes;
+			}
+			if (delivered) {
+				link.condition.notify_all();
+			}
+			if (refused) {
+				return;
+			}
+		}
+
+		bool duplicate = !recordPacket(link, number);
+		auto& top = link.received.back();
+		//a gap below the packet is reported right away, so the sender detects the loss early
+		bool gap = number != top.second || (link.received.size() > 1 && top.first == number);
+		if (!duplicate && number == top.second) {
+			link.largestReceivedTime = now;
+		}
+		link.unackedPackets++;
+		if (duplicate || gap) {
+			sendAck(link, now);
+		}
+		else if (link.unackedPackets == 1) {
+			link.ackDeadline = now + std::chrono::milliseconds(ackDelayMs);
+		}
+		if (!duplicate && type == PACKET_FIN) {
+			link.readClosed = true;
+			link.condition.notify_all();
+		}
+	}
+
+	bool ReliableUdpSocket::Transport::onFragment(Link& link, uint16_t stream, uint64_t message, uint32_t size, uint32_t offset, const uint8_t* data, uint32_t bytes, bool& delivered) {
+		Link::ReceiveStream& receiveStream = link.receiveStreams[stream];
+		if (message < receiveStream.nextMessage) {
+			return true;
+		}
+		auto entry = receiveStream.messages.find(message);
+		if (entry == receiveStream.messages.end()) {
+			if (message - receiveStream.nextMessage > maxMessagesAhead) {
+				return false;
+			}
+			//the memory of a message is taken when it fits into the receive buffer
+			//the next message of a stream is also taken while few streams receive one, so messages larger than the buffer still get through
+			int64_t cost = (int64_t)size + partialMessageOverhead;
+			if (link.readQueueBytes + link.partialBytes + cost > link.receiveBufferSize) {
+				if (message != receiveStream.nextMessage) {
+					return false;
+				}
+				int receiving = 0;
+				for (auto& other : link.receiveStreams) {
+					if (!other.second.messages.empty() && other.second.messages.begin()->first == other.second.nextMessage) {
+						receiving++;
+					}
+				}
+				if (receiving >= maxLargeMessages) {
+					return false;
+				}
+			}
+			entry = receiveStream.messages.emplace(message, Link::PartialMessage()).first;
+			entry->second.data.resize(size);
+			link.partialBytes += cost;
+		}
+		Link::PartialMessage& partial = entry->second;
+		if (partial.data.size() != size || !partial.offsets.insert(offset).second) {
+			return true;
+		}
+		if (bytes > 0) {
+			memcpy(partial.data.data() + offset, data, bytes);
+		}
+		partial.received += bytes;
+
+		//complete messages are delivered in order, a missing one only holds back its own stream
+		while (true) {
+			auto next = receiveStream.messages.find(receiveStream.nextMessage);
+			if (next == receiveStream.messages.end() || next->second.offsets.empty() || next->second.received != next->second.data.size()) {
+				break;
+			}
+			link.partialBytes -= (int64_t)next->second.data.size() + partialMessageOverhead;
+			if (!next->second.data.empty()) {
+				link.readQueueBytes += next->second.data.size();
+				link.readQueue.push_back(std::move(next->second.data));
+			}
+			receiveStream.messages.erase(next);
+			receiveStream.nextMessage++;
+			delivered = true;
+		}
+		return true;
+	}
+
+	void ReliableUdpSocket::Transport::onAck(Link& link, const uint8_t* ptr, const uint8_t* end, Clock::time_point now) {
+		uint64_t largest = 0;
+		uint32_t ackDelayUs = 0;
+		uint8_t count = 0;
+		if (!get(ptr, end, largest) || !get(ptr, end, ackDelayUs) || !get(ptr, end, count)) {
+			return;
+		}
+		bool progress = false;
+		for (int i = 0; i < count; i++) {
+			uint64_t first = 0;
+			uint64_t last = 0;
+			if (!get(ptr, end, first) || !get(ptr, end, last) || first > last) {
+				break;
+			}
+			for (auto entry = link.inflight.lower_bound(first); entry != link.inflight.end() && entry->first <= last;) {
+				Link::SentPacket& sent = entry->second;
+				if (entry->first == largest) {
+					updateRtt(link, std::chrono::duration<double, std::micro>(now - sent.time).count(), ackDelayUs);
+				}
+				link.bytesInFlight -= sent.bytes;
+				for (auto& fragment : sent.fragments) {
+					link.queuedBytes -= fragment.size;
+				}
+				//slow start doubles the window every round trip, afterwards it grows by a packet per round trip
+				if (entry->first > link.recoveryPacket) {
+					if (link.window < link.threshold) {
+						link.window += sent.bytes;
+					}
+					else {
+						link.window += (double)link.maxDatagramSize * sent.bytes / link.window;
+					}
+				}
+				link.largestAcked = std::max(link.largestAcked, entry->first);
+				entry = link.inflight.erase(entry);
+				progress = true;
+			}
+		}
+		if (!progress) {
+			return;
+		}
+		link.probeCount = 0;
+		detectLosses(link, now);
+		flush(link, now);
+		link.condition.notify_all();
+	}
+
+	bool ReliableUdpSocket::Transport::service(Link& link, Clock::time_point now) {
+		if (link.error) {
+			return link.released;
+		}
+		if (!link.connected) {
+			if (now >= link.connectDeadline) {
+				fail(link, ErrorCode::TIME_OUT);
+				return link.released;
+			}
+			if (now - link.synTime >= std::chrono::milliseconds(synIntervalMs)) {
+				link.synTime = now;
+				sendControl(PACKET_SYN, link.id, link.remote, link.cookie);
+			}
+			return false;
+		}
+		if (now - link.lastReceive >= std::chrono::milliseconds(link.idleTimeoutMs)) {
+			fail(link, ErrorCode::TIME_OUT);
+			return link.released;
+		}
+
+		//the driver services the links after every batch of datagrams, so one ack covers the whole batch
+		if (link.unackedPackets >= 2 || (link.unackedPackets > 0 && now >= link.ackDeadline)) {
+			sendAck(link, now);
+		}
+		detectLosses(link, now);
+		if (!link.inflight.empty() && now >= link.lastDataSend + getProbeTimeout(link)) {
+			//nothing was acknowledged for a while, the oldest packet is sent again to get an ack
+			//when probes are lost as well the path is congested and the window starts over
+			auto oldest = link.inflight.begin();
+			onLoss(link, oldest->first, oldest->second, false);
+			link.inflight.erase(oldest);
+			if (link.probeCount > 0) {
+				link.recoveryPacket = link.nextPacketNumber - 1;
+				link.window = (double)minWindowPackets * link.maxDatagramSize;
+			}
+			link.probeCount++;
+			link.lastDataSend = now;
+		}
+		flush(link, now);
+
+		if (link.released) {
+			if (link.finSent && link.inflight.empty() && link.retransmits.empty()) {
+				return true;
+			}
+			if (now - link.releaseTime >= std::chrono::milliseconds(link.lingerMs)) {
+				sendControl(PACKET_RESET, link.id, link.remote);
+				return true;
+			}
+		}
+		else if (now - link.lastSend >= std::chrono::milliseconds(link.idleTimeoutMs / 4)) {
+			sendControl(PACKET_PING, link.id, link.remote);
+			link.lastSend = now;
+		}
+		return false;
+	}
+
+	void ReliableUdpSocket::Transport::flush(Link& link, Clock::time_point now) {
+		if (!link.connected || link.error) {
+			return;
+		}
+		//the window is spread over the round trip time, with some headroom so pacing does not hold back the window growth
+		double rate = link.window * 1.25 / std::max(link.smoothedRttUs, 1.0);
+		double elapsedUs = std::chrono::duration<double, std::micro>(now - link.pacingTime).count();
+		double burst = std::max((double)initialWindowPackets * link.maxDatagramSize, rate * tickMs * 2000);
+		link.pacingTime = now;
+		link.pacingTokens = std::min(burst, link.pacingTokens + rate * elapsedUs);
+
+		int count = 0;
+		while (link.pacingTokens > 0 && link.bytesInFlight + link.maxDatagramSize <= link.window) {
+			int bytes = buildPacket(link, link.sendBuffer.data() + (size_t)count * link.maxDatagramSize, now);
+			if (bytes == 0) {
+				break;
+			}
+			link.sendSizes[count++] = bytes;
+			if (count == maxBatchPackets) {
+				sendPackets(link, count);
+				count = 0;
+			}
+		}
+		if (count > 0) {
+			sendPackets(link, count);
+		}
+	}
+
+	bool ReliableUdpSocket::Transport::nextFragment(Link& link, Link::Fragment& fragment, int maxSize) {
+		Link::SendStream* next = nullptr;
+		uint16_t stream = 0;
+		for (auto& entry : link.sendStreams) {
+			Link::SendStream& candidate = entry.second;
+			if (candidate.queue.empty()) {
+				continue;
+			}
+			if (!next || candidate.priority < next->priority || (candidate.priority == next->priority && candidate.virtualTime < next->virtualTime)) {
+				next = &candidate;
+				stream = entry.first;
+			}
+		}
+		if (!next) {
+			return false;
+		}
+
+		auto& message = next->queue.front();
+		uint32_t size = (uint32_t)message.second->size();
+		fragment.data = message.second;
+		fragment.stream = stream;
+		fragment.message = message.first;
+		fragment.offset = next->offset;
+		fragment.size = std::min<uint32_t>(size - next->offset, maxSize);
+
+		next->virtualTime = std::max(next->virtualTime, link.virtualClock);
+		link.virtualClock = next->virtualTime;
+		next->virtualTime += (double)std::max<uint32_t>(fragment.size, 1) / next->weight;
+		next->offset += fragment.size;
+		if (next->offset >= size) {
+			next->queue.pop_front();
+			next->offset = 0;
+			link.unsentMessages--;
+		}
+		return true;
+	}
+
+	int ReliableUdpSocket::Transport::buildPacket(Link& link, uint8_t* packet, Clock::time_point now) {
+		Link::SentPacket sent;
+		uint8_t* ptr = packet + packetHeaderSize + packetNumberSize;
+		uint8_t* end = packet + link.maxDatagramSize;
+		//repeated fragments come first, then small messages share the packet
+		while (true) {
+			int space = (int)(end - ptr) - fragmentHeaderSize;
+			Link::Fragment fragment;
+			if (!link.retransmits.empty()) {
+				if ((int)link.retransmits.front().size > space) {
+					break;
+				}
+				fragment = link.retransmits.front();
+				link.retransmits.pop_front();
+			}
+			else if (space <= 0 || !nextFragment(link, fragment, space)) {
+				break;
+			}
+			put(ptr, fragment.stream);
+			put(ptr, fragment.message);
+			put(ptr, (uint32_t)fragment.data->size());
+			put(ptr, fragment.offset);
+			put(ptr, (uint16_t)fragment.size);
+			if (fragment.size > 0) {
+				memcpy(ptr, fragment.data->data() + fragment.offset, fragment.size);
+				ptr += fragment.size;
+			}
+			sent.fragments.push_back(std::move(fragment));
+		}
+
+		uint8_t type = PACKET_DATA;
+		if (sent.fragments.empty()) {
+			//the fin follows once all data is acknowledged
+			if (!(link.released || link.writeClosed) || link.finSent || !link.inflight.empty()) {
+				return 0;
+			}
+			type = PACKET_FIN;
+			sent.fin = true;
+			link.finSent = true;
+		}
+		uint64_t number = link.nextPacketNumber++;
+		uint8_t* header = packet;
+		put(header, type);
+		put(header, link.id);
+		put(header, number);
+
+		int bytes = (int)(ptr - packet);
+		sent.time = now;
+		sent.bytes = bytes;
+		link.inflight.emplace(number, std::move(sent));
+		link.bytesInFlight += bytes;
+		link.pacingTokens -= bytes;
+		link.lastSend = now;
+		link.lastDataSend = now;
+		return bytes;
+	}
+
+	void ReliableUdpSocket::Transport::sendPackets(Link& link, int count) {
+		//runs of full packets are sent as one datagram with their segment size, a shorter packet can end a run
+		link.datagrams.clear();
+		bool segment = segmentation;
+		for (int i = 0; i < count;) {
+			Datagram datagram;
+			datagram.data = link.sendBuffer.data() + (size_t)i * link.maxDatagramSize;
+			datagram.bytes = link.sendSizes[i];
+			datagram.endpoint = link.remote;
+			int next = i + 1;
+			while (segment && next < count && link.sendSizes[next - 1] == link.maxDatagramSize) {
+				datagram.bytes += link.sendSizes[next++];
+			}
+			if (next - i > 1) {
+				datagram.segmentSize = link.maxDatagramSize;
+			}
+			link.datagrams.push_back(datagram);
+			i = next;
+		}
+
+		int sent = 0;
+		ErrorCode error = socket.writeBatch(link.datagrams.data(), (int)link.datagrams.size(), sent);
+		if (error && sent < link.datagrams.size() && link.datagrams[sent].segmentSize > 0) {
+			//the system cannot segment, the rest is sent packet by packet
+			segmentation = false;
+			for (int i = sent; i < link.datagrams.size(); i++) {
+				Datagram& datagram = link.datagrams[i];
+				int size = datagram.segmentSize > 0 ? datagram.segmentSize : datagram.bytes;
+				for (int offset = 0; offset < datagram.bytes; offset += size) {
+					socket.write(datagram.data + offset, std::min(size, datagram.bytes - offset), link.remote);
+				}
+			}
+		}
+		//other failures are handled like lost packets
+	}
+
+	void ReliableUdpSocket::Transport::sendAck(Link& link, Clock::time_point now) {
+		if (link.received.empty()) {
+			return;
+		}
+		uint8_t* ptr = link.ackBuffer.data();
+		put(ptr, (uint8_t)PACKET_ACK);
+		put(ptr, link.id);
+		put(ptr, link.received.back().second);
+		put(ptr, (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - link.largestReceivedTime).count());
+		int count = std::min((int)link.received.size(), maxAckRanges);
+		put(ptr, (uint8_t)count);
+		for (int i = 0; i < count; i++) {
+			auto& range = link.received[link.received.size() - 1 - i];
+			put(ptr, range.first);
+			put(ptr, range.second);
+		}
+		socket.write(link.ackBuffer.data(), (int)(ptr - link.ackBuffer.data()), link.remote);
+		link.unackedPackets = 0;
+		link.lastSend = now;
+	}
+
+	void ReliableUdpSocket::Transport::sendControl(PacketType type, uint64_t id, const Endpoint& endpoint, uint64_t cookie) {
+		uint8_t packet[packetHeaderSize + sizeof(cookie)];
+		uint8_t* ptr = packet;
+		put(ptr, (uint8_t)type);
+		put(ptr, id);
+		if (cookie != 0) {
+			put(ptr, cookie);
+		}
+		socket.write(packet, (int)(ptr - packet), endpoint);
+	}
+
+	uint64_t ReliableUdpSocket::Transport::createCookie(uint64_t id, const Endpoint& endpoint) {
+		uint8_t data[sizeof(cookieSecret) + sizeof(id) + 16 + sizeof(uint16_t)];
+		uint8_t* ptr = data;
+		memcpy(ptr, cookieSecret, sizeof(cookieSecret));
+		ptr += sizeof(cookieSecret);
+		put(ptr, id);
+		ptr += endpoint.getAddressBytes(ptr);
+		put(ptr, endpoint.getPort());
+		Blob<256> hash = sha256(data, (int)(ptr - data));
+		uint64_t cookie = hash.words[0];
+		return cookie != 0 ? cookie : 1;
+	}
+
+	void ReliableUdpSocket::Transport::detectLosses(Link& link, Clock::time_point now) {
+		//a packet is lost when three later ones were acknowledged or when a later one was and it is older than an eighth more than the round trip time
+		double delayUs = std::max(std::max(link.smoothedRttUs, link.latestRttUs) * 9 / 8, tickMs * 1000.0);
+		auto deadline = now - std::chrono::microseconds((int64_t)delayUs);
+		for (auto entry = link.inflight.begin(); entry != link.inflight.end() && entry->first < link.largestAcked;) {
+			if (link.largestAcked - entry->first >= lossPacketThreshold || entry->second.time <= deadline) {
+				onLoss(link, entry->first, entry->second, true);
+				entry = link.inflight.erase(entry);
+			}
+			else {
+				entry++;
+			}
+		}
+	}
+
+	void ReliableUdpSocket::Transport::onLoss(Link& link, uint64_t number, Link::SentPacket& packet, bool congestion) {
+		link.bytesInFlight -= packet.bytes;
+		if (packet.fin) {
+			link.finSent = false;
+		}
+		for (auto& fragment : packet.fragments) {
+			link.retransmits.push_back(std::move(fragment));
+		}
+		link.retransmitCount++;
+		//the window is halved once for all losses of a round trip
+		if (congestion && number > link.recoveryPacket) {
+			link.recoveryPacket = link.nextPacketNumber - 1;
+			link.threshold = std::max(link.window / 2, (double)minWindowPackets * link.maxDatagramSize);
+			link.window = link.threshold;
+		}
+	}
+
+	void ReliableUdpSocket::Transport::updateRtt(Link& link, double sampleUs, double ackDelayUs) {
+		if (!link.hasRtt || sampleUs < link.minRttUs) {
+			link.minRttUs = sampleUs;
+		}
+		//the time the ack was held back by the receiver is not part of the path
+		if (sampleUs - ackDelayUs >= link.minRttUs) {
+			sampleUs -= ackDelayUs;
+		}
+		link.latestRttUs = sampleUs;
+		if (!link.hasRtt) {
+			link.smoothedRttUs = sampleUs;
+			link.rttVarianceUs = sampleUs / 2;
+			link.hasRtt = true;
+		}
+		else {
+			link.rttVarianceUs = link.rttVarianceUs * 3 / 4 + std::abs(link.smoothedRttUs - sampleUs) / 4;
+			link.smoothedRttUs = link.smoothedRttUs * 7 / 8 + sampleUs / 8;
+		}
+	}
+
+	Clock::duration ReliableUdpSocket::Transport::getProbeTimeout(Link& link) {
+		double timeoutUs = link.smoothedRttUs + std::max(link.rttVarianceUs * 4, tickMs * 1000.0) + ackDelayMs * 1000.0;
+		timeoutUs *= (double)(1 << std::min(link.probeCount, 6));
+		return std::chrono::microseconds((int64_t)timeoutUs);
+	}
+
+	bool ReliableUdpSocket::Transport::recordPacket(Link& link, uint64_t number) {
+		auto& ranges = link.received;
+		int i = (int)ranges.size() - 1;
+		while (i >= 0 && ranges[i].first > number) {
+			i--;
+		}
+		if (i >= 0 && number <= ranges[i].second) {
+			return false;
+		}
+		bool joinLower = i >= 0 && ranges[i].second + 1 == number;
+		bool joinUpper = i + 1 < ranges.size() && ranges[i + 1].first == number + 1;
+		if (joinLower && joinUpper) {
+			ranges[i].second = ranges[i + 1].second;
+			ranges.erase(ranges.begin() + (i + 1));
+		}
+		else if (joinLower) {
+			ranges[i].second = number;
+		}
+		else if (joinUpper) {
+			ranges[i + 1].first = number;
+		}
+		else {
+			ranges.insert(ranges.begin() + (i + 1), { number, number });
+		}
+		if (ranges.size() > maxReceivedRanges) {
+			ranges.erase(ranges.begin());
+		}
+		return true;
+	}
+
+	void ReliableUdpSocket::Transport::fail(Link& link, ErrorCode error) {
+		link.error = error;
+		link.condition.notify_all();
+	}
+
+	ReliableUdpSocket::ReliableUdpSocket() {}
+
+	ReliableUdpSocket::~ReliableUdpSocket() {
+		disconnect();
+	}
+
+	ErrorCode ReliableUdpSocket::connect(const Endpoint& ep) {
+		disconnect();
+		transport = nullptr;
+		link = nullptr;
+		endpoint = ep;
+		if (!endpoint.isValid()) {
+			return ErrorCode::INVALID_ENDPOINT;
+		}
+
+		transport = std::make_shared<Transport>();
+		ErrorCode error = transport->socket.create(endpoint.isIpv4());
+		if (error) {
+			transport = nullptr;
+			return error;
+		}
+		transport->setup(*this);
+		auto now = Clock::now();
+		link = std::make_shared<Link>();
+		link->id = createLinkId();
+		link->remote = endpoint;
+		link->outbound = true;
+		transport->configure(*link, now);
+		link->connectDeadline = now + std::chrono::milliseconds(connectTimeoutMs);
+		link->synTime = now;
+		transport->links[link->id] = link;
+		transport->users = 1;
+		transport->sendControl(PACKET_SYN, link->id, endpoint);
+		transport->start(transport);
+
+		std::unique_lock<std::mutex> lock(link->mutex);
+		link->condition.wait(lock, [&]() {
+			return link->connected || link->error;
+		});
+		error = link->error;
+		lock.unlock();
+		if (error) {
+			disconnect();
+		}
+		return error;
+	}
+
+	ErrorCode ReliableUdpSocket::connect(const std::vector<Endpoint>& endpoints, int timeoutMs, int attemptDelayMs) {
+		//attempts are not raced, every attempt needs a handshake of its own
+		ErrorCode error = endpoints.empty() ? ErrorCode::INVALID_ENDPOINT : ErrorCode::TIME_OUT;
+		int timeout = connectTimeoutMs;
+		connectTimeoutMs = timeoutMs;
+		for (auto& ep : endpoints) {
+			error = connect(ep);
+			if (!error) {
+				break;
+			}
+		}
+		connectTimeoutMs = timeout;
+		return error;
+	}
+
+	ErrorCode ReliableUdpSocket::listen(uint16_t port, bool prefereIpv4, bool reuseAddress, bool dualStacking) {
+		disconnect();
+		link = nullptr;
+		transport = std::make_shared<Transport>();
+		ErrorCode error = transport->socket.listen(port, prefereIpv4, reuseAddress, dualStacking);
+		if (error) {
+			transport = nullptr;
+			return error;
+		}
+		transport->setup(*this);
+		std::random_device device;
+		for (auto& word : transport->cookieSecret) {
+			word = ((uint64_t)device() << 32) | device();
+		}
+		transport->listening = true;
+		transport->users = 1;
+		transport->start(transport);
+		return ErrorCode::NO_ERROR;
+	}
+
+	std::shared_ptr<StreamSocket> ReliableUdpSocket::accept() {
+		std::shared_ptr<Transport> transport = this->transport;
+		if (!transport || link) {
+			return nullptr;
+		}
+		std::unique_lock<std::mutex> lock(transport->mutex);
+		transport->acceptCondition.wait(lock, [&]() {
+			return !transport->pendingAccepts.empty() || !transport->listening;
+		});
+		if (!transport->listening) {
+			return nullptr;
+		}
+		auto socket = std::make_shared<ReliableUdpSocket>();
+		socket->transport = transport;
+		socket->link = transport->pendingAccepts.front();
+		socket->endpoint = socket->link->remote;
+		socket->maxDatagramSize = transport->maxDatagramSize;
+		socket->connectTimeoutMs = transport->connectTimeoutMs;
+		socket->idleTimeoutMs = transport->idleTimeoutMs;
+		socket->sendBufferSize = transport->sendBufferSize;
+		socket->receiveBufferSize = transport->receiveBufferSize;
+		socket->lingerMs = transport->lingerMs;
+		socket->maxLinks = transport->maxLinks;
+		transport->pendingAccepts.pop_front();
+		transport->users++;
+		return socket;
+	}
+
+	bool ReliableUdpSocket::disconnect() {
+		if (!transport) {
+			return false;
+		}
+		auto now = Clock::now();
+		bool connected = false;
+		bool released = false;
+		if (link) {
+			std::unique_lock<std::mutex> lock(link->mutex);
+			connected = link->connected && !link->error;
+			if (!link->released) {
+				link->released = true;
+				link->releaseTime = now;
+				released = true;
+			}
+			link->condition.notify_all();
+		}
+		else {
+			std::unique_lock<std::mutex> lock(transport->mutex);
+			connected = transport->listening;
+			if (transport->listening) {
+				transport->listening = false;
+				//links that were never accepted are closed
+				for (auto& pending : transport->pendingAccepts) {
+					std::unique_lock<std::mutex> linkLock(pending->mutex);
+					pending->released = true;
+					pending->releaseTime = now;
+				}
+				transport->pendingAccepts.clear();
+				released = true;
+			}
+			transport->acceptCondition.notify_all();
+		}
+
+		//the transport and the link stay referenced, a reader on another thread might still use them
+		if (released) {
+			std::unique_lock<std::mutex> lock(transport->mutex);
+			transport->users--;
+			lock.unlock();
+			transport->wake();
+		}
+		return connected;
+	}
+
+	bool ReliableUdpSocket::shutdownWrite() {
+		if (!link) {
+			return false;
+		}
+		std::unique_lock<std::mutex> lock(link->mutex);
+		link->writeClosed = true;
+		transport->flush(*link, Clock::now());
+		lock.unlock();
+		transport->wake();
+		return true;
+	}
+
+	bool ReliableUdpSocket::isConnected() {
+		if (!link) {
+			return false;
+		}
+		std::unique_lock<std::mutex> lock(link->mutex);
+		return link->connected && !link->error && !link->released;
+	}
+
+	const Endpoint& ReliableUdpSocket::getEndpoint() {
+		return endpoint;
+	}
+
+	ErrorCode ReliableUdpSocket::setOptions(const SocketOptions& options) {
+		return ErrorCode::NO_ERROR;
+	}
+
+	ErrorCode ReliableUdpSocket::write(const void* data, int bytes) {
+		//larger writes are split into several messages, they keep their order on the stream
+		int count = 0;
+		do {
+			int size = std::min(bytes - count, (int)maxMessageSize);
+			ErrorCode error = writeMessage(0, 0, 1, (const uint8_t*)data + count, size, nullptr, 0);
+			if (error) {
+				return error;
+			}
+			count += size;
+		} while (count < bytes);
+		return ErrorCode::NO_ERROR;
+	}
+
+	ErrorCode ReliableUdpSocket::read(void* data, int& bytes) {
+		if (!link) {
+			return ErrorCode::DISCONNECTED;
+		}
+		std::unique_lock<std::mutex> lock(link->mutex);
+		link->condition.wait(lock, [&]() {
+			return !link->readQueue.empty() || link->readClosed || link->error || link->released;
+		});
+		if (link->released || link->readQueue.empty()) {
+			return link->error ? link->error : ErrorCode::DISCONNECTED;
+		}
+
+		int count = 0;
+		while (count < bytes && !link->readQueue.empty()) {
+			std::vector<uint8_t>& front = link->readQueue.front();
+			int size = (int)std::min<size_t>(bytes - count, front.size() - link->readOffset);
+			memcpy((uint8_t*)data + count, front.data() + link->readOffset, size);
+			count += size;
+			link->readOffset += size;
+			if (link->readOffset == front.size()) {
+				link->readQueue.pop_front();
+				link->readOffset = 0;
+			}
+		}
+		link->readQueueBytes -= count;
+		bytes = count;
+		bytesDown += count;
+		return ErrorCode::NO_ERROR;
+	}
+
+	ErrorCode ReliableUdpSocket::sendFile(int file, int64_t offset, int bytes) {
+#if WIN32
+		return ErrorCode::GENERAL_ERROR;
+#else
+		std::vector<uint8_t> data(bytes);
+		int count = 0;
+		bool pipe = false;
+		while (count < bytes) {
+			ssize_t code = pipe ? -1 : ::pread(file, data.data() + count, bytes - count, offset + count);
+			if (code < 0 && (pipe || errno == ESPIPE)) {
+				pipe = true;
+				code = ::read(file, data.data() + count, bytes - count);
+			}
+			if (code < 0 && errno == EINTR) {
+				continue;
+			}
+			if (code <= 0) {
+				return code == 0 ? ErrorCode::DISCONNECTED : getLastError();
+			}
+			count += (int)code;
+		}
+		return write(data.data(), bytes);
+#endif
+	}
+
+	bool ReliableUdpSocket::hasStreams() {
+		return true;
+	}
+
+	ErrorCode ReliableUdpSocket::writeMessage(uint16_t stream, int priority, int weight, const void* header, int headerSize, const void* payload, int payloadSize) {
+		if (!link) {
+			return ErrorCode::DISCONNECTED;
+		}
+		int64_t size = (int64_t)headerSize + payloadSize;
+		if (size > maxMessageSize) {
+			return ErrorCode::LIMIT_REACHED;
+		}
+		auto data = std::make_shared<std::vector<uint8_t>>(size);
+		if (headerSize > 0) {
+			memcpy(data->data(), header, headerSize);
+		}
+		if (payloadSize > 0) {
+			memcpy(data->data() + headerSize, payload, payloadSize);
+		}
+
+		std::unique_lock<std::mutex> lock(link->mutex);
+		link->condition.wait(lock, [&]() {
+			return link->queuedBytes < link->sendBufferSize || link->error || link->released;
+		});
+		if (link->error) {
+			return link->error;
+		}
+		if (link->released || link->writeClosed || !link->connected) {
+			return ErrorCode::DISCONNECTED;
+		}
+		Link::SendStream& entry = link->sendStreams[stream];
+		entry.priority = priority;
+		entry.weight = std::max(weight, 1);
+		entry.queue.push_back({ entry.nextMessage++, data });
+		link->unsentMessages++;
+		link->queuedBytes += size;
+		bytesUp += (int)size;
+		//an idle link sends right away, otherwise the driver sends with the next ack and packs small messages together
+		if (link->inflight.empty()) {
+			transport->flush(*link, Clock::now());
+		}
+		bool busy = link->isBusy();
+		lock.unlock();
+		if (busy) {
+			transport->wake();
+		}
+		return ErrorCode::NO_ERROR;
+	}
+
+	int ReliableUdpSocket::getRoundTripUs() {
+		if (!link) {
+			return 0;
+		}
+		std::unique_lock<std::mutex> lock(link->mutex);
+		return (int)link->smoothedRttUs;
+	}
+
+	int ReliableUdpSocket::getCongestionWindow() {
+		if (!link) {
+			return 0;
+		}
+		std::unique_lock<std::mutex> lock(link->mutex);
+		return (int)link->window;
+	}
+
+	int64_t ReliableUdpSocket::getRetransmits() {
+		if (!link) {
+			return 0;
+		}
+		std::unique_lock<std::mutex> lock(link->mutex);
+		return link->retransmitCount;
+	}
+
+}
@@ -0,0 +1,72 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#pragma once
+
+#include "StreamSocket.h"
+#include "UdpSocket.h"
+#include <memory>
+
+namespace net {
+
+	//reliable ordered transport over udp, it replaces the TcpSocket under a Connection
+	//every frame is a message of its stream, messages of different streams are delivered independently, so a lost datagram only delays its own stream
+	//losses are detected from selective acks, the rate follows a congestion window (new reno) and is paced over the round trip time
+	//all links of a listener share its udp port, links are told apart by a random id
+	//a listener only creates a link once the remote echoed the cookie of its first syn
+	class ReliableUdpSocket : public StreamSocket {
+	public:
+		//size of the datagrams, small enough to pass most paths unfragmented, both sides need the same or a smaller size
+		int maxDatagramSize = 1200;
+		int connectTimeoutMs = 5000;
+		//the link fails when nothing was received for this long, idle links send keep alives to prevent that
+		int idleTimeoutMs = 30000;
+		//writes block while this many written bytes are not acknowledged
+		int sendBufferSize = 4 * 1024 * 1024;
+		//datagrams are dropped without an ack while this many received bytes are not read, the sender repeats them later
+		int receiveBufferSize = 4 * 1024 * 1024;
+		//a disconnected link still delivers the written data for this long
+		int lingerMs = 2000;
+		//syns of new links are answered with a reset while the listener has this many links
+		int maxLinks = 1024;
+
+		ReliableUdpSocket();
+		~ReliableUdpSocket();
+
+		using StreamSocket::connect;
+		ErrorCode connect(const Endpoint& endpoint) override;
+		//tries the endpoints in order, each attempt fails after timeoutMs
+		ErrorCode connect(const std::vector<Endpoint>& endpoints, int timeoutMs, int attemptDelayMs = 250) override;
+		ErrorCode listen(uint16_t port, bool prefereIpv4 = false, bool reuseAddress = false, bool dualStacking = false) override;
+		std::shared_ptr<StreamSocket> accept() override;
+		bool disconnect() override;
+		bool shutdownWrite() override;
+
+		bool isConnected() override;
+		const Endpoint& getEndpoint() override;
+		//tcp options do not apply to the transport
+		ErrorCode setOptions(const SocketOptions& options) override;
+
+		//the data is one message on stream 0
+		ErrorCode write(const void* data, int bytes) override;
+		ErrorCode read(void* data, int& bytes) override;
+		//the file is read into memory and written as one message
+		ErrorCode sendFile(int file, int64_t offset, int bytes) override;
+		bool hasStreams() override;
+		ErrorCode writeMessage(uint16_t stream, int priority, int weight, const void* header, int headerSize, const void* payload, int payloadSize) override;
+
+		//state of the link, for diagnostics
+		int getRoundTripUs();
+		int getCongestionWindow();
+		int64_t getRetransmits();
+
+	private:
+		class Link;
+		class Transport;
+		std::shared_ptr<Transport> transport;
+		std::shared_ptr<Link> link;
+		Endpoint endpoint;
+	};
+
+}
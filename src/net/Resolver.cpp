@@ -0,0 +1,268 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include "Resolver.h"
+#include <cstring>
+
+#if WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#undef NO_ERROR
+#else
+#include<sys/socket.h>
+#include<sys/types.h>
+#include<netdb.h>
+#endif
+
+namespace net {
+
+	Resolver::Resolver() {}
+
+	Resolver::~Resolver() {
+		stop();
+	}
+
+	void Resolver::resolve(const std::string& host, uint16_t port, const Callback& callback, bool prefereIpv4) {
+		std::vector<Endpoint> endpoints;
+		if (getLiteral(host, port, endpoints)) {
+			callback(ErrorCode::NO_ERROR, endpoints);
+			return;
+		}
+
+		std::string key = getKey(host, prefereIpv4);
+		std::unique_lock<std::mutex> lock(mutex);
+		ErrorCode error;
+		if (lookup(key, port, error, endpoints)) {
+			lock.unlock();
+			callback(error, endpoints);
+			return;
+		}
+		if (stopping) {
+			lock.unlock();
+			callback(ErrorCode::DISCONNECTED, endpoints);
+			return;
+		}
+
+		//concurrent resolves of the same host share one query
+		auto entry = queries.find(key);
+		if (entry != queries.end()) {
+			entry->second.callbacks.push_back({ port, callback });
+			return;
+		}
+		Query& query = queries[key];
+		query.host = host;
+		query.prefereIpv4 = prefereIpv4;
+		query.callbacks.push_back({ port, callback });
+		queue.push_back(key);
+
+		if (idleWorkers == 0 && workers.size() < workerCount) {
+			workers.emplace_back([this]() {
+				runWorker();
+			});
+		}
+		else {
+			condition.notify_one();
+		}
+	}
+
+	ErrorCode Resolver::resolve(const std::string& host, uint16_t port, std::vector<Endpoint>& endpoints, bool prefereIpv4) {
+		if (getLiteral(host, port, endpoints)) {
+			return ErrorCode::NO_ERROR;
+		}
+
+		std::string key = getKey(host, prefereIpv4);
+		std::unique_lock<std::mutex> lock(mutex);
+		ErrorCode error;
+		if (lookup(key, port, error, endpoints)) {
+			return error;
+		}
+		lock.unlock();
+
+		error = query(host, prefereIpv4, endpoints);
+		lock.lock();
+		store(key, error, endpoints);
+		lock.unlock();
+
+		for (auto& ep : endpoints) {
+			ep.setPort(port);
+		}
+		return error;
+	}
+
+	bool Resolver::getCached(const std::string& host, uint16_t port, std::vector<Endpoint>& endpoints, bool prefereIpv4) {
+		if (getLiteral(host, port, endpoints)) {
+			return true;
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		ErrorCode error;
+		return lookup(getKey(host, prefereIpv4), port, error, endpoints) && !error;
+	}
+
+	void Resolver::clear() {
+		std::unique_lock<std::mutex> lock(mutex);
+		cache.clear();
+	}
+
+	void Resolver::stop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+		std::vector<std::thread> threads = std::move(workers);
+		workers.clear();
+		lock.unlock();
+		condition.notify_all();
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		lock.lock();
+		std::unordered_map<std::string, Query> canceled = std::move(queries);
+		queries.clear();
+		queue.clear();
+		idleWorkers = 0;
+		stopping = false;
+		lock.unlock();
+
+		std::vector<Endpoint> endpoints;
+		for (auto& query : canceled) {
+			for (auto& callback : query.second.callbacks) {
+				callback.second(ErrorCode::DISCONNECTED, endpoints);
+			}
+		}
+	}
+
+	Resolver& Resolver::getDefault() {
+		static Resolver resolver;
+		return resolver;
+	}
+
+	void Resolver::runWorker() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			while (queue.empty() && !stopping) {
+				idleWorkers++;
+				condition.wait(lock);
+				idleWorkers--;
+			}
+			if (stopping) {
+				break;
+			}
+			std::string key = queue.front();
+			queue.pop_front();
+			std::string host = queries[key].host;
+			bool prefereIpv4 = queries[key].prefereIpv4;
+			lock.unlock();
+
+			std::vector<Endpoint> endpoints;
+			ErrorCode error = query(host, prefereIpv4, endpoints);
+
+			lock.lock();
+			store(key, error, endpoints);
+			auto entry = queries.find(key);
+			if (entry == queries.end()) {
+				continue;
+			}
+			auto callbacks = std::move(entry->second.callbacks);
+			queries.erase(entry);
+			lock.unlock();
+
+			for (auto& callback : callbacks) {
+				std::vector<Endpoint> result = endpoints;
+				for (auto& ep : result) {
+					ep.setPort(callback.first);
+				}
+				callback.second(error, result);
+			}
+			lock.lock();
+		}
+	}
+
+	void Resolver::store(const std::string& key, ErrorCode error, std::vector<Endpoint>& endpoints) {
+		auto now = std::chrono::steady_clock::now();
+		if (cache.size() >= maxCacheEntries) {
+			for (auto entry = cache.begin(); entry != cache.end();) {
+				if (entry->second.expires <= now) {
+					entry = cache.erase(entry);
+				}
+				else {
+					entry++;
+				}
+			}
+			if (cache.size() >= maxCacheEntries) {
+				cache.erase(cache.begin());
+			}
+		}
+
+		Entry& entry = cache[key];
+		entry.endpoints = endpoints;
+		entry.error = error;
+		entry.expires = now + std::chrono::milliseconds(error ? negativeTtlMs : positiveTtlMs);
+	}
+
+	bool Resolver::lookup(const std::string& key, uint16_t port, ErrorCode& error, std::vector<Endpoint>& endpoints) {
+		auto entry = cache.find(key);
+		if (entry == cache.end()) {
+			return false;
+		}
+		if (entry->second.expires <= std::chrono::steady_clock::now()) {
+			cache.erase(entry);
+			return false;
+		}
+		error = entry->second.error;
+		endpoints = entry->second.endpoints;
+		for (auto& ep : endpoints) {
+			ep.setPort(port);
+		}
+		return true;
+	}
+
+	std::string Resolver::getKey(const std::string& host, bool prefereIpv4) {
+		return (prefereIpv4 ? "4:" : "6:") + host;
+	}
+
+	ErrorCode Resolver::query(const std::string& host, bool prefereIpv4, std::vector<Endpoint>& endpoints) {
+		std::vector<Endpoint> v4;
+		std::vector<Endpoint> v6;
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_socktype = SOCK_STREAM;
+		struct addrinfo* info;
+		if (getaddrinfo(host.c_str(), nullptr, &hints, &info) != 0) {
+			return ErrorCode::NOT_FOUND;
+		}
+		for (addrinfo* i = info; i != nullptr; i = i->ai_next) {
+			Endpoint ep;
+			if (i->ai_family == AF_INET) {
+				memcpy(ep.getHandle(), i->ai_addr, sizeof(sockaddr_in));
+				v4.push_back(ep);
+			}
+			else if (i->ai_family == AF_INET6) {
+				memcpy(ep.getHandle(), i->ai_addr, sizeof(sockaddr_in6));
+				v6.push_back(ep);
+			}
+		}
+		freeaddrinfo(info);
+
+		std::vector<Endpoint>& first = prefereIpv4 ? v4 : v6;
+		std::vector<Endpoint>& second = prefereIpv4 ? v6 : v4;
+		for (int i = 0; i < first.size() || i < second.size(); i++) {
+			if (i < first.size()) {
+				endpoints.push_back(first[i]);
+			}
+			if (i < second.size()) {
+				endpoints.push_back(second[i]);
+			}
+		}
+		return endpoints.empty() ? ErrorCode::NOT_FOUND : ErrorCode::NO_ERROR;
+	}
+
+	bool Resolver::getLiteral(const std::string& host, uint16_t port, std::vector<Endpoint>& endpoints) {
+		Endpoint ep(host, port, false);
+		if (ep.isValid()) {
+			endpoints.push_back(ep);
+			return true;
+		}
+		return false;
+	}
+
+}
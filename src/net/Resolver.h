@@ -0,0 +1,79 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#pragma once
+
+#include "Endpoint.h"
+#include "ErrorCode.h"
+#include <functional>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+
+namespace net {
+
+	//resolves host names on a worker pool, results and failures are cached per host name and family preference
+	class Resolver {
+	public:
+		int workerCount = 2;
+		//getaddrinfo does not report the ttl of the records, cached results expire after fixed times instead
+		int positiveTtlMs = 5 * 60 * 1000;
+		int negativeTtlMs = 10 * 1000;
+		int maxCacheEntries = 1024;
+
+		//endpoints are sorted by preference, ipv6 and ipv4 alternate
+		typedef std::function<void(ErrorCode error, std::vector<Endpoint>& endpoints)> Callback;
+
+		Resolver();
+		~Resolver();
+
+		//the callback is invoked on a worker thread, or before the function returns for literals and cached results
+		void resolve(const std::string& host, uint16_t port, const Callback& callback, bool prefereIpv4 = false);
+		//blocks the calling thread when the host is not cached
+		ErrorCode resolve(const std::string& host, uint16_t port, std::vector<Endpoint>& endpoints, bool prefereIpv4 = false);
+		//never blocks, returns false when the host is neither a literal nor cached
+		bool getCached(const std::string& host, uint16_t port, std::vector<Endpoint>& endpoints, bool prefereIpv4 = false);
+		void clear();
+		void stop();
+
+		static Resolver& getDefault();
+
+	private:
+		class Entry {
+		public:
+			std::vector<Endpoint> endpoints;
+			ErrorCode error = ErrorCode::NO_ERROR;
+			std::chrono::steady_clock::time_point expires;
+		};
+		class Query {
+		public:
+			std::string host;
+			bool prefereIpv4 = false;
+			//callbacks of all callers waiting for the same host
+			std::vector<std::pair<uint16_t, Callback>> callbacks;
+		};
+
+		std::unordered_map<std::string, Entry> cache;
+		std::unordered_map<std::string, Query> queries;
+		std::deque<std::string> queue;
+		std::vector<std::thread> workers;
+		int idleWorkers = 0;
+		bool stopping = false;
+		std::mutex mutex;
+		std::condition_variable condition;
+
+		void runWorker();
+		//mutex must be locked by the caller
+		void store(const std::string& key, ErrorCode error, std::vector<Endpoint>& endpoints);
+		//mutex must be locked by the caller
+		bool lookup(const std::string& key, uint16_t port, ErrorCode& error, std::vector<Endpoint>& endpoints);
+		static std::string getKey(const std::string& host, bool prefereIpv4);
+		static ErrorCode query(const std::string& host, bool prefereIpv4, std::vector<Endpoint>& endpoints);
+		static bool getLiteral(const std::string& host, uint16_t port, std::vector<Endpoint>& endpoints);
+	};
+
+}
@@ -3,6 +3,7 @@
 //
 
 #include "Server.h"
+#include "ReliableUdpSocket.h"
 
 namespace net {
 
@@ -14,7 +15,9 @@ namespace net {
 		disconnectCallback = nullptr;
 		connectCallback = nullptr;
 		errorCallback = nullptr;
+		chunkCallback = nullptr;
 		packetize = false;
+		socketOptions.noDelay = 1;
 	}
 
 	Server::Server(Server&& server) {
@@ -26,6 +29,9 @@ namespace net {
 		disconnectCallback = server.disconnectCallback;
 		connectCallback = server.connectCallback;
 		errorCallback = server.errorCallback;
+		chunkCallback = server.chunkCallback;
+		socketOptions = server.socketOptions;
+		transport = server.transport;
 
 		server.listener = nullptr;
 		server.thread = nullptr;
@@ -34,6 +40,7 @@ namespace net {
 		server.disconnectCallback = nullptr;
 		server.connectCallback = nullptr;
 		server.errorCallback = nullptr;
+		server.chunkCallback = nullptr;
 	}
 
 	Server::~Server() {
@@ -42,8 +49,9 @@ namespace net {
 
 	ErrorCode Server::listen(uint16_t port, bool prefereIpv4, bool reuseAddress, bool dualStacking) {
 		if (!listener) {
-			listener = std::make_shared<TcpSocket>();
+			listener = createSocket();
 		}
+		listener->setOptions(socketOptions);
 		ErrorCode error = listener->listen(port, prefereIpv4, reuseAddress, dualStacking);
 		if (error) {
 			if (errorCallback) {
@@ -80,6 +88,7 @@ namespace net {
 	}
 
 	bool Server::hasAnyConnection() {
+		std::unique_lock<std::mutex> lock(connectionsMutex);
 		for (auto& conn : connections) {
 			if (conn && conn->socket) {
 				if (conn->socket->isConnected()) {
@@ -91,6 +100,30 @@ namespace net {
 	}
 
 	void Server::close() {
+		std::unique_lock<std::mutex> connectLock(connectMutex);
+		stopConnectThreads = true;
+		while (pendingResolves > 0) {
+			connectCondition.wait(connectLock);
+		}
+		std::vector<std::thread> threads = std::move(connectThreads);
+		std::deque<PendingConnect> canceled = std::move(pendingConnects);
+		connectThreads.clear();
+		pendingConnects.clear();
+		connectLock.unlock();
+		connectCondition.notify_all();
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		for (auto& pending : canceled) {
+			if (pending.callback) {
+				pending.callback(nullptr, ErrorCode::DISCONNECTED);
+			}
+		}
+		connectLock.lock();
+		stopConnectThreads = false;
+		idleConnectThreads = 0;
+		connectLock.unlock();
+
 		if (listener) {
 			listener->disconnect();
 		}
@@ -101,14 +134,21 @@ namespace net {
 			thread = nullptr;
 		}
 
+		//connections are destroyed without holding the lock, their threads remove themselves on exit
+		std::unique_lock<std::mutex> lock(connectionsMutex);
 		auto tmp = connections;
+		auto tmpDisconnected = disconnectedConnections;
 		connections.clear();
-		tmp.clear();
 		disconnectedConnections.clear();
+		lock.unlock();
+		tmp.clear();
+		tmpDisconnected.clear();
 	}
 
 	ErrorCode Server::connectAsClient(const Endpoint& endpoint) {
 		std::shared_ptr<Connection> conn = std::make_shared<Connection>();
+		conn->socket = createSocket();
+		conn->socket->setOptions(socketOptions);
 		conn->errorCallback = errorCallback;
 		ErrorCode error = conn->connect(endpoint);
 		if (!error) {
@@ -119,6 +159,8 @@ namespace net {
 
 	ErrorCode Server::connectAsClient(const std::string& address, uint16_t port, bool resolve, bool prefereIpv4) {
 		std::shared_ptr<Connection> conn = std::make_shared<Connection>();
+		conn->socket = createSocket();
+		conn->socket->setOptions(socketOptions);
 		conn->errorCallback = errorCallback;
 		ErrorCode error = conn->connect(address, port, resolve, prefereIpv4);
 		if (!error) {
@@ -127,16 +169,102 @@ namespace net {
 		return error;
 	}
 
-	void Server::addConnection(std::shared_ptr<net::Connection> conn) {
+	void Server::connectAsClientAsync(const std::string& address, uint16_t port, const ConnectCallback& callback) {
+		std::unique_lock<std::mutex> lock(connectMutex);
+		pendingResolves++;
+		lock.unlock();
+
+		//host names are resolved before the connect is queued, so they do not occupy a connect slot
+		Endpoint::resolve(address, port, [this, callback](ErrorCode error, std::vector<Endpoint>& endpoints) {
+			std::unique_lock<std::mutex> lock(connectMutex);
+			pendingResolves--;
+			if (!error && stopConnectThreads) {
+				error = ErrorCode::DISCONNECTED;
+			}
+			if (error) {
+				lock.unlock();
+				connectCondition.notify_all();
+				if (callback) {
+					callback(nullptr, error);
+				}
+				return;
+			}
+
+			PendingConnect pending;
+			pending.endpoints = endpoints;
+			pending.callback = callback;
+			pendingConnects.push_back(pending);
+			if (idleConnectThreads == 0 && connectThreads.size() < maxPendingConnects) {
+				connectThreads.emplace_back([this]() {
+					runConnectThread();
+				});
+			}
+			lock.unlock();
+			connectCondition.notify_all();
+		});
+	}
+
+	std::shared_ptr<StreamSocket> Server::createSocket() {
+		if (transport == TRANSPORT_UDP) {
+			return std::make_shared<ReliableUdpSocket>();
+		}
+		return std::make_shared<TcpSocket>();
+	}
+
+	void Server::runConnectThread() {
+		std::unique_lock<std::mutex> lock(connectMutex);
+		while (true) {
+			while (pendingConnects.empty() && !stopConnectThreads) {
+				idleConnectThreads++;
+				connectCondition.wait(lock);
+				idleConnectThreads--;
+			}
+			if (stopConnectThreads) {
+				break;
+			}
+			PendingConnect pending = pendingConnects.front();
+			pendingConnects.pop_front();
+			lock.unlock();
+
+			std::shared_ptr<Connection> conn = std::make_shared<Connection>();
+			conn->socket = createSocket();
+			conn->socket->setOptions(socketOptions);
+			conn->errorCallback = errorCallback;
+			ErrorCode error = conn->connect(pending.endpoints, connectTimeoutMs, connectAttemptDelayMs);
+
+			lock.lock();
+			if (!error && stopConnectThreads) {
+				error = ErrorCode::DISCONNECTED;
+			}
+			lock.unlock();
+			if (error) {
+				if (pending.callback) {
+					pending.callback(nullptr, error);
+				}
+			}
+			else {
+				addConnection(conn, pending.callback);
+			}
+			lock.lock();
+		}
+	}
+
+	void Server::addConnection(std::shared_ptr<net::Connection> conn, const ConnectCallback& callback) {
+		std::unique_lock<std::mutex> lock(connectionsMutex);
+		auto tmpDisconnected = disconnectedConnections;
 		disconnectedConnections.clear();
+		lock.unlock();
+		tmpDisconnected.clear();
 
 		conn->packetize = packetize;
 		conn->readCallback = readCallback;
 		conn->errorCallback = errorCallback;
+		conn->chunkCallback = chunkCallback;
 		conn->disconnectCallback = [&](Connection* conn) {
 			if (disconnectCallback) {
 				disconnectCallback(conn);
 			}
+			std::unique_lock<std::mutex> lock(connectionsMutex);
 			for (int i = 0; i < connections.size(); i++) {
 				if (connections[i].get() == conn) {
 					disconnectedConnections.push_back(connections[i]);
@@ -146,10 +274,15 @@ namespace net {
 			}
 		};
 
+		lock.lock();
 		connections.push_back(conn);
+		lock.unlock();
 		if (connectCallback) {
 			connectCallback(conn.get());
 		}
+		if (callback) {
+			callback(conn.get(), ErrorCode::NO_ERROR);
+		}
 
 		conn->run();
 	}
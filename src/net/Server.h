@@ -5,6 +5,8 @@
 #pragma once
 
 #include "Connection.h"
+#include <deque>
+#include <condition_variable>
 
 namespace net {
 
@@ -12,11 +14,27 @@ namespace net {
 	public:
 		std::vector<std::shared_ptr<net::Connection>> connections;
 		bool packetize;
+		//asynchronous connects beyond this number are queued
+		int maxPendingConnects = 16;
+		int connectTimeoutMs = 5000;
+		//delay before racing the next address of a host
+		int connectAttemptDelayMs = 250;
+		//applied to the listener, accepted and outbound sockets, nagle is disabled by default
+		SocketOptions socketOptions;
+		//connections run over tcp or over the reliable udp transport, both sides have to use the same
+		enum Transport {
+			TRANSPORT_TCP,
+			TRANSPORT_UDP,
+		};
+		Transport transport = TRANSPORT_TCP;
 
 		std::function<void(Connection*, Buffer&)> readCallback;
 		std::function<void(Connection*)> disconnectCallback;
 		std::function<void(Connection*)> connectCallback;
 		std::function<void(Connection*, ErrorCode)> errorCallback;
+		std::function<void(Connection*, uint64_t messageId, int64_t offset, Buffer& chunk, bool last)> chunkCallback;
+		//called once an asynchronous connect finished, before the connection is read from, conn is nullptr on failure
+		typedef std::function<void(Connection* conn, ErrorCode error)> ConnectCallback;
 
 		Server();
 		Server(Server&& server);
@@ -30,14 +48,33 @@ namespace net {
 
 		ErrorCode connectAsClient(const Endpoint& endpoint);
 		ErrorCode connectAsClient(const std::string& address, uint16_t port, bool resolve = true, bool prefereIpv4 = false);
+		//connects on a worker thread, all addresses of the host are raced
+		void connectAsClientAsync(const std::string& address, uint16_t port, const ConnectCallback& callback = nullptr);
 
 	private:
-		std::shared_ptr<TcpSocket> listener;
+		std::shared_ptr<StreamSocket> listener;
 		std::thread* thread;
 		bool running;
 		std::vector<std::shared_ptr<net::Connection>> disconnectedConnections;
+		//connections are added and removed from the accept thread, connection threads and client connects
+		std::mutex connectionsMutex;
 
-		void addConnection(std::shared_ptr<net::Connection> conn);
+		class PendingConnect {
+		public:
+			std::vector<Endpoint> endpoints;
+			ConnectCallback callback;
+		};
+		std::deque<PendingConnect> pendingConnects;
+		std::vector<std::thread> connectThreads;
+		int idleConnectThreads = 0;
+		int pendingResolves = 0;
+		bool stopConnectThreads = false;
+		std::mutex connectMutex;
+		std::condition_variable connectCondition;
+
+		std::shared_ptr<StreamSocket> createSocket();
+		void addConnection(std::shared_ptr<net::Connection> conn, const ConnectCallback& callback = nullptr);
+		void runConnectThread();
 	};
 
 }
@@ -0,0 +1,35 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include "StreamSocket.h"
+
+namespace net {
+
+	StreamSocket::~StreamSocket() {}
+
+	ErrorCode StreamSocket::connect(const std::string& address, uint16_t port, bool resolve, bool prefereIpv4) {
+		return connect(Endpoint(address, port, resolve, prefereIpv4));
+	}
+
+	bool StreamSocket::enableZeroCopy() {
+		return false;
+	}
+
+	ErrorCode StreamSocket::writeZeroCopy(const void* data, int bytes) {
+		return write(data, bytes);
+	}
+
+	uint32_t StreamSocket::getZeroCopySequence() {
+		return 0;
+	}
+
+	uint32_t StreamSocket::getZeroCopyCompleted(int timeoutMs) {
+		return 0;
+	}
+
+	bool StreamSocket::isZeroCopyEffective() {
+		return false;
+	}
+
+}
@@ -0,0 +1,82 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#pragma once
+
+#include "Endpoint.h"
+#include "ErrorCode.h"
+#include <memory>
+#include <vector>
+#include <string>
+
+namespace net {
+
+	//options of a tcp socket, -1 and empty strings leave the system default
+	class SocketOptions {
+	public:
+		//sends small writes immediately instead of waiting for outstanding acks (nagle)
+		int noDelay = -1;
+		//holds back partial segments until the socket is uncorked, linux only
+		int cork = -1;
+		//acks immediately instead of delaying them, the kernel falls back to delayed acks after a while, linux only
+		int quickAck = -1;
+		int sendBufferSize = -1;
+		//set before connecting or listening to affect the window scale of the connection
+		int receiveBufferSize = -1;
+		int keepAlive = -1;
+		int keepAliveIdleSec = -1;
+		int keepAliveIntervalSec = -1;
+		int keepAliveCount = -1;
+		//the connection fails when written data stays unacknowledged for this long, linux only
+		int userTimeoutMs = -1;
+		//blocking reads poll the device queue for this long before sleeping, linux only
+		int busyPollUs = -1;
+		//writes block while more bytes than this are not sent yet, so data queues in the process where it can still be prioritized, linux only
+		int notSentLowat = -1;
+		//name of the congestion control algorithm, like cubic or bbr, linux only
+		std::string congestionControl;
+	};
+
+	//a reliable connection under a Connection, implemented by TcpSocket and ReliableUdpSocket
+	class StreamSocket {
+	public:
+		int bytesUp = 0;
+		int bytesDown = 0;
+
+		virtual ~StreamSocket();
+
+		virtual ErrorCode connect(const Endpoint& endpoint) = 0;
+		ErrorCode connect(const std::string& address, uint16_t port, bool resolve = true, bool prefereIpv4 = false);
+		//connects to the first endpoint that accepts, each attempt fails after timeoutMs
+		virtual ErrorCode connect(const std::vector<Endpoint>& endpoints, int timeoutMs, int attemptDelayMs = 250) = 0;
+		virtual ErrorCode listen(uint16_t port, bool prefereIpv4 = false, bool reuseAddress = false, bool dualStacking = false) = 0;
+		virtual std::shared_ptr<StreamSocket> accept() = 0;
+		virtual bool disconnect() = 0;
+		//stops sending, data that was already written is still delivered and reading continues
+		virtual bool shutdownWrite() = 0;
+
+		virtual bool isConnected() = 0;
+		virtual const Endpoint& getEndpoint() = 0;
+		//transports ignore the options that do not apply to them
+		virtual ErrorCode setOptions(const SocketOptions& options) = 0;
+
+		virtual ErrorCode write(const void* data, int bytes) = 0;
+		virtual ErrorCode read(void* data, int& bytes) = 0;
+		//sends bytes of a file or pipe, without copying them through user space where the transport supports it
+		virtual ErrorCode sendFile(int file, int64_t offset, int bytes) = 0;
+
+		//true when the transport carries independent streams, then frames are written whole with writeMessage
+		virtual bool hasStreams() = 0;
+		//writes header and payload as one message of a stream, the lower priority is sent first and the weight shares the rate within a priority
+		virtual ErrorCode writeMessage(uint16_t stream, int priority, int weight, const void* header, int headerSize, const void* payload, int payloadSize) = 0;
+
+		//transports without zero copy sends keep these, enableZeroCopy returns false and writeZeroCopy copies
+		virtual bool enableZeroCopy();
+		virtual ErrorCode writeZeroCopy(const void* data, int bytes);
+		virtual uint32_t getZeroCopySequence();
+		virtual uint32_t getZeroCopyCompleted(int timeoutMs = 0);
+		virtual bool isZeroCopyEffective();
+	};
+
+}
@@ -4,6 +4,8 @@
 
 #include "TcpSocket.h"
 #include <cstring>
+#include <chrono>
+#include <algorithm>
 
 #if WIN32
 #include <winsock2.h>
@@ -15,9 +17,42 @@
 #include<sys/types.h>
 #include<netdb.h>
 #include<arpa/inet.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<cerrno>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<sys/sendfile.h>
+#include<linux/errqueue.h>
 #endif
 
 namespace net {
+
+	static void setBlocking(int handle, bool blocking) {
+#if WIN32
+		u_long mode = blocking ? 0 : 1;
+		ioctlsocket(handle, FIONBIO, &mode);
+#else
+		int flags = fcntl(handle, F_GETFL, 0);
+		fcntl(handle, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
+	}
+
+	static void closeHandle(int handle) {
+#if WIN32
+		closesocket(handle);
+#else
+		::close(handle);
+#endif
+	}
+
+	static bool isConnectInProgress() {
+#if WIN32
+		return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+		return errno == EINPROGRESS;
+#endif
+	}
 	
 	TcpSocket::TcpSocket() {
 		handle = -1;
@@ -44,6 +79,7 @@ namespace net {
 			connected = false;
 			return getLastError();
 		}
+		applyOptions(handle, options);
 
 		int code = ::connect(handle, (sockaddr*)endpoint.getHandle(), sizeof(Endpoint));
 		if (code != 0) {
@@ -57,8 +93,129 @@ namespace net {
 		return ErrorCode::NO_ERROR;
 	}
 
-	ErrorCode TcpSocket::connect(const std::string& address, uint16_t port, bool resolve, bool prefereIpv4) {
-		return connect(Endpoint(address, port, resolve, prefereIpv4));
+	ErrorCode TcpSocket::connect(const std::vector<Endpoint>& endpoints, int timeoutMs, int attemptDelayMs) {
+		if (handle != -1) {
+			disconnect();
+		}
+		connected = false;
+
+		class Attempt {
+		public:
+			int handle;
+			int index;
+			std::chrono::steady_clock::time_point deadline;
+		};
+		std::vector<Attempt> attempts;
+		ErrorCode error = endpoints.empty() ? ErrorCode::INVALID_ENDPOINT : ErrorCode::TIME_OUT;
+		int next = 0;
+		int winner = -1;
+		auto nextStart = std::chrono::steady_clock::now();
+
+		while (winner == -1) {
+			auto now = std::chrono::steady_clock::now();
+
+			//start the next attempt when the delay passed or nothing else is in flight
+			if (next < endpoints.size() && (now >= nextStart || attempts.empty())) {
+				const Endpoint& ep = endpoints[next];
+				Attempt attempt;
+				attempt.index = next++;
+				attempt.deadline = now + std::chrono::milliseconds(timeoutMs);
+				nextStart = now + std::chrono::milliseconds(attemptDelayMs);
+				if (!ep.isValid()) {
+					error = ErrorCode::INVALID_ENDPOINT;
+					continue;
+				}
+				attempt.handle = (int)socket(ep.isIpv4() ? AF_INET : AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+				if (attempt.handle == -1) {
+					error = getLastError();
+					continue;
+				}
+				applyOptions(attempt.handle, options);
+				setBlocking(attempt.handle, false);
+				if (::connect(attempt.handle, (sockaddr*)ep.getHandle(), sizeof(Endpoint)) == 0) {
+					attempts.push_back(attempt);
+					winner = (int)attempts.size() - 1;
+					break;
+				}
+				if (!isConnectInProgress()) {
+					error = getLastError();
+					closeHandle(attempt.handle);
+					continue;
+				}
+				attempts.push_back(attempt);
+			}
+
+			for (int i = 0; i < attempts.size();) {
+				if (now >= attempts[i].deadline) {
+					closeHandle(attempts[i].handle);
+					attempts.erase(attempts.begin() + i);
+					error = ErrorCode::TIME_OUT;
+				}
+				else {
+					i++;
+				}
+			}
+			if (attempts.empty()) {
+				if (next >= endpoints.size()) {
+					break;
+				}
+				continue;
+			}
+
+			auto wakeup = attempts[0].deadline;
+			for (auto& attempt : attempts) {
+				wakeup = std::min(wakeup, attempt.deadline);
+			}
+			if (next < endpoints.size()) {
+				wakeup = std::min(wakeup, nextStart);
+			}
+			int waitMs = (int)std::chrono::duration_cast<std::chrono::milliseconds>(wakeup - now).count() + 1;
+
+			std::vector<pollfd> fds(attempts.size());
+			for (int i = 0; i < attempts.size(); i++) {
+				fds[i].fd = attempts[i].handle;
+				fds[i].events = POLLOUT;
+				fds[i].revents = 0;
+			}
+#if WIN32
+			WSAPoll(fds.data(), (ULONG)fds.size(), waitMs);
+#else
+			poll(fds.data(), fds.size(), waitMs);
+#endif
+
+			for (int i = (int)fds.size() - 1; i >= 0; i--) {
+				if (fds[i].revents == 0) {
+					continue;
+				}
+				int code = 0;
+				socklen_t size = sizeof(code);
+				getsockopt(attempts[i].handle, SOL_SOCKET, SO_ERROR, (char*)&code, &size);
+				if (code == 0 && (fds[i].revents & POLLOUT)) {
+					winner = i;
+					break;
+				}
+				error = code != 0 ? getErrorCodeFromInternal(code) : ErrorCode::CONNECTION_REFUSED;
+				closeHandle(attempts[i].handle);
+				attempts.erase(attempts.begin() + i);
+				nextStart = std::chrono::steady_clock::now();
+			}
+		}
+
+		//the losing attempts of the race are aborted
+		for (int i = 0; i < attempts.size(); i++) {
+			if (i != winner) {
+				closeHandle(attempts[i].handle);
+			}
+		}
+		if (winner == -1) {
+			return error;
+		}
+
+		handle = attempts[winner].handle;
+		endpoint = endpoints[attempts[winner].index];
+		setBlocking(handle, true);
+		connected = true;
+		return ErrorCode::NO_ERROR;
 	}
 
 	ErrorCode TcpSocket::listen(uint16_t port, bool prefereIpv4, bool reuseAddress, bool dualStacking) {
@@ -91,6 +248,8 @@ namespace net {
 			return getLastError();
 		}
 
+		applyOptions(handle, options);
+
 		if (reuseAddress) {
 			int flag = 1;
 			setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (char*)&flag, sizeof(flag));
@@ -121,7 +280,7 @@ namespace net {
 		return ErrorCode::NO_ERROR;
 	}
 
-	std::shared_ptr<TcpSocket> TcpSocket::accept() {
+	std::shared_ptr<StreamSocket> TcpSocket::accept() {
 		Endpoint ep;
 
 		socklen_t size = sizeof(Endpoint);
@@ -135,6 +294,8 @@ namespace net {
 		socket->handle = result;
 		socket->endpoint = ep;
 		socket->connected = true;
+		socket->options = options;
+		applyOptions(result, options);
 		return socket;
 	}
 
@@ -152,6 +313,14 @@ namespace net {
 		return status == 0;
 	}
 
+	bool TcpSocket::shutdownWrite() {
+#if WIN32
+		return shutdown(handle, SD_SEND) == 0;
+#else
+		return shutdown(handle, SHUT_WR) == 0;
+#endif
+	}
+
 	bool TcpSocket::isConnected() {
 		return connected;
 	}
@@ -160,6 +329,92 @@ namespace net {
 		return endpoint;
 	}
 
+	ErrorCode TcpSocket::setOptions(const SocketOptions& options) {
+		this->options = options;
+		if (handle == -1) {
+			return ErrorCode::NO_ERROR;
+		}
+		return applyOptions(handle, options);
+	}
+
+	ErrorCode TcpSocket::getOptions(SocketOptions& options) {
+		if (handle == -1) {
+			return ErrorCode::DISCONNECTED;
+		}
+		ErrorCode error = ErrorCode::NO_ERROR;
+		auto get = [&](int level, int name, int& value) {
+			int result = 0;
+			socklen_t size = sizeof(result);
+			if (getsockopt(handle, level, name, (char*)&result, &size) != 0) {
+				if (!error) {
+					error = getLastError();
+				}
+				return;
+			}
+			value = result;
+		};
+
+		get(IPPROTO_TCP, TCP_NODELAY, options.noDelay);
+		get(SOL_SOCKET, SO_SNDBUF, options.sendBufferSize);
+		get(SOL_SOCKET, SO_RCVBUF, options.receiveBufferSize);
+		get(SOL_SOCKET, SO_KEEPALIVE, options.keepAlive);
+#if !WIN32
+		get(IPPROTO_TCP, TCP_CORK, options.cork);
+		get(IPPROTO_TCP, TCP_QUICKACK, options.quickAck);
+		get(IPPROTO_TCP, TCP_KEEPIDLE, options.keepAliveIdleSec);
+		get(IPPROTO_TCP, TCP_KEEPINTVL, options.keepAliveIntervalSec);
+		get(IPPROTO_TCP, TCP_KEEPCNT, options.keepAliveCount);
+		get(IPPROTO_TCP, TCP_USER_TIMEOUT, options.userTimeoutMs);
+		get(SOL_SOCKET, SO_BUSY_POLL, options.busyPollUs);
+		get(IPPROTO_TCP, TCP_NOTSENT_LOWAT, options.notSentLowat);
+		char name[64] = {};
+		socklen_t size = sizeof(name) - 1;
+		if (getsockopt(handle, IPPROTO_TCP, TCP_CONGESTION, name, &size) == 0) {
+			options.congestionControl = name;
+		}
+#endif
+		return error;
+	}
+
+	ErrorCode TcpSocket::applyOptions(int handle, const SocketOptions& options) {
+		ErrorCode error = ErrorCode::NO_ERROR;
+		auto set = [&](int level, int name, int value) {
+			if (value < 0) {
+				return;
+			}
+			if (setsockopt(handle, level, name, (char*)&value, sizeof(value)) != 0 && !error) {
+				error = getLastError();
+			}
+		};
+
+		set(IPPROTO_TCP, TCP_NODELAY, options.noDelay);
+		set(SOL_SOCKET, SO_SNDBUF, options.sendBufferSize);
+		set(SOL_SOCKET, SO_RCVBUF, options.receiveBufferSize);
+		set(SOL_SOCKET, SO_KEEPALIVE, options.keepAlive);
+#if WIN32
+		bool unsupported = options.cork >= 0 || options.quickAck >= 0 || options.keepAliveIdleSec >= 0 || options.keepAliveIntervalSec >= 0
+			|| options.keepAliveCount >= 0 || options.userTimeoutMs >= 0 || options.busyPollUs >= 0 || options.notSentLowat >= 0 || !options.congestionControl.empty();
+		if (unsupported && !error) {
+			error = ErrorCode::GENERAL_ERROR;
+		}
+#else
+		set(IPPROTO_TCP, TCP_CORK, options.cork);
+		set(IPPROTO_TCP, TCP_QUICKACK, options.quickAck);
+		set(IPPROTO_TCP, TCP_KEEPIDLE, options.keepAliveIdleSec);
+		set(IPPROTO_TCP, TCP_KEEPINTVL, options.keepAliveIntervalSec);
+		set(IPPROTO_TCP, TCP_KEEPCNT, options.keepAliveCount);
+		set(IPPROTO_TCP, TCP_USER_TIMEOUT, options.userTimeoutMs);
+		set(SOL_SOCKET, SO_BUSY_POLL, options.busyPollUs);
+		set(IPPROTO_TCP, TCP_NOTSENT_LOWAT, options.notSentLowat);
+		if (!options.congestionControl.empty()) {
+			if (setsockopt(handle, IPPROTO_TCP, TCP_CONGESTION, options.congestionControl.c_str(), (socklen_t)options.congestionControl.size()) != 0 && !error) {
+				error = getLastError();
+			}
+		}
+#endif
+		return error;
+	}
+
 	ErrorCode TcpSocket::write(const void* data, int bytes) {
 		int code = ::send(handle, (char*)data, bytes, 0);
 		if (code < 0) {
@@ -184,6 +439,138 @@ namespace net {
 		return ErrorCode::NO_ERROR;
 	}
 
+	ErrorCode TcpSocket::sendFile(int file, int64_t offset, int bytes) {
+#if WIN32
+		return ErrorCode::GENERAL_ERROR;
+#else
+		off_t position = offset;
+		bool pipe = false;
+		while (bytes > 0) {
+			//sendfile needs a file that can be mapped, pipes are spliced instead
+			ssize_t code = pipe ? -1 : ::sendfile(handle, file, &position, bytes);
+			if (code < 0 && (pipe || errno == EINVAL || errno == ESPIPE || errno == ENOSYS)) {
+				pipe = true;
+				code = ::splice(file, nullptr, handle, nullptr, bytes, SPLICE_F_MOVE | SPLICE_F_MORE);
+			}
+			if (code < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				connected = false;
+				return getLastError();
+			}
+			if (code == 0) {
+				//the file ended before all bytes were sent
+				return ErrorCode::GENERAL_ERROR;
+			}
+			bytes -= (int)code;
+			bytesUp += (int)code;
+		}
+		return ErrorCode::NO_ERROR;
+#endif
+	}
+
+	bool TcpSocket::hasStreams() {
+		return false;
+	}
+
+	ErrorCode TcpSocket::writeMessage(uint16_t stream, int priority, int weight, const void* header, int headerSize, const void* payload, int payloadSize) {
+		ErrorCode error = write(header, headerSize);
+		if (!error && payloadSize > 0) {
+			error = write(payload, payloadSize);
+		}
+		return error;
+	}
+
+	bool TcpSocket::enableZeroCopy() {
+#if WIN32 || !defined(SO_ZEROCOPY)
+		return false;
+#else
+		if (!zeroCopy) {
+			int flag = 1;
+			zeroCopy = setsockopt(handle, SOL_SOCKET, SO_ZEROCOPY, &flag, sizeof(flag)) == 0;
+		}
+		return zeroCopy;
+#endif
+	}
+
+	ErrorCode TcpSocket::writeZeroCopy(const void* data, int bytes) {
+#if WIN32 || !defined(MSG_ZEROCOPY)
+		return write(data, bytes);
+#else
+		if (!zeroCopy) {
+			return write(data, bytes);
+		}
+		const char* ptr = (const char*)data;
+		while (bytes > 0) {
+			ssize_t code = ::send(handle, ptr, bytes, MSG_ZEROCOPY);
+			if (code < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				//the kernel limits the memory pinned for zero copy, the rest is copied
+				if (errno == ENOBUFS) {
+					return write(ptr, bytes);
+				}
+				connected = false;
+				return getLastError();
+			}
+			//every successful call is one notification id
+			zeroCopySequence++;
+			ptr += code;
+			bytes -= (int)code;
+			bytesUp += (int)code;
+		}
+		return ErrorCode::NO_ERROR;
+#endif
+	}
+
+	uint32_t TcpSocket::getZeroCopySequence() {
+		return zeroCopySequence;
+	}
+
+	uint32_t TcpSocket::getZeroCopyCompleted(int timeoutMs) {
+#if !WIN32 && defined(MSG_ZEROCOPY)
+		while (zeroCopyCompleted != zeroCopySequence) {
+			char control[128];
+			msghdr message = {};
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+			if (recvmsg(handle, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+				if (errno != EAGAIN || timeoutMs <= 0) {
+					break;
+				}
+				//notifications on the error queue are signaled as an error condition
+				pollfd fd = {};
+				fd.fd = handle;
+				if (poll(&fd, 1, timeoutMs) <= 0) {
+					break;
+				}
+				timeoutMs = 0;
+				continue;
+			}
+			for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+				sock_extended_err* error = (sock_extended_err*)CMSG_DATA(header);
+				if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+					continue;
+				}
+				//ids of the completed sends are the range from ee_info to ee_data
+				if ((int32_t)(error->ee_data + 1 - zeroCopyCompleted) > 0) {
+					zeroCopyCompleted = error->ee_data + 1;
+				}
+				if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+					zeroCopyEffective = false;
+				}
+			}
+		}
+#endif
+		return zeroCopyCompleted;
+	}
+
+	bool TcpSocket::isZeroCopyEffective() {
+		return zeroCopyEffective;
+	}
+
 	int TcpSocket::getHandle() {
 		return handle;
 	}
@@ -4,37 +4,65 @@
 
 #pragma once
 
-#include "Endpoint.h"
-#include "ErrorCode.h"
-#include <memory>
+#include "StreamSocket.h"
 
 namespace net {
 
-	class TcpSocket {
+	class TcpSocket : public StreamSocket {
 	public:
-		int bytesUp = 0;
-		int bytesDown = 0;
-
 		TcpSocket();
 		~TcpSocket();
 
-		ErrorCode connect(const Endpoint &endpoint);
-		ErrorCode connect(const std::string& address, uint16_t port, bool resolve = true, bool prefereIpv4 = false);
-		ErrorCode listen(uint16_t port, bool prefereIpv4 = false, bool reuseAddress = false, bool dualStacking = false);
-		std::shared_ptr<TcpSocket> accept();
-		bool disconnect();
+		using StreamSocket::connect;
+		ErrorCode connect(const Endpoint &endpoint) override;
+		//connects to the first endpoint that accepts, a new attempt is started every attemptDelayMs or when an attempt fails (happy eyeballs)
+		//each attempt fails after timeoutMs
+		ErrorCode connect(const std::vector<Endpoint>& endpoints, int timeoutMs, int attemptDelayMs = 250) override;
+		ErrorCode listen(uint16_t port, bool prefereIpv4 = false, bool reuseAddress = false, bool dualStacking = false) override;
+		std::shared_ptr<StreamSocket> accept() override;
+		bool disconnect() override;
+		bool shutdownWrite() override;
+
+		bool isConnected() override;
+		const Endpoint& getEndpoint() override;
+		//options are applied to the open socket and to the sockets of later connects, accepted sockets take the options of the listener
+		//all set options are applied, the error of the first one that failed is returned
+		ErrorCode setOptions(const SocketOptions& options) override;
+		//reads the options from the open socket
+		ErrorCode getOptions(SocketOptions& options);
 
-		bool isConnected();
-		const Endpoint& getEndpoint();
+		ErrorCode write(const void* data, int bytes) override;
+		ErrorCode read(void* data, int &bytes) override;
+		//sends bytes of a file or pipe without copying them through user space, linux only
+		ErrorCode sendFile(int file, int64_t offset, int bytes) override;
 
-		ErrorCode write(const void* data, int bytes);
-		ErrorCode read(void* data, int &bytes);
+		bool hasStreams() override;
+		//header and payload are written in sequence, the stream is ignored
+		ErrorCode writeMessage(uint16_t stream, int priority, int weight, const void* header, int headerSize, const void* payload, int payloadSize) override;
+
+		//enables MSG_ZEROCOPY sends, returns false when the system does not support them
+		bool enableZeroCopy() override;
+		//the memory must not change until getZeroCopyCompleted reaches getZeroCopySequence, falls back to a copying send without zero copy
+		ErrorCode writeZeroCopy(const void* data, int bytes) override;
+		//number of zero copy sends issued
+		uint32_t getZeroCopySequence() override;
+		//number of zero copy sends the kernel released, waits up to timeoutMs for a notification when sends are outstanding
+		uint32_t getZeroCopyCompleted(int timeoutMs = 0) override;
+		//false once the kernel reported that it copied the data anyway, like on loopback
+		bool isZeroCopyEffective() override;
 
 		int getHandle();
 	private:
 		Endpoint endpoint;
 		bool connected;
 		int handle;
+		SocketOptions options;
+		bool zeroCopy = false;
+		bool zeroCopyEffective = true;
+		uint32_t zeroCopySequence = 0;
+		uint32_t zeroCopyCompleted = 0;
+
+		static ErrorCode applyOptions(int handle, const SocketOptions& options);
 	};
 
 }
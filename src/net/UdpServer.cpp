@@ -0,0 +1,272 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include "UdpServer.h"
+#include <cstring>
+#include <algorithm>
+
+#if WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#undef NO_ERROR
+#else
+#include<poll.h>
+#endif
+
+namespace net {
+
+	//the server whose worker runs on this thread
+	static thread_local UdpServer* currentServer = nullptr;
+
+	size_t UdpServer::SourceKeyHash::operator()(const SourceKey& key) const {
+		uint64_t hash = 14695981039346656037ull;
+		for (uint8_t byte : key) {
+			hash = (hash ^ byte) * 1099511628211ull;
+		}
+		return (size_t)hash;
+	}
+
+	UdpServer::UdpServer() {
+		running = false;
+		readCallback = nullptr;
+		connectCallback = nullptr;
+		disconnectCallback = nullptr;
+		errorCallback = nullptr;
+	}
+
+	UdpServer::~UdpServer() {
+		close();
+	}
+
+	ErrorCode UdpServer::listen(uint16_t port, bool prefereIpv4, bool dualStacking) {
+		close();
+		int count = workerCount > 0 ? workerCount : std::max(1, (int)std::thread::hardware_concurrency());
+		for (int i = 0; i < count; i++) {
+			auto worker = std::make_shared<Worker>();
+			ErrorCode error = worker->socket.listen(port, prefereIpv4, false, dualStacking, count > 1);
+			if (error && i == 0 && count > 1) {
+				//without port sharing all sources are served by one worker
+				count = 1;
+				error = worker->socket.listen(port, prefereIpv4, false, dualStacking, false);
+			}
+			if (!error && gro) {
+				error = worker->socket.enableGro();
+			}
+			if (error) {
+				workers.clear();
+				if (errorCallback) {
+					errorCallback(nullptr, error);
+				}
+				return error;
+			}
+			workers.push_back(std::move(worker));
+		}
+		return ErrorCode::NO_ERROR;
+	}
+
+	void UdpServer::run() {
+		if (running || workers.empty()) {
+			return;
+		}
+		running = true;
+		for (int i = 0; i < workers.size(); i++) {
+			std::shared_ptr<Worker> worker = workers[i];
+			worker->running = true;
+			worker->detached = false;
+			worker->thread = new std::thread([this, worker, i]() {
+				runWorker(worker, i);
+			});
+		}
+	}
+
+	bool UdpServer::isRunning() {
+		return running;
+	}
+
+	void UdpServer::close() {
+		//a worker waits for no one, the close that is in progress joins it once its callback returned
+		bool onWorker = currentServer == this;
+		std::unique_lock<std::mutex> lock(closeMutex, std::defer_lock);
+		if (onWorker && !lock.try_lock()) {
+			running = false;
+			return;
+		}
+		if (!onWorker) {
+			lock.lock();
+		}
+		running = false;
+		for (auto& worker : workers) {
+			worker->running = false;
+		}
+		for (auto& worker : workers) {
+			if (worker->thread) {
+				//close can be called by a callback on a worker thread, a source of that worker is still in use
+				if (worker->thread->get_id() == std::this_thread::get_id()) {
+					worker->detached = true;
+					worker->thread->detach();
+					detachedWorkers.push_back(worker);
+				}
+				else {
+					worker->thread->join();
+				}
+				delete worker->thread;
+				worker->thread = nullptr;
+			}
+		}
+		for (auto& worker : workers) {
+			if (!worker->detached) {
+				expireSources(*worker, true);
+				worker->socket.close();
+			}
+		}
+		workers.clear();
+
+		if (onWorker) {
+			return;
+		}
+		for (auto& worker : detachedWorkers) {
+			while (!worker->finished) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		detachedWorkers.clear();
+	}
+
+	ErrorCode UdpServer::write(Source* source, Buffer& buffer) {
+		if (!source || source->worker >= workers.size()) {
+			return ErrorCode::DISCONNECTED;
+		}
+		ErrorCode error = workers[source->worker]->socket.write(buffer.data(), buffer.size(), source->endpoint);
+		if (error && errorCallback) {
+			errorCallback(source, error);
+		}
+		return error;
+	}
+
+	ErrorCode UdpServer::write(const Endpoint& endpoint, Buffer& buffer) {
+		if (workers.empty()) {
+			return ErrorCode::DISCONNECTED;
+		}
+		ErrorCode error = workers[0]->socket.write(buffer.data(), buffer.size(), endpoint);
+		if (error && errorCallback) {
+			errorCallback(nullptr, error);
+		}
+		return error;
+	}
+
+	int UdpServer::getSourceCount() {
+		int count = 0;
+		for (auto& worker : workers) {
+			std::unique_lock<std::mutex> lock(worker->mutex);
+			count += (int)worker->sources.size();
+		}
+		return count;
+	}
+
+	void UdpServer::runWorker(std::shared_ptr<Worker> worker, int index) {
+		currentServer = this;
+		DatagramBatch batch(batchSize, gro ? std::max(maxDatagramSize, 65535) : maxDatagramSize);
+		auto lastExpiry = std::chrono::steady_clock::now();
+		while (worker->running) {
+			pollfd fd = {};
+			fd.fd = worker->socket.getHandle();
+			fd.events = POLLIN;
+#if WIN32
+			int code = WSAPoll(&fd, 1, pollIntervalMs);
+#else
+			int code = poll(&fd, 1, pollIntervalMs);
+#endif
+			if (code > 0 && worker->running) {
+				ErrorCode error = worker->socket.readBatch(batch);
+				if (error) {
+					if (errorCallback) {
+						errorCallback(nullptr, error);
+					}
+				}
+				for (int i = 0; i < batch.count && worker->running; i++) {
+					Datagram& datagram = batch.datagrams[i];
+					//coalesced datagrams are split into their segments again
+					int segmentSize = datagram.segmentSize > 0 ? datagram.segmentSize : datagram.bytes;
+					int offset = 0;
+					do {
+						int bytes = std::min(segmentSize, datagram.bytes - offset);
+						onDatagram(*worker, index, datagram, datagram.data + offset, bytes);
+						offset += bytes;
+					} while (offset < datagram.bytes && worker->running);
+				}
+			}
+
+			auto now = std::chrono::steady_clock::now();
+			if (now - lastExpiry >= std::chrono::milliseconds(pollIntervalMs)) {
+				lastExpiry = now;
+				expireSources(*worker, false);
+			}
+		}
+
+		if (worker->detached) {
+			expireSources(*worker, true);
+			worker->socket.close();
+		}
+		worker->finished = true;
+	}
+
+	void UdpServer::onDatagram(Worker& worker, int index, Datagram& datagram, uint8_t* data, int bytes) {
+		SourceKey key = getKey(datagram.endpoint);
+		std::unique_lock<std::mutex> lock(worker.mutex);
+		auto entry = worker.sources.find(key);
+		bool added = entry == worker.sources.end();
+		if (added) {
+			entry = worker.sources.emplace(key, Source()).first;
+			entry->second.endpoint = datagram.endpoint;
+			entry->second.worker = index;
+		}
+		Source& source = entry->second;
+		source.lastRead = std::chrono::steady_clock::now();
+		source.datagrams++;
+		source.bytes += bytes;
+		lock.unlock();
+
+		//sources are only removed by this thread, so the pointer stays valid during the callbacks
+		if (added && connectCallback) {
+			connectCallback(&source);
+		}
+		if (readCallback && worker.running) {
+			Buffer buffer(data, bytes);
+			readCallback(&source, buffer);
+		}
+	}
+
+	void UdpServer::expireSources(Worker& worker, bool all) {
+		auto deadline = std::chrono::steady_clock::now() - std::chrono::milliseconds(idleTimeoutMs);
+		std::vector<decltype(worker.sources)::node_type> expired;
+		std::unique_lock<std::mutex> lock(worker.mutex);
+		for (auto entry = worker.sources.begin(); entry != worker.sources.end();) {
+			auto next = std::next(entry);
+			if (all || entry->second.lastRead <= deadline) {
+				expired.push_back(worker.sources.extract(entry));
+			}
+			entry = next;
+		}
+		lock.unlock();
+
+		//callbacks are invoked without the lock, so they can count the sources
+		if (disconnectCallback) {
+			for (auto& node : expired) {
+				disconnectCallback(&node.mapped());
+			}
+		}
+	}
+
+	UdpServer::SourceKey UdpServer::getKey(const Endpoint& endpoint) {
+		SourceKey key = {};
+		uint8_t address[16] = {};
+		int size = endpoint.getAddressBytes(address);
+		uint16_t port = endpoint.getPort();
+		memcpy(key.data(), address, sizeof(address));
+		memcpy(key.data() + sizeof(address), &port, sizeof(port));
+		key[sizeof(address) + sizeof(port)] = (uint8_t)size;
+		return key;
+	}
+
+}
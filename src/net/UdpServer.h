@@ -0,0 +1,109 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#pragma once
+
+#include "UdpSocket.h"
+#include "util/Buffer.h"
+#include <thread>
+#include <functional>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <unordered_map>
+#include <array>
+#include <atomic>
+
+namespace net {
+
+	//datagram server, every worker thread has its own socket on the port (SO_REUSEPORT)
+	//the system sends all datagrams of a source to the same worker, so the state of a source is only used by one thread
+	class UdpServer {
+	public:
+		//a remote endpoint that sent datagrams, it is forgotten after it was idle for idleTimeoutMs
+		class Source {
+		public:
+			Endpoint endpoint;
+			std::chrono::steady_clock::time_point lastRead;
+			int64_t datagrams = 0;
+			int64_t bytes = 0;
+			//free for the application, like the session of the source
+			std::shared_ptr<void> userData;
+		private:
+			friend class UdpServer;
+			int worker = 0;
+		};
+
+		//0 uses one worker per hardware thread
+		int workerCount = 0;
+		int idleTimeoutMs = 30000;
+		//datagrams received with one system call
+		int batchSize = 64;
+		int maxDatagramSize = 2048;
+		//receives coalesced datagrams (gro), they are still passed to readCallback one by one
+		bool gro = false;
+
+		std::function<void(Source*, Buffer&)> readCallback;
+		//the first datagram of a new source
+		std::function<void(Source*)> connectCallback;
+		//the source was idle for idleTimeoutMs or the server is closed
+		//a source is only valid until this callback returned, other threads should keep a copy of its endpoint instead of the pointer
+		std::function<void(Source*)> disconnectCallback;
+		//source is nullptr for errors of the sockets
+		std::function<void(Source*, ErrorCode)> errorCallback;
+
+		UdpServer();
+		~UdpServer();
+
+		ErrorCode listen(uint16_t port, bool prefereIpv4 = false, bool dualStacking = false);
+		void run();
+		bool isRunning();
+		//can be called from a callback, the worker of the calling thread then disconnects its sources after the callback returned
+		//the server must not be destroyed from its own callbacks
+		void close();
+
+		//replies are written over the socket that receives from the source
+		//only for the thread of the callback that passed the source, it can expire at any time on other threads, use write(source->endpoint) there
+		ErrorCode write(Source* source, Buffer& buffer);
+		ErrorCode write(const Endpoint& endpoint, Buffer& buffer);
+		int getSourceCount();
+
+	private:
+		//address, port and address length
+		typedef std::array<uint8_t, 19> SourceKey;
+		class SourceKeyHash {
+		public:
+			size_t operator()(const SourceKey& key) const;
+		};
+
+		class Worker {
+		public:
+			UdpSocket socket;
+			std::thread* thread = nullptr;
+			//set by close, the worker stops and a worker that closed the server from its own callback cleans up after itself
+			std::atomic<bool> running = false;
+			std::atomic<bool> detached = false;
+			std::atomic<bool> finished = false;
+			std::unordered_map<SourceKey, Source, SourceKeyHash> sources;
+			//the sources are changed by the worker and counted by other threads
+			std::mutex mutex;
+		};
+
+		//the thread of a worker holds a reference, so a worker that is closed from its own callback stays valid until it returned
+		std::vector<std::shared_ptr<Worker>> workers;
+		//workers that were closed from their own callback and did not finish yet, the server has to outlive them
+		std::vector<std::shared_ptr<Worker>> detachedWorkers;
+		//close is called by the owner and by callbacks on the worker threads
+		std::mutex closeMutex;
+		bool running;
+		//workers wake up in this interval to expire idle sources and to notice a close
+		static constexpr int pollIntervalMs = 100;
+
+		void runWorker(std::shared_ptr<Worker> worker, int index);
+		void onDatagram(Worker& worker, int index, Datagram& datagram, uint8_t* data, int bytes);
+		void expireSources(Worker& worker, bool all);
+		static SourceKey getKey(const Endpoint& endpoint);
+	};
+
+}
@@ -15,10 +15,29 @@
 #include<sys/types.h>
 #include<netdb.h>
 #include<arpa/inet.h>
+#include<netinet/in.h>
+#include<netinet/udp.h>
 #endif
 
 namespace net {
 
+	DatagramBatch::DatagramBatch(int capacity, int maxDatagramSize) {
+		this->maxDatagramSize = maxDatagramSize;
+		memory.resize((size_t)capacity * maxDatagramSize);
+		datagrams.resize(capacity);
+		for (int i = 0; i < capacity; i++) {
+			datagrams[i].data = memory.data() + (size_t)i * maxDatagramSize;
+		}
+	}
+
+	int DatagramBatch::getCapacity() {
+		return (int)datagrams.size();
+	}
+
+	int DatagramBatch::getMaxDatagramSize() {
+		return maxDatagramSize;
+	}
+
 	UdpSocket::UdpSocket() {
 		handle = -1;
 	}
@@ -35,7 +54,7 @@ namespace net {
 		return ErrorCode::NO_ERROR;
 	}
 
-	ErrorCode UdpSocket::listen(uint16_t port, bool prefereIpv4, bool reuseAddress, bool dualStacking) {
+	ErrorCode UdpSocket::listen(uint16_t port, bool prefereIpv4, bool reuseAddress, bool dualStacking, bool reusePort) {
 		struct sockaddr_in6 addr6;
 		struct sockaddr_in& addr4 = *(sockaddr_in*)&addr6;
 		memset(&addr6, 0, sizeof(addr6));
@@ -74,6 +93,20 @@ namespace net {
 			setsockopt(handle, IPPROTO_IPV6, IPV6_V6ONLY, (char*)&flag, sizeof(flag));
 		}
 
+		if (reusePort) {
+#if WIN32
+			close();
+			return ErrorCode::GENERAL_ERROR;
+#else
+			int flag = 1;
+			if (setsockopt(handle, SOL_SOCKET, SO_REUSEPORT, (char*)&flag, sizeof(flag)) != 0) {
+				ErrorCode error = getLastError();
+				close();
+				return error;
+			}
+#endif
+		}
+
 		int code = ::bind(handle, (sockaddr*)&addr6, sizeof(addr6));
 		if (code != 0) {
 			ErrorCode error = getLastError();
@@ -85,19 +118,18 @@ namespace net {
 	}
 
 	void UdpSocket::close() {
-#if WIN32
-		int status = shutdown(handle, SD_BOTH);
-		if (status == 0) {
-			status = closesocket(handle);
-			handle = -1;
+		if (handle == -1) {
+			return;
 		}
+		//shutdown fails for unconnected datagram sockets, but still wakes up blocked reads
+#if WIN32
+		shutdown(handle, SD_BOTH);
+		closesocket(handle);
 #else
-		int status = shutdown(handle, SHUT_RDWR);
-		if (status == 0) {
-			status = ::close(handle);
-			handle = -1;
-		}
+		shutdown(handle, SHUT_RDWR);
+		::close(handle);
 #endif
+		handle = -1;
 	}
 
 	ErrorCode UdpSocket::write(const void* data, int bytes, const Endpoint& endpoint) {
@@ -117,4 +149,126 @@ namespace net {
 		return ErrorCode::NO_ERROR;
 	}
 
+	ErrorCode UdpSocket::readBatch(DatagramBatch& batch) {
+		batch.count = 0;
+#if WIN32
+		int bytes = batch.getMaxDatagramSize();
+		Datagram& datagram = batch.datagrams[0];
+		ErrorCode error = read(datagram.data, bytes, datagram.endpoint);
+		if (error) {
+			return error;
+		}
+		datagram.bytes = bytes;
+		datagram.segmentSize = 0;
+		batch.count = 1;
+		return ErrorCode::NO_ERROR;
+#else
+		int capacity = batch.getCapacity();
+		size_t controlSize = CMSG_SPACE(sizeof(int));
+		batch.headers.resize(capacity * (sizeof(mmsghdr) + sizeof(iovec) + controlSize));
+		mmsghdr* messages = (mmsghdr*)batch.headers.data();
+		iovec* vectors = (iovec*)(messages + capacity);
+		uint8_t* control = (uint8_t*)(vectors + capacity);
+		for (int i = 0; i < capacity; i++) {
+			Datagram& datagram = batch.datagrams[i];
+			vectors[i].iov_base = datagram.data;
+			vectors[i].iov_len = batch.getMaxDatagramSize();
+			msghdr& header = messages[i].msg_hdr;
+			header = {};
+			header.msg_name = datagram.endpoint.getHandle();
+			header.msg_namelen = sizeof(Endpoint);
+			header.msg_iov = &vectors[i];
+			header.msg_iovlen = 1;
+			header.msg_control = control + i * controlSize;
+			header.msg_controllen = controlSize;
+		}
+
+		//blocks for the first datagram only
+		int count = recvmmsg(handle, messages, capacity, MSG_WAITFORONE, nullptr);
+		if (count <= 0) {
+			return getLastError();
+		}
+		for (int i = 0; i < count; i++) {
+			Datagram& datagram = batch.datagrams[i];
+			datagram.bytes = (int)messages[i].msg_len;
+			datagram.segmentSize = 0;
+			msghdr& header = messages[i].msg_hdr;
+			for (cmsghdr* entry = CMSG_FIRSTHDR(&header); entry; entry = CMSG_NXTHDR(&header, entry)) {
+				if (entry->cmsg_level == SOL_UDP && entry->cmsg_type == UDP_GRO) {
+					memcpy(&datagram.segmentSize, CMSG_DATA(entry), sizeof(int));
+				}
+			}
+		}
+		batch.count = count;
+		return ErrorCode::NO_ERROR;
+#endif
+	}
+
+	ErrorCode UdpSocket::writeBatch(const Datagram* datagrams, int count, int& sent) {
+		sent = 0;
+#if WIN32
+		for (; sent < count; sent++) {
+			if (datagrams[sent].segmentSize > 0) {
+				return ErrorCode::GENERAL_ERROR;
+			}
+			ErrorCode error = write(datagrams[sent].data, datagrams[sent].bytes, datagrams[sent].endpoint);
+			if (error) {
+				return error;
+			}
+		}
+		return ErrorCode::NO_ERROR;
+#else
+		std::vector<mmsghdr> messages(count);
+		std::vector<iovec> vectors(count);
+		std::vector<uint8_t> control((size_t)count * CMSG_SPACE(sizeof(uint16_t)));
+		for (int i = 0; i < count; i++) {
+			const Datagram& datagram = datagrams[i];
+			vectors[i].iov_base = datagram.data;
+			vectors[i].iov_len = datagram.bytes;
+			msghdr& header = messages[i].msg_hdr;
+			header = {};
+			header.msg_name = (void*)datagram.endpoint.getHandle();
+			header.msg_namelen = sizeof(Endpoint);
+			header.msg_iov = &vectors[i];
+			header.msg_iovlen = 1;
+			if (datagram.segmentSize > 0) {
+				header.msg_control = control.data() + (size_t)i * CMSG_SPACE(sizeof(uint16_t));
+				header.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+				cmsghdr* entry = CMSG_FIRSTHDR(&header);
+				entry->cmsg_level = SOL_UDP;
+				entry->cmsg_type = UDP_SEGMENT;
+				entry->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				uint16_t segmentSize = (uint16_t)datagram.segmentSize;
+				memcpy(CMSG_DATA(entry), &segmentSize, sizeof(segmentSize));
+			}
+		}
+
+		//a partial send returns the number of datagrams that were sent, the error of the next one is reported on the next call
+		while (sent < count) {
+			int code = sendmmsg(handle, messages.data() + sent, count - sent, 0);
+			if (code <= 0) {
+				return getLastError();
+			}
+			sent += code;
+		}
+		return ErrorCode::NO_ERROR;
+#endif
+	}
+
+	ErrorCode UdpSocket::enableGro() {
+#if WIN32
+		return ErrorCode::GENERAL_ERROR;
+#else
+		int flag = 1;
+		if (setsockopt(handle, SOL_UDP, UDP_GRO, &flag, sizeof(flag)) != 0) {
+			return getLastError();
+		}
+		return ErrorCode::NO_ERROR;
+#endif
+	}
+
+	int UdpSocket::getHandle() {
+		return handle;
+	}
+
 }
@@ -6,21 +6,64 @@
 
 #include "Endpoint.h"
 #include "ErrorCode.h"
+#include <vector>
+#include <cstdint>
 
 namespace net {
 
+	class Datagram {
+	public:
+		uint8_t* data = nullptr;
+		int bytes = 0;
+		Endpoint endpoint;
+		//size of the segments of a datagram that is sent with gso or received with gro, the last segment can be shorter
+		//0 for a single datagram
+		int segmentSize = 0;
+	};
+
+	//datagrams of one batched read, the memory is reused by every read into the batch
+	class DatagramBatch {
+	public:
+		std::vector<Datagram> datagrams;
+		//number of datagrams received by the last read
+		int count = 0;
+
+		//with gro the size has to fit the coalesced datagrams, up to 64 KiB
+		DatagramBatch(int capacity = 64, int maxDatagramSize = 2048);
+		int getCapacity();
+		int getMaxDatagramSize();
+
+	private:
+		friend class UdpSocket;
+		std::vector<uint8_t> memory;
+		int maxDatagramSize;
+		//message headers of the system call, kept so reads do not allocate
+		std::vector<uint8_t> headers;
+	};
+
 	class UdpSocket {
 	public:
 		UdpSocket();
 		~UdpSocket();
 
 		ErrorCode create(bool prefereIpv4 = false);
-		ErrorCode listen(uint16_t port, bool prefereIpv4 = false, bool reuseAddress = false, bool dualStacking = false);
+		//sockets that reuse the port share it, the system spreads the sources over them
+		ErrorCode listen(uint16_t port, bool prefereIpv4 = false, bool reuseAddress = false, bool dualStacking = false, bool reusePort = false);
 		void close();
 
 		ErrorCode write(const void* data, int bytes, const Endpoint &endpoint);
 		ErrorCode read(void* data, int &bytes, Endpoint& endpoint);
 
+		//receives as many datagrams as are available with one call, blocks until at least one arrived
+		ErrorCode readBatch(DatagramBatch& batch);
+		//sends the datagrams with one call, sent is the number of datagrams that were sent
+		//datagrams with a segment size are split into datagrams of that size by the system or the network card (gso), linux only
+		ErrorCode writeBatch(const Datagram* datagrams, int count, int& sent);
+		//consecutive datagrams of a source are received coalesced with their segment size set (gro), linux only
+		ErrorCode enableGro();
+
+		int getHandle();
+
 	private:
 		int handle;
 	};
@@ -0,0 +1,288 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include "Dht.h"
+#include "crypto/sha.h"
+#include <algorithm>
+#include <atomic>
+
+namespace net {
+
+	class Dht::GetState {
+	public:
+		DhtKey key;
+		GetCallback callback;
+		std::vector<PeerId> nodes;
+		std::vector<PeerId> missed;
+		int next = 0;
+		int inFlight = 0;
+		bool done = false;
+		std::mutex mutex;
+	};
+
+	Dht::Dht(PeerNetwork& network, uint16_t service) : network(network) {
+		this->service = service;
+		network.setRequestHandler(service, [this](PeerId source, Buffer& request, Buffer& response) {
+			handleRequest(source, request, response);
+		});
+	}
+
+	Dht::~Dht() {
+		stop();
+		network.setRequestHandler(service, nullptr);
+	}
+
+	void Dht::start() {
+		lastRepublish = std::chrono::steady_clock::now();
+		timers.start();
+		timers.add(maintenanceIntervalMs, [this]() {
+			maintain();
+		});
+	}
+
+	void Dht::stop() {
+		timers.stop();
+	}
+
+	void Dht::put(const DhtKey& key, Buffer& value, const PutCallback& callback) {
+		auto data = std::make_shared<std::vector<uint8_t>>(value.data(), value.data() + value.size());
+		publishedMutex.lock();
+		published[key] = *data;
+		publishedMutex.unlock();
+
+		findClosest(key, [this, key, data, callback](std::vector<PeerId>& nodes) {
+			store(key, data, nodes, valueTtlMs, false, callback);
+		});
+	}
+
+	void Dht::get(const DhtKey& key, const GetCallback& callback) {
+		Buffer value;
+		if (storage.get(key, value)) {
+			callback(ErrorCode::NO_ERROR, value);
+			return;
+		}
+
+		findClosest(key, [this, key, callback](std::vector<PeerId>& nodes) {
+			auto state = std::make_shared<GetState>();
+			state->key = key;
+			state->callback = callback;
+			state->nodes = nodes;
+			queryValue(state);
+		});
+	}
+
+	DhtKey Dht::getKey(const std::string& name) {
+		return sha256(name);
+	}
+
+	PeerId Dht::getLocation(const DhtKey& key) {
+		return PeerId(key);
+	}
+
+	void Dht::handleRequest(PeerId source, Buffer& request, Buffer& response) {
+		Opcode opcode = request.read<Opcode>();
+		DhtKey key = request.read<DhtKey>();
+
+		if (opcode == STORE) {
+			int ttlMs = request.read<int>();
+			uint8_t cached = request.read<uint8_t>();
+			bool stored = storage.put(key, request.data(), request.size(), std::min(ttlMs, valueTtlMs), cached);
+			response.write((uint8_t)stored);
+		}
+		else if (opcode == FIND_VALUE) {
+			Buffer value;
+			if (storage.get(key, value)) {
+				response.write((uint8_t)1);
+				response.writeBytes(value.data(), value.size());
+			}
+			else {
+				response.write((uint8_t)0);
+			}
+		}
+	}
+
+	void Dht::findClosest(const DhtKey& key, const std::function<void(std::vector<PeerId>&)>& callback) {
+		PeerId location = getLocation(key);
+		network.findNodes(location, [this, location, callback](std::vector<Peer>& closest) {
+			//the local peer is a candidate for storing the value as well
+			std::vector<PeerId> nodes;
+			nodes.push_back(network.getLocalId());
+			for (auto& peer : closest) {
+				if (std::find(nodes.begin(), nodes.end(), peer.id) == nodes.end()) {
+					nodes.push_back(peer.id);
+				}
+			}
+
+			std::sort(nodes.begin(), nodes.end(), [&](const PeerId& a, const PeerId& b) {
+				return (location ^ a) < (location ^ b);
+			});
+			if (nodes.size() > replication) {
+				nodes.resize(replication);
+			}
+			callback(nodes);
+		});
+	}
+
+	void Dht::store(const DhtKey& key, std::shared_ptr<std::vector<uint8_t>> value, std::vector<PeerId>& nodes, int ttlMs, bool cached, const PutCallback& callback) {
+		class StoreState {
+		public:
+			std::atomic<int> remaining;
+			std::atomic<int> stored;
+			std::atomic<ErrorCode> error;
+		};
+
+		if (nodes.empty()) {
+			if (callback) {
+				callback(ErrorCode::DISCONNECTED, 0);
+			}
+			return;
+		}
+
+		auto state = std::make_shared<StoreState>();
+		state->remaining = (int)nodes.size();
+		state->stored = 0;
+		state->error = ErrorCode::LIMIT_REACHED;
+
+		Buffer packet;
+		packet.write(Opcode::STORE);
+		packet.write(key);
+		packet.write(ttlMs);
+		packet.write((uint8_t)cached);
+		packet.writeBytes(value->data(), (int)value->size());
+
+		for (auto& node : nodes) {
+			network.request(node, service, packet, [state, callback](ErrorCode error, Buffer& response) {
+				if (error) {
+					state->error = error;
+				}
+				else if (response.read<uint8_t>()) {
+					state->stored++;
+				}
+
+				if (--state->remaining == 0) {
+					if (callback) {
+						callback(state->stored > 0 ? ErrorCode::NO_ERROR : state->error.load(), state->stored);
+					}
+				}
+			});
+		}
+	}
+
+	void Dht::queryValue(std::shared_ptr<GetState> state) {
+		std::vector<PeerId> queries;
+		std::unique_lock<std::mutex> lock(state->mutex);
+		while (!state->done && state->inFlight < concurrency && state->next < state->nodes.size()) {
+			queries.push_back(state->nodes[state->next++]);
+			state->inFlight++;
+		}
+		if (!state->done && state->inFlight == 0) {
+			state->done = true;
+			lock.unlock();
+			Buffer value;
+			state->callback(ErrorCode::NOT_FOUND, value);
+			return;
+		}
+		lock.unlock();
+
+		for (auto& node : queries) {
+			Buffer packet;
+			packet.write(Opcode::FIND_VALUE);
+			packet.write(state->key);
+
+			network.request(node, service, packet, [this, state, node](ErrorCode error, Buffer& response) {
+				bool found = !error && response.read<uint8_t>() == 1;
+
+				std::unique_lock<std::mutex> lock(state->mutex);
+				state->inFlight--;
+				if (state->done) {
+					return;
+				}
+
+				if (!found) {
+					if (!error) {
+						state->missed.push_back(node);
+					}
+					lock.unlock();
+					queryValue(state);
+					return;
+				}
+
+				//cache the value at the closest queried peer that did not have it
+				state->done = true;
+				PeerId location = getLocation(state->key);
+				std::vector<PeerId> cacheNodes;
+				for (auto& missed : state->missed) {
+					if (missed != network.getLocalId()) {
+						if (cacheNodes.empty() || (location ^ missed) < (location ^ cacheNodes[0])) {
+							cacheNodes = { missed };
+						}
+					}
+				}
+				lock.unlock();
+
+				auto value = std::make_shared<std::vector<uint8_t>>(response.data(), response.data() + response.size());
+				storage.put(state->key, value->data(), (int)value->size(), cacheTtlMs, true);
+				if (!cacheNodes.empty()) {
+					store(state->key, value, cacheNodes, cacheTtlMs, true, nullptr);
+				}
+				state->callback(ErrorCode::NO_ERROR, response);
+			});
+		}
+	}
+
+	void Dht::maintain() {
+		storage.expire();
+
+		auto now = std::chrono::steady_clock::now();
+		if (now - lastRepublish >= std::chrono::milliseconds(republishIntervalMs)) {
+			lastRepublish = now;
+			republish();
+		}
+
+		if (timers.isRunning()) {
+			timers.add(maintenanceIntervalMs, [this]() {
+				maintain();
+			});
+		}
+	}
+
+	void Dht::republish() {
+		class Republish {
+		public:
+			DhtKey key;
+			std::shared_ptr<std::vector<uint8_t>> value;
+			int ttlMs;
+		};
+
+		//values published by this peer get a new lifetime
+		std::vector<Republish> values;
+		publishedMutex.lock();
+		for (auto& i : published) {
+			values.push_back({ i.first, std::make_shared<std::vector<uint8_t>>(i.second), valueTtlMs });
+		}
+
+		//replicas stored by this peer keep their remaining lifetime, so values of a publisher that left still expire
+		//the closest peers might have changed since they were stored
+		for (auto& key : storage.getKeys(false)) {
+			if (!published.contains(key)) {
+				Buffer value;
+				int ttlMs = 0;
+				if (storage.get(key, value, &ttlMs) && ttlMs > 0) {
+					values.push_back({ key, std::make_shared<std::vector<uint8_t>>(value.data(), value.data() + value.size()), ttlMs });
+				}
+			}
+		}
+		publishedMutex.unlock();
+
+		for (auto& i : values) {
+			DhtKey key = i.key;
+			auto value = i.value;
+			int ttlMs = i.ttlMs;
+			findClosest(key, [this, key, value, ttlMs](std::vector<PeerId>& nodes) {
+				store(key, value, nodes, ttlMs, false, nullptr);
+			});
+		}
+	}
+
+}
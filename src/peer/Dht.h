@@ -0,0 +1,64 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#pragma once
+
+#include "PeerNetwork.h"
+#include "DhtStorage.h"
+
+namespace net {
+
+	//distributed hash table, values are replicated to the closest peers of a key
+	class Dht {
+	public:
+		//number of peers closest to a key that store a replica
+		int replication = 8;
+		//number of parallel value queries per get
+		int concurrency = 3;
+		int valueTtlMs = 2 * 60 * 60 * 1000;
+		int cacheTtlMs = 10 * 60 * 1000;
+		int republishIntervalMs = 60 * 60 * 1000;
+		int maintenanceIntervalMs = 1000;
+		DhtStorage storage;
+
+		typedef std::function<void(ErrorCode error, int replicas)> PutCallback;
+		typedef std::function<void(ErrorCode error, Buffer& value)> GetCallback;
+
+		Dht(PeerNetwork& network, uint16_t service = 2);
+		~Dht();
+
+		//starts expiring and republishing values
+		void start();
+		void stop();
+
+		void put(const DhtKey& key, Buffer& value, const PutCallback& callback = nullptr);
+		void get(const DhtKey& key, const GetCallback& callback);
+
+		static DhtKey getKey(const std::string& name);
+		static PeerId getLocation(const DhtKey& key);
+
+	private:
+		enum Opcode : uint8_t {
+			STORE,
+			FIND_VALUE,
+		};
+
+		class GetState;
+
+		PeerNetwork& network;
+		uint16_t service;
+		TimerWheel timers;
+		std::unordered_map<DhtKey, std::vector<uint8_t>, DhtKeyHash> published;
+		std::mutex publishedMutex;
+		std::chrono::steady_clock::time_point lastRepublish;
+
+		void handleRequest(PeerId source, Buffer& request, Buffer& response);
+		void findClosest(const DhtKey& key, const std::function<void(std::vector<PeerId>&)>& callback);
+		void store(const DhtKey& key, std::shared_ptr<std::vector<uint8_t>> value, std::vector<PeerId>& nodes, int ttlMs, bool cached, const PutCallback& callback);
+		void queryValue(std::shared_ptr<GetState> state);
+		void maintain();
+		void republish();
+	};
+
+}
@@ -0,0 +1,251 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include "DhtStorage.h"
+
+namespace net {
+
+	bool DhtStorage::open(const std::string& directory) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!log.open(directory)) {
+			return false;
+		}
+
+		//the log keeps the wall clock expiry time in front of the value
+		auto now = std::chrono::system_clock::now();
+		for (auto& key : log.getKeys()) {
+			Buffer value;
+			log.get(key, value);
+			int64_t expiresMs = value.read<int64_t>();
+			auto ttl = std::chrono::system_clock::time_point(std::chrono::milliseconds(expiresMs)) - now;
+			if (ttl <= std::chrono::milliseconds(0) || entries.contains(key)) {
+				log.remove(key);
+				continue;
+			}
+
+			Entry& entry = entries[key];
+			entry.expires = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(ttl);
+			entry.persisted = true;
+			bytes += getEntryBytes(0);
+			persistedBytes += value.size();
+		}
+		log.compact();
+		return true;
+	}
+
+	void DhtStorage::close() {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (auto entry = entries.begin(); entry != entries.end();) {
+			auto next = std::next(entry);
+			if (entry->second.persisted) {
+				bytes -= getEntryBytes(0);
+				persistedBytes -= getValueSize(entry->second, entry->first);
+				entries.erase(entry);
+			}
+			entry = next;
+		}
+		log.close();
+	}
+
+	bool DhtStorage::put(const DhtKey& key, const void* data, int bytes, int ttlMs, bool cached) {
+		if (bytes < 0 || bytes > maxValueSize) {
+			return false;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		auto expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(ttlMs);
+
+		//the old entry is only replaced once the new value is stored, so a failed put keeps it
+		int64_t oldBytes = 0;
+		int64_t oldPersistedBytes = 0;
+		auto entry = entries.find(key);
+		if (entry != entries.end()) {
+			//a cached copy never replaces a stored replica
+			if (cached && !entry->second.cached) {
+				if (expires > entry->second.expires) {
+					entry->second.expires = expires;
+				}
+				return true;
+			}
+			int oldSize = getValueSize(entry->second, key);
+			oldBytes = getEntryBytes(entry->second.persisted ? 0 : oldSize);
+			oldPersistedBytes = entry->second.persisted ? oldSize : 0;
+		}
+
+		bool persisted = !cached && log.isOpen();
+		int64_t needed = getEntryBytes(persisted ? 0 : bytes);
+		if (persisted && persistedBytes - oldPersistedBytes + bytes > maxPersistedBytes) {
+			return false;
+		}
+
+		//make space by evicting the least recently used cached values
+		auto victim = lru.end();
+		while (this->bytes - oldBytes + needed > maxBytes && victim != lru.begin()) {
+			victim--;
+			if (*victim == key) {
+				continue;
+			}
+			DhtKey evicted = *victim++;
+			removeEntry(entries.find(evicted));
+		}
+		if (this->bytes - oldBytes + needed > maxBytes) {
+			return false;
+		}
+
+		if (persisted) {
+			auto expiresMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() + ttlMs;
+			Buffer record;
+			record.write((int64_t)expiresMs);
+			record.writeBytes(data, bytes);
+			if (!log.put(key, record.data(), record.size())) {
+				return false;
+			}
+		}
+
+		entry = entries.find(key);
+		if (entry != entries.end()) {
+			//the log already holds the new record of a persisted value
+			this->bytes -= oldBytes;
+			persistedBytes -= oldPersistedBytes;
+			if (entry->second.cached) {
+				lru.erase(entry->second.lru);
+			}
+			if (entry->second.persisted && !persisted) {
+				log.remove(key);
+			}
+			entries.erase(entry);
+		}
+		Entry& newEntry = entries[key];
+		if (!persisted) {
+			newEntry.value.assign((const uint8_t*)data, (const uint8_t*)data + bytes);
+		}
+		newEntry.expires = expires;
+		newEntry.cached = cached;
+		newEntry.persisted = persisted;
+		if (cached) {
+			lru.push_front(key);
+			newEntry.lru = lru.begin();
+		}
+		this->bytes += needed;
+		if (persisted) {
+			persistedBytes += bytes;
+		}
+		return true;
+	}
+
+	bool DhtStorage::get(const DhtKey& key, Buffer& value, int* ttlMs) {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto entry = entries.find(key);
+		if (entry == entries.end()) {
+			return false;
+		}
+		auto now = std::chrono::steady_clock::now();
+		if (entry->second.expires <= now) {
+			removeEntry(entry);
+			return false;
+		}
+		if (ttlMs) {
+			*ttlMs = (int)std::chrono::duration_cast<std::chrono::milliseconds>(entry->second.expires - now).count();
+		}
+
+		if (entry->second.cached) {
+			lru.splice(lru.begin(), lru, entry->second.lru);
+		}
+		if (entry->second.persisted) {
+			Buffer record;
+			log.get(key, record);
+			record.skip(sizeof(int64_t));
+			value.writeBytes(record.data(), record.size());
+		}
+		else {
+			value.writeBytes(entry->second.value.data(), (int)entry->second.value.size());
+		}
+		return true;
+	}
+
+	bool DhtStorage::has(const DhtKey& key) {
+		std::unique_lock<std::mutex> lock(mutex);
+		return entries.contains(key);
+	}
+
+	void DhtStorage::remove(const DhtKey& key) {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto entry = entries.find(key);
+		if (entry != entries.end()) {
+			removeEntry(entry);
+		}
+	}
+
+	int DhtStorage::expire() {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto now = std::chrono::steady_clock::now();
+		int count = 0;
+		for (auto entry = entries.begin(); entry != entries.end();) {
+			auto next = std::next(entry);
+			if (entry->second.expires <= now) {
+				removeEntry(entry);
+				count++;
+			}
+			entry = next;
+		}
+		if (count > 0 && log.isOpen()) {
+			log.compact();
+		}
+		return count;
+	}
+
+	std::vector<DhtKey> DhtStorage::getKeys(bool includeCached) {
+		std::unique_lock<std::mutex> lock(mutex);
+		std::vector<DhtKey> keys;
+		for (auto& entry : entries) {
+			if (includeCached || !entry.second.cached) {
+				keys.push_back(entry.first);
+			}
+		}
+		return keys;
+	}
+
+	int64_t DhtStorage::getBytes() {
+		return bytes;
+	}
+
+	int64_t DhtStorage::getPersistedBytes() {
+		return persistedBytes;
+	}
+
+	int DhtStorage::getCount() {
+		return (int)entries.size();
+	}
+
+	int64_t DhtStorage::getEntryBytes(int valueSize) {
+		return valueSize + sizeof(DhtKey) + sizeof(Entry);
+	}
+
+	int DhtStorage::getValueSize(Entry& entry, const DhtKey& key) {
+		if (entry.persisted) {
+			Buffer record;
+			log.get(key, record);
+			return record.size() - (int)sizeof(int64_t);
+		}
+		return (int)entry.value.size();
+	}
+
+	void DhtStorage::removeEntry(std::unordered_map<DhtKey, Entry, DhtKeyHash>::iterator entry) {
+		if (entry->second.persisted) {
+			persistedBytes -= getValueSize(entry->second, entry->first);
+			bytes -= getEntryBytes(0);
+		}
+		else {
+			bytes -= getEntryBytes((int)entry->second.value.size());
+		}
+		if (entry->second.cached) {
+			lru.erase(entry->second.lru);
+		}
+		if (entry->second.persisted) {
+			log.remove(entry->first);
+		}
+		entries.erase(entry);
+	}
+
+}
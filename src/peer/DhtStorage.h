@@ -0,0 +1,75 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#pragma once
+
+#include "util/Blob.h"
+#include "util/Buffer.h"
+#include "util/LogStore.h"
+#include <unordered_map>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <chrono>
+
+namespace net {
+
+	typedef Blob<256> DhtKey;
+
+	class DhtKeyHash {
+	public:
+		size_t operator()(const DhtKey& key) const {
+			return (size_t)key.words[0];
+		}
+	};
+
+	//local value storage of a dht node, cached values are evicted in lru order when the limits are reached
+	class DhtStorage {
+	public:
+		//memory of the values and entries, values of persisted replicas are held by the log and counted against maxPersistedBytes instead
+		int64_t maxBytes = 64 * 1024 * 1024;
+		int64_t maxPersistedBytes = 1024ll * 1024 * 1024;
+		int maxValueSize = 64 * 1024;
+
+		//stores replicas in a persistent log in the directory, replicas from a previous run are restored
+		bool open(const std::string& directory);
+		void close();
+
+		bool put(const DhtKey& key, const void* data, int bytes, int ttlMs, bool cached);
+		//ttlMs receives the remaining lifetime of the value
+		bool get(const DhtKey& key, Buffer& value, int* ttlMs = nullptr);
+		bool has(const DhtKey& key);
+		void remove(const DhtKey& key);
+		//removes expired values, returns the number of removed values
+		int expire();
+		std::vector<DhtKey> getKeys(bool includeCached = false);
+		int64_t getBytes();
+		int64_t getPersistedBytes();
+		int getCount();
+
+	private:
+		class Entry {
+		public:
+			std::vector<uint8_t> value;
+			std::chrono::steady_clock::time_point expires;
+			bool cached = false;
+			//the value is held by the log instead of the entry
+			bool persisted = false;
+			std::list<DhtKey>::iterator lru;
+		};
+
+		std::unordered_map<DhtKey, Entry, DhtKeyHash> entries;
+		//cached keys, most recently used first
+		std::list<DhtKey> lru;
+		int64_t bytes = 0;
+		int64_t persistedBytes = 0;
+		LogStore log;
+		std::mutex mutex;
+
+		int64_t getEntryBytes(int valueSize);
+		int getValueSize(Entry& entry, const DhtKey& key);
+		void removeEntry(std::unordered_map<DhtKey, Entry, DhtKeyHash>::iterator entry);
+	};
+
+}
@@ -0,0 +1,64 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include "FailureDetector.h"
+#include <cmath>
+#include <algorithm>
+
+namespace net {
+
+	void FailureDetector::heartbeat(std::chrono::steady_clock::time_point time) {
+		if (started) {
+			float interval = std::chrono::duration_cast<std::chrono::microseconds>(time - lastHeartbeat).count() / 1000.0f;
+			if (intervals.size() < windowSize) {
+				intervals.push_back(interval);
+			}
+			else {
+				sum -= intervals[nextInterval];
+				squareSum -= intervals[nextInterval] * intervals[nextInterval];
+				intervals[nextInterval] = interval;
+				nextInterval = (nextInterval + 1) % windowSize;
+			}
+			sum += interval;
+			squareSum += interval * interval;
+		}
+		lastHeartbeat = time;
+		started = true;
+	}
+
+	double FailureDetector::getPhi(std::chrono::steady_clock::time_point time) {
+		if (!started) {
+			return 0;
+		}
+
+		double mean = initialIntervalMs;
+		double deviation = initialIntervalMs / 4;
+		if (!intervals.empty()) {
+			mean = sum / intervals.size();
+			deviation = std::sqrt(std::max(0.0, squareSum / intervals.size() - mean * mean));
+		}
+		mean += acceptablePauseMs;
+		deviation = std::max(deviation, (double)minStdDeviationMs);
+
+		//logistic approximation of the normal distribution
+		double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(time - lastHeartbeat).count() / 1000.0;
+		double y = (elapsed - mean) / deviation;
+		double e = std::exp(-y * (1.5976 + 0.070566 * y * y));
+		if (elapsed > mean) {
+			return -std::log10(e / (1.0 + e));
+		}
+		else {
+			return -std::log10(1.0 - 1.0 / (1.0 + e));
+		}
+	}
+
+	bool FailureDetector::hasHeartbeat() {
+		return started;
+	}
+
+	std::chrono::steady_clock::time_point FailureDetector::getLastHeartbeat() {
+		return lastHeartbeat;
+	}
+
+}
@@ -0,0 +1,38 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#pragma once
+
+#include <vector>
+#include <chrono>
+
+namespace net {
+
+	//phi accrual failure detector, the suspicion level grows with the time since the last heartbeat
+	//relative to the distribution of previous heartbeat intervals
+	class FailureDetector {
+	public:
+		int windowSize = 100;
+		float minStdDeviationMs = 200;
+		//added to the mean interval to tolerate pauses without heartbeats
+		float acceptablePauseMs = 0;
+		//assumed interval until the first interval was measured
+		float initialIntervalMs = 1000;
+
+		void heartbeat(std::chrono::steady_clock::time_point time);
+		//-log10 of the probability that a heartbeat is still going to arrive
+		double getPhi(std::chrono::steady_clock::time_point time);
+		bool hasHeartbeat();
+		std::chrono::steady_clock::time_point getLastHeartbeat();
+
+	private:
+		std::vector<float> intervals;
+		int nextInterval = 0;
+		double sum = 0;
+		double squareSum = 0;
+		std::chrono::steady_clock::time_point lastHeartbeat;
+		bool started = false;
+	};
+
+}
@@ -3,13 +3,28 @@
 //
 
 #include "PeerNetwork.h"
+#include "net/Resolver.h"
 #include "util/random.h"
 #include "util/hex.h"
 #include "util/strutil.h"
+#include "crypto/sha.h"
 #include <stdarg.h>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <cfloat>
+#include <cstring>
 
 namespace net {
 
+	const uint32_t peerCacheMagic = 0x50434e31;
+	const uint8_t peerCacheVersion = 1;
+
+	//the network whose packets are processed on this thread, a stream written here would wait for acks this thread has to process
+	static thread_local PeerNetwork* processingNetwork = nullptr;
+	//the connection whose read thread this is
+	static thread_local Connection* processingConnection = nullptr;
+
 	const char* getOpcodeName(PeerNetwork::Opcode opcode) {
 		switch (opcode)
 		{
@@ -35,6 +50,26 @@ namespace net {
 			return "BROADCAST";
 		case net::PeerNetwork::DISCONNECT:
 			return "DISCONNECT";
+		case net::PeerNetwork::FIND_NODE:
+			return "FIND_NODE";
+		case net::PeerNetwork::FIND_NODE_REPLY:
+			return "FIND_NODE_REPLY";
+		case net::PeerNetwork::REQUEST:
+			return "REQUEST";
+		case net::PeerNetwork::RESPONSE:
+			return "RESPONSE";
+		case net::PeerNetwork::RELIABLE_MESSAGE:
+			return "RELIABLE_MESSAGE";
+		case net::PeerNetwork::ACK:
+			return "ACK";
+		case net::PeerNetwork::MULTIPATH_MESSAGE:
+			return "MULTIPATH_MESSAGE";
+		case net::PeerNetwork::HEARTBEAT:
+			return "HEARTBEAT";
+		case net::PeerNetwork::STREAM_CHUNK:
+			return "STREAM_CHUNK";
+		case net::PeerNetwork::STREAM_ACK:
+			return "STREAM_ACK";
 		default:
 			return "INVALID_OPCODE";
 		}
@@ -45,6 +80,8 @@ namespace net {
 		{
 		case net::PeerNetwork::DISCONNECTED:
 			return "DISCONNECTED";
+		case net::PeerNetwork::CONNECTING_TO_CACHED_PEERS:
+			return "CONNECTING_TO_CACHED_PEERS";
 		case net::PeerNetwork::CONNECTING_TO_ENTRY_NODE:
 			return "CONNECTING_TO_ENTRY_NODE";
 		case net::PeerNetwork::SENDING_LOOKUPS:
@@ -60,9 +97,19 @@ namespace net {
 
 	PeerNetwork::PeerNetwork() {
 		clientOnly = false;
+		socketOptions.noDelay = 1;
+		randomBytes(nextRequestId);
+		randomBytes(nextDeliveryId);
 	}
 
 	PeerNetwork::~PeerNetwork() {
+		timers.stop();
+		failAllRequests(ErrorCode::DISCONNECTED);
+		failAllDeliveries(ErrorCode::DISCONNECTED);
+		lookupMutex.lock();
+		lookups.clear();
+		lookupMutex.unlock();
+		lookupCondition.notify_all();
 		if (lookupThread) {
 			lookupThread->join();
 			lookupThread = nullptr;
@@ -151,9 +198,32 @@ namespace net {
 
 		this->clientOnly = clientOnly;
 		server.packetize = true;
+		server.connectTimeoutMs = connectTimeoutMs;
+		server.maxPendingConnects = maxPendingConnects;
+		server.socketOptions = socketOptions;
+		//chunks of streamed messages and their acks are small writes, with nagle they wait for delayed acks and streams stall
+		if (server.socketOptions.noDelay < 0) {
+			server.socketOptions.noDelay = 1;
+		}
+		server.transport = transport;
 		wasEntryNodeLookedUp = false;
 		setState(State::DISCONNECTED);
 		entryNode = nullptr;
+		routingTable.proximityRouting = proximityRouting;
+		routingTable.bucketCapacity = bucketCapacity;
+		routingTable.replacementCacheSize = replacementCacheSize;
+		pendingBucketChecks.clear();
+		timers.start();
+		if (rttProbeIntervalMs > 0) {
+			timers.add(rttProbeIntervalMs, [this]() {
+				probeRtts();
+			});
+		}
+		if (heartbeatIntervalMs > 0) {
+			timers.add(heartbeatIntervalMs, [this]() {
+				sendHeartbeats();
+			});
+		}
 
 		server.errorCallback = [&](Connection* conn, ErrorCode error) {
 			log(3, "%s\n", getErrorString(error));
@@ -164,11 +234,23 @@ namespace net {
 		};
 		server.disconnectCallback = [&](Connection* conn) {
 			log(1, "disconnect %s %i\n", conn->socket->getEndpoint().getAddress().c_str(), conn->socket->getEndpoint().getPort());
+			processingNetwork = this;
+			processingConnection = conn;
 			onDisconnect(conn);
+			processingNetwork = nullptr;
+			processingConnection = nullptr;
 		};
 		server.readCallback = [&](Connection* conn, Buffer &buffer) {
+			processingNetwork = this;
+			processingConnection = conn;
+			std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
 			Peer* peer = routingTable.get(conn);
-			processPacket(peer, buffer, peer->id, true);
+			if (peer) {
+				peer->detector.heartbeat(std::chrono::steady_clock::now());
+				processPacket(peer, buffer, peer->id, true, lock);
+			}
+			processingNetwork = nullptr;
+			processingConnection = nullptr;
 		};
 
 		if (!clientOnly) {
@@ -189,27 +271,238 @@ namespace net {
 			server.run();
 		}
 
-		//connect to entry node
+		if (!peerCacheFile.empty() && peerCacheIntervalMs > 0) {
+			timers.add(peerCacheIntervalMs, [this]() {
+				runPeerCacheTimer();
+			});
+		}
+
+		//peers of the previous run are tried first, they usually still know the current network
+		std::vector<Peer> cachedPeers;
+		if (!clientOnly && loadPeerCache(cachedPeers)) {
+			setState(State::CONNECTING_TO_CACHED_PEERS);
+			cachedPeersConnecting = (int)cachedPeers.size();
+			timers.add(peerCacheTimeoutMs, [this]() {
+				onPeerCacheTimeout();
+			});
+			connectToCachedPeers(cachedPeers);
+			return;
+		}
+
+		connectToEntryNodes();
+	}
+
+	void PeerNetwork::connectToEntryNodes() {
 		setState(State::CONNECTING_TO_ENTRY_NODE);
-		for (auto& node : entryNodes) {
-			Endpoint ep(node.address, node.port);
-			if (node.address != routingTable.localPeer->address || node.port != localPort) {
-				if (ep.isValid() && (ep.getAddress() != routingTable.localPeer->address || ep.getPort() != localPort)) {
-					if (getState() != State::CONNECTING_TO_ENTRY_NODE) {
-						break;
-					}
-					log(2, "try connecting to %s %i\n", node.address.c_str(), node.port);
-					if (connectToPeer(ep.getAddress(), ep.getPort())) {
-						break;
-					}
-					if (getState() != State::CONNECTING_TO_ENTRY_NODE) {
-						break;
-					}
+
+		//entry nodes are tried in order with a few connects in flight, the first one that connects is used
+		auto attempts = std::make_shared<EntryNodeAttempts>();
+		attempts->nodes = entryNodes;
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		for (int i = 0; i < std::max(1, entryNodeConcurrency); i++) {
+			connectToNextEntryNode(attempts);
+		}
+	}
+
+	//routingTableMutex must be locked by the caller
+	void PeerNetwork::connectToNextEntryNode(std::shared_ptr<EntryNodeAttempts> attempts) {
+		if (attempts->next >= attempts->nodes.size()) {
+			if (attempts->running == 0 && !attempts->connected) {
+				log(1, "could not connect to any entry node\n");
+			}
+			return;
+		}
+		Peer node = attempts->nodes[attempts->next++];
+		attempts->running++;
+
+		std::string localAddress = routingTable.localPeer->address;
+		uint16_t localPort = routingTable.localPeer->port;
+		Endpoint::resolve(node.address, node.port, [this, attempts, node, localAddress, localPort](ErrorCode error, std::vector<Endpoint>& endpoints) {
+			//the local peer itself might be listed as an entry node
+			bool local = node.address == localAddress && node.port == localPort;
+			for (auto& ep : endpoints) {
+				if (ep.getAddress() == localAddress && ep.getPort() == localPort) {
+					local = true;
+				}
+			}
+			if (error || local) {
+				onEntryNodeAttempt(attempts, nullptr);
+				return;
+			}
+
+			log(2, "try connecting to %s %i\n", node.address.c_str(), node.port);
+			connectToPeer(node.address, node.port, [this, attempts](Connection* conn, ErrorCode error) {
+				onEntryNodeAttempt(attempts, conn);
+			});
+		});
+	}
+
+	void PeerNetwork::onEntryNodeAttempt(std::shared_ptr<EntryNodeAttempts> attempts, Connection* conn) {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		attempts->running--;
+		bool joining = getState() == State::CONNECTING_TO_ENTRY_NODE;
+		if (conn) {
+			Peer* peer = routingTable.get(conn);
+			if (!peer) {
+				return;
+			}
+			if (attempts->connected || !joining) {
+				//only one entry node is used, the lookups find the neighbors
+				peer->dropped = true;
+				disconnectFromPeer(peer);
+				return;
+			}
+			attempts->connected = true;
+			entryNode = peer;
+			return;
+		}
+		if (!attempts->connected && joining) {
+			connectToNextEntryNode(attempts);
+		}
+	}
+
+	void PeerNetwork::connectToCachedPeers(std::vector<Peer>& peers) {
+		auto failed = std::make_shared<std::atomic<int>>(0);
+		int count = (int)peers.size();
+		for (auto& peer : peers) {
+			log(2, "try connecting to cached peer %s %i\n", peer.address.c_str(), peer.port);
+			connectToPeer(peer.address, peer.port, [this, failed, count](Connection* conn, ErrorCode error) {
+				//no need to wait for the timeout when none of the cached peers is reachable
+				if (!conn && ++*failed == count) {
+					onPeerCacheTimeout();
+				}
+			});
+		}
+	}
+
+	void PeerNetwork::onCachedPeersConnected() {
+		setState(State::CONNECTED);
+
+		//the cached neighbors are enough to route, the buckets are refreshed in the background
+		std::unique_lock<std::mutex> lock(lookupMutex);
+		startLookup(localId);
+	}
+
+	void PeerNetwork::onPeerCacheTimeout() {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		if (getState() != State::CONNECTING_TO_CACHED_PEERS) {
+			return;
+		}
+
+		int connected = 0;
+		for (auto& peer : routingTable.peers) {
+			if (peer->state == Peer::CONNECTED) {
+				connected++;
+			}
+		}
+		if (connected > 0 && entryNodes.empty()) {
+			onCachedPeersConnected();
+			return;
+		}
+		lock.unlock();
+
+		log(2, "%i cached peers responded, connecting to entry nodes\n", connected);
+		connectToEntryNodes();
+	}
+
+	void PeerNetwork::savePeerCache() {
+		if (peerCacheFile.empty()) {
+			return;
+		}
+
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		Buffer peers;
+		uint32_t count = 0;
+		for (auto& peer : routingTable.peers) {
+			if (peer->state == Peer::CONNECTED && peer->id != PeerId(0)) {
+				if (writeContact(peers, peer.get())) {
+					peers.write(now);
+					peers.write(peer->rttMs);
+					count++;
+				}
+			}
+		}
+		lock.unlock();
+
+		//an empty table would discard the peers of a previous run that might still be reachable
+		if (count > 0) {
+			Buffer file;
+			file.write(peerCacheMagic);
+			file.write(peerCacheVersion);
+			file.write(count);
+			file.writeBytes(peers.data(), peers.size());
+
+			std::string tmp = peerCacheFile + ".tmp";
+			std::ofstream stream(tmp, std::ios::binary | std::ios::trunc);
+			if (stream.is_open()) {
+				stream.write((const char*)file.data(), file.size());
+				stream.close();
+				std::error_code error;
+				std::filesystem::rename(tmp, peerCacheFile, error);
+				if (error) {
+					log(2, "could not write peer cache %s\n", peerCacheFile.c_str());
 				}
 			}
 		}
 	}
 
+	void PeerNetwork::runPeerCacheTimer() {
+		savePeerCache();
+		if (timers.isRunning()) {
+			timers.add(peerCacheIntervalMs, [this]() {
+				runPeerCacheTimer();
+			});
+		}
+	}
+
+	bool PeerNetwork::loadPeerCache(std::vector<Peer>& peers) {
+		if (peerCacheFile.empty()) {
+			return false;
+		}
+		std::ifstream stream(peerCacheFile, std::ios::binary);
+		if (!stream.is_open()) {
+			return false;
+		}
+		std::string data((std::istreambuf_iterator<char>(stream)), (std::istreambuf_iterator<char>()));
+
+		Buffer file((void*)data.data(), (int)data.size());
+		if (file.read<uint32_t>() != peerCacheMagic || file.read<uint8_t>() != peerCacheVersion) {
+			return false;
+		}
+		uint32_t count = file.read<uint32_t>();
+
+		int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		for (uint32_t i = 0; i < count && file.size() > 0; i++) {
+			Peer peer;
+			bool valid = readContact(file, peer);
+			int64_t lastSeen = file.read<int64_t>();
+			peer.rttMs = file.read<float>();
+			if (valid && peer.id != localId && now - lastSeen <= peerCacheMaxAgeMs) {
+				peers.push_back(peer);
+			}
+		}
+
+		//peers with a known low round trip time are preferred
+		std::sort(peers.begin(), peers.end(), [](const Peer& a, const Peer& b) {
+			return (a.rttMs > 0 ? a.rttMs : FLT_MAX) < (b.rttMs > 0 ? b.rttMs : FLT_MAX);
+		});
+		if (peers.size() > peerCacheMaxPeers) {
+			peers.resize(peerCacheMaxPeers);
+		}
+
+		std::unique_lock<std::mutex> lock(lookupMutex);
+		for (auto& peer : peers) {
+			Peer& contact = contacts[peer.id];
+			contact.id = peer.id;
+			contact.address = peer.address;
+			contact.port = peer.port;
+			contact.rttMs = peer.rttMs;
+		}
+		log(2, "loaded %i cached peers\n", (int)peers.size());
+		return !peers.empty();
+	}
+
 	void PeerNetwork::setLocalPeer(const std::string& localAddress, uint16_t localPort, int maxPortOffset, PeerId id) {
 		routingTable.localPeer->address = localAddress;
 		routingTable.localPeer->port = localPort;
@@ -224,11 +517,20 @@ namespace net {
 	}
 
 	void PeerNetwork::disconnect() {
+		savePeerCache();
+		lookupMutex.lock();
+		lookups.clear();
+		lookupMutex.unlock();
+		lookupCondition.notify_all();
 		server.close();
+		timers.stop();
+		failAllRequests(ErrorCode::DISCONNECTED);
+		failAllDeliveries(ErrorCode::DISCONNECTED);
 		setState(State::DISCONNECTED);
 	}
 
 	bool PeerNetwork::isConnected() {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
 		for (auto& peer : routingTable.peers) {
 			if (peer && peer->conn) {
 				if (peer->conn->socket->isConnected()) {
@@ -246,6 +548,7 @@ namespace net {
 	}
 
 	PeerId PeerNetwork::getRandomNeighborPeer() {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
 		int i = 0;
 		randomBytes(i);
 		int index = i % routingTable.peers.size();
@@ -257,6 +560,7 @@ namespace net {
 	}
 
 	void PeerNetwork::send(PeerId id, Buffer& payload, bool exact) {
+		trackTraffic(id);
 		Buffer packet;
 		createPacketRoute(packet, localId, id, 1);
 		packet.write(Opcode::MESSAGE);
@@ -265,6 +569,45 @@ namespace net {
 		sendToNextPeer(id, packet);
 	}
 
+	void PeerNetwork::sendReliable(PeerId id, Buffer& payload, const DeliveryCallback& callback, bool multipath) {
+		if (id == localId) {
+			if (readCallback) {
+				Buffer message(payload.data(), payload.size());
+				readCallback(localId, message);
+			}
+			if (callback) {
+				callback(ErrorCode::NO_ERROR);
+			}
+			return;
+		}
+
+		trackTraffic(id);
+		std::unique_lock<std::mutex> lock(deliveryMutex);
+		if (pendingDeliveries.size() >= maxPendingDeliveries) {
+			lock.unlock();
+			if (callback) {
+				callback(ErrorCode::LIMIT_REACHED);
+			}
+			return;
+		}
+
+		uint64_t deliveryId = ++nextDeliveryId;
+		Buffer packet;
+		createPacketRoute(packet, localId, id, 1);
+		packet.write(Opcode::RELIABLE_MESSAGE);
+		packet.write(deliveryId);
+		packet.writeBytes(payload.data(), payload.size());
+
+		PendingDelivery& pending = pendingDeliveries[deliveryId];
+		pending.target = id;
+		pending.packet.assign(packet.data(), packet.data() + packet.size());
+		pending.multipath = multipath;
+		pending.callback = callback;
+		lock.unlock();
+
+		sendDelivery(deliveryId);
+	}
+
 	void PeerNetwork::broadcast(Buffer& payload) {
 		Buffer packet;
 		packet.write(Opcode::BROADCAST);
@@ -292,255 +635,1516 @@ namespace net {
 		sendToAllPeers(packet);
 	}
 
-	bool PeerNetwork::connectToPeer(const std::string& address, uint16_t port) {
-		ErrorCode error = server.connectAsClient(address, port);
-		return !error;
+	void PeerNetwork::setRequestHandler(uint16_t service, const RequestHandler& handler) {
+		std::unique_lock<std::mutex> lock(requestMutex);
+		requestHandlers[service] = handler;
 	}
 
-	void PeerNetwork::disconnectFromPeer(Peer* peer) {
-		Buffer reply;
-		reply.write(Opcode::DISCONNECT);
-		peer->conn->write(reply);
-		peer->conn->disconnect();
-	}
+	uint64_t PeerNetwork::request(PeerId id, uint16_t service, Buffer& payload, const ResponseCallback& callback, int timeoutMs) {
+		if (timeoutMs <= 0) {
+			timeoutMs = requestTimeoutMs;
+		}
 
-	void PeerNetwork::performLookups() {
-		if (lookupThread) {
-			lookupThread->join();
-			lookupThread = nullptr;
+		if (id == localId) {
+			Buffer request(payload.data(), payload.size());
+			Buffer response;
+			handleRequest(localId, service, request, response);
+			ErrorCode error = (ErrorCode)response.read<uint8_t>();
+			if (callback) {
+				callback(error, response);
+			}
+			return 0;
 		}
 
-		lookupThread = std::make_shared<std::thread>([&]() {
-			for (int i = 0; i < lookupCountOnConnect; i++) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(20));
-				auto target = routingTable.getLookupTarget(i);
-
-				if (entryNode) {
-					Buffer packet;
-					createPacketRoute(packet, localId, target, 0);
-					createPacketLookup(packet, localId, entryNode->id, target);
-					lookupTargets.insert(target);
-					if (i == lookupCountOnConnect - 1) {
-						setState(State::LOOKUPS_SEND);
-					}
-					entryNode->conn->write(packet);
-				}
+		trackTraffic(id);
+		std::unique_lock<std::mutex> lock(requestMutex);
+		if (pendingRequests.size() >= maxPendingRequests) {
+			lock.unlock();
+			Buffer response;
+			if (callback) {
+				callback(ErrorCode::LIMIT_REACHED, response);
 			}
+			return 0;
+		}
+
+		uint64_t requestId = ++nextRequestId;
+		PendingRequest& pending = pendingRequests[requestId];
+		pending.target = id;
+		pending.callback = callback;
+		pending.sendTime = std::chrono::steady_clock::now();
+		pending.timer = timers.add(timeoutMs, [this, requestId]() {
+			Buffer response;
+			completeRequest(requestId, PeerId(0), ErrorCode::TIME_OUT, response);
 		});
+		lock.unlock();
+
+		Buffer packet;
+		createPacketRoute(packet, localId, id, 1);
+		packet.write(Opcode::REQUEST);
+		packet.write(requestId);
+		packet.write(service);
+		packet.writeBytes(payload.data(), payload.size());
+		if (!sendToNextPeer(id, packet)) {
+			Buffer response;
+			completeRequest(requestId, PeerId(0), ErrorCode::DISCONNECTED, response);
+		}
+		return requestId;
 	}
 
-	void PeerNetwork::onConnect(Connection* conn) {
-		Peer peer;
-		peer.conn = conn;
-		peer.address = conn->socket->getEndpoint().getAddress();
-		peer.port = conn->socket->getEndpoint().getPort();
-		peer.state = Peer::PRE_HANDSHAKE;
+	std::future<PeerNetwork::Response> PeerNetwork::request(PeerId id, uint16_t service, Buffer& payload, int timeoutMs) {
+		auto promise = std::make_shared<std::promise<Response>>();
+		std::future<Response> future = promise->get_future();
+		request(id, service, payload, [promise](ErrorCode error, Buffer& data) {
+			Response response;
+			response.error = error;
+			if (data.size() > 0) {
+				response.data.writeBytes(data.data(), data.size());
+			}
+			promise->set_value(std::move(response));
+		}, timeoutMs);
+		return future;
+	}
 
-		routingTable.add(peer);
+	std::shared_ptr<MessageWriter> PeerNetwork::openMessage(PeerId id) {
+		trackTraffic(id);
+		auto stream = std::make_shared<OutgoingStream>();
+		stream->target = id;
 
-		if (conn->outbound) {
-			Buffer packet;
-			createPacketHandshake(packet, localId, routingTable.localPeer->port, routingTable.localPeer->address);
-			conn->write(packet);
+		std::unique_lock<std::mutex> lock(streamMutex);
+		for (auto entry = outgoingStreams.begin(); entry != outgoingStreams.end();) {
+			if (entry->second.expired()) {
+				entry = outgoingStreams.erase(entry);
+			}
+			else {
+				entry++;
+			}
 		}
+		uint64_t messageId = ++nextStreamId;
+		outgoingStreams[messageId] = stream;
+		lock.unlock();
 
-		if (getState() == State::CONNECTING_TO_ENTRY_NODE) {
-			entryNode = routingTable.get(conn);
-		}
+		return std::make_shared<MessageWriter>(messageId, streamChunkSize, [this, stream](uint64_t messageId, int64_t offset, Buffer& chunk, bool last) {
+			return sendChunk(stream, messageId, offset, chunk, last);
+		});
 	}
 
-	void PeerNetwork::onDisconnect(Connection* conn) {
-		Peer* peer = routingTable.get(conn);
-		if (!peer) {
-			return;
+	ErrorCode PeerNetwork::sendChunk(std::shared_ptr<OutgoingStream> stream, uint64_t messageId, int64_t offset, Buffer& chunk, bool last) {
+		if (stream->target == localId) {
+			onChunk(localId, messageId, offset, last, chunk);
+			return ErrorCode::NO_ERROR;
+		}
+		if (processingNetwork == this) {
+			log(1, "stream %llu written from a network callback\n", (unsigned long long)messageId);
+			return ErrorCode::GENERAL_ERROR;
 		}
-		peer->state = Peer::DISCONNECTED;
-		PeerId id = peer->id;
-		routingTable.remove(conn);
 
-		if (server.isRunning()) {
-			int index = routingTable.getLookupIndex(id);
-			PeerId target = routingTable.getLookupTarget(index);
-			Buffer packet;
-			createPacketRoute(packet, localId, target, 0);
-			createPacketLookup(packet, localId, localId, target);
+		//the window bounds the number of chunks buffered on the path to the target
+		std::unique_lock<std::mutex> lock(streamMutex);
+		bool open = streamCondition.wait_for(lock, std::chrono::milliseconds(streamTimeoutMs), [&]() {
+			return streamWindow <= 0 || stream->sent - stream->acked < streamWindow;
+		});
+		if (!open) {
+			return ErrorCode::TIME_OUT;
+		}
+		stream->sent++;
+		lock.unlock();
+
+		Buffer packet;
+		createPacketRoute(packet, localId, stream->target, 1);
+		packet.write(Opcode::STREAM_CHUNK);
+		packet.write(messageId);
+		packet.write(offset);
+		packet.write((uint8_t)last);
+		packet.writeBytes(chunk.data(), chunk.size());
+		if (!sendToNextPeer(stream->target, packet)) {
+			return ErrorCode::DISCONNECTED;
+		}
+		if (!last) {
+			return ErrorCode::NO_ERROR;
+		}
 
-			Peer* next = routingTable.getNext(target, id, false);
-			if (next) {
-				lookupTargets.insert(target);
-				next->conn->write(packet);
+		lock.lock();
+		bool acked = streamCondition.wait_for(lock, std::chrono::milliseconds(streamTimeoutMs), [&]() {
+			return stream->acked >= stream->sent;
+		});
+		outgoingStreams.erase(messageId);
+		return acked ? ErrorCode::NO_ERROR : ErrorCode::TIME_OUT;
+	}
+
+	void PeerNetwork::onChunk(PeerId source, uint64_t messageId, int64_t offset, bool last, Buffer& chunk) {
+		std::unique_lock<std::mutex> lock(streamMutex);
+		auto now = std::chrono::steady_clock::now();
+		for (auto entry = incomingStreams.begin(); entry != incomingStreams.end();) {
+			if (now - entry->second.lastChunk > std::chrono::milliseconds(streamTimeoutMs)) {
+				entry = incomingStreams.erase(entry);
+			}
+			else {
+				entry++;
 			}
 		}
+
+		IncomingStream& stream = incomingStreams[{ source, messageId }];
+		stream.received += chunk.size();
+		stream.lastChunk = now;
+		if (last) {
+			stream.size = offset + chunk.size();
+		}
+		bool complete = stream.size >= 0 && stream.received >= stream.size;
+		if (complete) {
+			incomingStreams.erase({ source, messageId });
+		}
+		lock.unlock();
+
+		if (chunkCallback) {
+			chunkCallback(source, messageId, offset, chunk, complete);
+		}
 	}
 
-	void PeerNetwork::processPacket(Peer* peer, Buffer& packet, PeerId routingSource, bool wasSendDirectly) {
-		if (!peer) {
+	void PeerNetwork::findNodes(PeerId target, const LookupCallback& callback) {
+		std::unique_lock<std::recursive_mutex> routingLock(routingTableMutex);
+		std::unique_lock<std::mutex> lock(lookupMutex);
+		startLookup(target, false, callback);
+		lock.unlock();
+		routingLock.unlock();
+		runLookupCompletions();
+	}
+
+	void PeerNetwork::setCompressionDictionary(const std::vector<uint8_t>& dictionary) {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		if (dictionary.empty()) {
+			compressionDictionary = nullptr;
+			compressionDictionaryHash = 0;
 			return;
 		}
+		compressionDictionary = std::make_shared<const std::vector<uint8_t>>(dictionary);
+		compressionDictionaryHash = sha256(dictionary.data(), (int)dictionary.size()).words[0];
+	}
 
-		if (debugFakeLatency && wasSendDirectly) {
-			if (getState() == State::CONNECTED) {
-				uint32_t time;
-				randomBytes(time);
-				time = time % 1000;
-				std::this_thread::sleep_for(std::chrono::milliseconds(time));
+	void PeerNetwork::handleRequest(PeerId source, uint16_t service, Buffer& request, Buffer& reply) {
+		RequestHandler handler;
+		requestMutex.lock();
+		auto entry = requestHandlers.find(service);
+		if (entry != requestHandlers.end()) {
+			handler = entry->second;
+		}
+		requestMutex.unlock();
+
+		if (handler) {
+			Buffer response;
+			handler(source, request, response);
+			reply.write((uint8_t)ErrorCode::NO_ERROR);
+			if (response.size() > 0) {
+				reply.writeBytes(response.data(), response.size());
 			}
 		}
+		else {
+			reply.write((uint8_t)ErrorCode::INVALID_PACKET);
+		}
+	}
 
-		int startReadIndex = packet.getReadIndex();
-		Opcode opcode = packet.read<Opcode>();
-
-		log(4, "packet: %s\n", getOpcodeName(opcode));
-
-		switch (opcode) {
-		case PING: {
-			Buffer reply;
-			createPacketRoute(reply, localId, routingSource, 1);
-			reply.write(Opcode::PONG);
-			peer->conn->write(reply);
-			break;
+	void PeerNetwork::completeRequest(uint64_t requestId, PeerId source, ErrorCode error, Buffer& response) {
+		std::unique_lock<std::mutex> lock(requestMutex);
+		auto entry = pendingRequests.find(requestId);
+		if (entry == pendingRequests.end()) {
+			return;
 		}
-		case PONG: {
-			log(2, "ping: %s\n", idToStr(routingSource).c_str());
-			break;
+		if (source != PeerId(0) && source != entry->second.target) {
+			return;
 		}
-		case HANDSHAKE: {
-			if (wasSendDirectly) {
-				peer->id = packet.read<PeerId>();
-				peer->port = packet.read<uint16_t>();
-				peer->address = packet.readStr();
-				peer->state = Peer::CONNECTED;
 
-				log(4, "handshake %s %i %s\n", idToStr(peer->id).c_str(), peer->port, peer->address.c_str());
+		ResponseCallback callback = std::move(entry->second.callback);
+		TimerWheel::TimerId timer = entry->second.timer;
+		PeerId target = entry->second.target;
+		auto sendTime = entry->second.sendTime;
+		pendingRequests.erase(entry);
+		lock.unlock();
 
-				Buffer reply;
-				reply.write(Opcode::HANDSHAKE_REPLY);
-				reply.write(localId);
-				reply.write(routingTable.localPeer->port);
-				reply.writeStr(routingTable.localPeer->address);
-				peer->conn->write(reply);
+		if (!error) {
+			updatePeerRtt(target, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sendTime).count() / 1000.0f);
+		}
 
+		if (error != ErrorCode::TIME_OUT) {
+			timers.cancel(timer);
+		}
+		if (callback) {
+			callback(error, response);
+		}
+	}
 
-				if (getState() == State::CONNECTING_TO_ENTRY_NODE) {
-					if (peer == entryNode) {
-						setState(State::CONNECTED);
-					}
-				}
-				break;
-			}
+	void PeerNetwork::failAllRequests(ErrorCode error) {
+		std::vector<uint64_t> ids;
+		requestMutex.lock();
+		for (auto& i : pendingRequests) {
+			ids.push_back(i.first);
 		}
-		case HANDSHAKE_REPLY: {
-			if (wasSendDirectly) {
-				peer->id = packet.read<PeerId>();
-				peer->port = packet.read<uint16_t>();
-				peer->address = packet.readStr();
-				peer->state = Peer::CONNECTED;
+		requestMutex.unlock();
 
-				log(4, "handshake reply %s %i %s\n", idToStr(peer->id).c_str(), peer->port, peer->address.c_str());
+		for (auto id : ids) {
+			Buffer response;
+			completeRequest(id, PeerId(0), error, response);
+		}
+	}
 
-				if (getState() == State::CONNECTING_TO_ENTRY_NODE) {
-					if (peer == entryNode) {
-						if (clientOnly) {
-							setState(State::CONNECTED);
-						}
-						else {
-							setState(State::SENDING_LOOKUPS);
-							performLookups();
-						}
-					}
-				}
-			}
-			break;
+	void PeerNetwork::sendDelivery(uint64_t deliveryId) {
+		std::unique_lock<std::mutex> lock(deliveryMutex);
+		auto entry = pendingDeliveries.find(deliveryId);
+		if (entry == pendingDeliveries.end()) {
+			return;
 		}
-		case LOOKUP: {
-			PeerId source = packet.read<PeerId>();
-			PeerId relay = packet.read<PeerId>();
-			PeerId target = packet.read<PeerId>();
 
-			log(4, "lookup %s %s %s\n", idToStr(source).c_str(), idToStr(relay).c_str(), idToStr(target).c_str());
+		PendingDelivery& pending = entry->second;
+		if (pending.attempts > deliveryMaxRetries) {
+			lock.unlock();
+			completeDelivery(deliveryId, PeerId(0), ErrorCode::TIME_OUT);
+			return;
+		}
 
-			Buffer reply;
-			if (relay != localId) {
-				createPacketRoute(reply, localId, relay, 1);
-			}
-			createPacketRoute(reply, localId, source, 1);
-			createPacketLookupReply(reply, localId, target, routingTable.localPeer->port, routingTable.localPeer->address);
-			peer->conn->write(reply);
-			break;
+		//exponential backoff on every retransmission
+		int timeoutMs = getDeliveryTimeout(pending.target);
+		for (int i = 0; i < pending.attempts && timeoutMs < deliveryMaxTimeoutMs; i++) {
+			timeoutMs *= 2;
 		}
-		case LOOKUP_REPLY: {
-			PeerId source = packet.read<PeerId>();
-			PeerId target = packet.read<PeerId>();
-			uint16_t port = packet.read<uint16_t>();
-			std::string address = packet.readStr();
+		timeoutMs = std::min(timeoutMs, deliveryMaxTimeoutMs);
 
-			log(4, "lookup reply %s %s %i %s\n", idToStr(source).c_str(), idToStr(target).c_str(), port, address.c_str());
+		int attempt = pending.attempts++;
+		pending.sendTime = std::chrono::steady_clock::now();
+		pending.timer = timers.add(timeoutMs, [this, deliveryId]() {
+			sendDelivery(deliveryId);
+		});
+		PeerId target = pending.target;
+		bool multipath = pending.multipath;
+		std::vector<uint8_t> data = pending.packet;
+		lock.unlock();
 
-			if (entryNode) {
-				if (source == entryNode->id) {
-					wasEntryNodeLookedUp = true;
+		if (attempt > 0) {
+			log(3, "retransmit %llu to %s (attempt %i)\n", (unsigned long long)deliveryId, idToStr(target).c_str(), attempt);
+		}
+		Buffer packet(data.data(), (int)data.size());
+		if (multipath) {
+			sendToNextPeers(target, packet, multipathCount);
+		}
+		else {
+			sendToNextPeer(target, packet, PeerId(0), attempt);
+		}
+	}
+
+	void PeerNetwork::completeDelivery(uint64_t deliveryId, PeerId source, ErrorCode error) {
+		std::unique_lock<std::mutex> lock(deliveryMutex);
+		auto entry = pendingDeliveries.find(deliveryId);
+		if (entry == pendingDeliveries.end()) {
+			return;
+		}
+		PendingDelivery& pending = entry->second;
+		if (source != PeerId(0) && source != pending.target) {
+			return;
+		}
+
+		//only unambiguous samples are used, an ack after a retransmission could belong to either transmission
+		PeerId target = pending.target;
+		float sampleMs = 0;
+		if (!error && pending.attempts == 1) {
+			sampleMs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - pending.sendTime).count() / 1000.0f;
+			auto rtt = deliveryRtts.find(pending.target);
+			if (rtt == deliveryRtts.end()) {
+				RttEstimate& estimate = deliveryRtts[pending.target];
+				estimate.smoothedMs = sampleMs;
+				estimate.variationMs = sampleMs / 2;
+			}
+			else {
+				RttEstimate& estimate = rtt->second;
+				estimate.variationMs = 0.75f * estimate.variationMs + 0.25f * std::abs(estimate.smoothedMs - sampleMs);
+				estimate.smoothedMs = 0.875f * estimate.smoothedMs + 0.125f * sampleMs;
+			}
+		}
+
+		DeliveryCallback callback = std::move(pending.callback);
+		TimerWheel::TimerId timer = pending.timer;
+		pendingDeliveries.erase(entry);
+		lock.unlock();
+
+		if (sampleMs > 0) {
+			updatePeerRtt(target, sampleMs);
+		}
+
+		if (error != ErrorCode::TIME_OUT) {
+			timers.cancel(timer);
+		}
+		if (callback) {
+			callback(error);
+		}
+	}
+
+	void PeerNetwork::failAllDeliveries(ErrorCode error) {
+		std::vector<uint64_t> ids;
+		deliveryMutex.lock();
+		for (auto& i : pendingDeliveries) {
+			ids.push_back(i.first);
+		}
+		deliveryMutex.unlock();
+
+		for (auto id : ids) {
+			completeDelivery(id, PeerId(0), error);
+		}
+	}
+
+	bool PeerNetwork::isNewDelivery(PeerId source, uint64_t deliveryId, std::chrono::steady_clock::time_point* firstArrival) {
+		std::unique_lock<std::mutex> lock(deliveryMutex);
+		auto now = std::chrono::steady_clock::now();
+		while (!seenDeliveryOrder.empty() && now - seenDeliveryOrder.front().first > std::chrono::milliseconds(deliveryDuplicateWindowMs)) {
+			seenDeliveries.erase(seenDeliveryOrder.front().second);
+			seenDeliveryOrder.pop_front();
+		}
+
+		auto key = std::make_pair(source, deliveryId);
+		auto entry = seenDeliveries.find(key);
+		if (entry != seenDeliveries.end()) {
+			if (firstArrival) {
+				*firstArrival = entry->second;
+			}
+			return false;
+		}
+		seenDeliveries[key] = now;
+		seenDeliveryOrder.push_back({ now, key });
+		if (firstArrival) {
+			*firstArrival = now;
+		}
+		return true;
+	}
+
+	void PeerNetwork::sendMultipath(PeerId id, Buffer& payload) {
+		if (id == localId) {
+			if (readCallback) {
+				Buffer message(payload.data(), payload.size());
+				readCallback(localId, message);
+			}
+			return;
+		}
+
+		trackTraffic(id);
+		deliveryMutex.lock();
+		uint64_t messageId = ++nextDeliveryId;
+		deliveryMutex.unlock();
+
+		Buffer packet;
+		createPacketRoute(packet, localId, id, 1);
+		packet.write(Opcode::MULTIPATH_MESSAGE);
+		packet.write(messageId);
+		int pathOffset = packet.getWriteIndex();
+		packet.write((uint8_t)0);
+		packet.writeBytes(payload.data(), payload.size());
+		sendToNextPeers(id, packet, multipathCount, pathOffset);
+	}
+
+	void PeerNetwork::onPathArrival(int path, bool first, std::chrono::steady_clock::time_point firstArrival) {
+		std::unique_lock<std::mutex> lock(deliveryMutex);
+		if (path >= pathStats.size()) {
+			pathStats.resize(path + 1);
+		}
+		PathStats& stats = pathStats[path];
+		stats.arrivals++;
+		if (first) {
+			stats.wins++;
+		}
+		else {
+			stats.lagMs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - firstArrival).count() / 1000.0;
+		}
+	}
+
+	std::vector<PeerNetwork::PathStats> PeerNetwork::getPathStats() {
+		std::unique_lock<std::mutex> lock(deliveryMutex);
+		return pathStats;
+	}
+
+	int PeerNetwork::getDeliveryTimeout(PeerId target) {
+		auto rtt = deliveryRtts.find(target);
+		if (rtt == deliveryRtts.end()) {
+			return deliveryInitialTimeoutMs;
+		}
+		int timeoutMs = (int)(rtt->second.smoothedMs + 4 * rtt->second.variationMs);
+		return std::clamp(timeoutMs, deliveryMinTimeoutMs, deliveryMaxTimeoutMs);
+	}
+
+	void PeerNetwork::trackTraffic(PeerId target) {
+		if (shortcutThreshold <= 0 || target == localId) {
+			return;
+		}
+
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		Peer* direct = routingTable.get(target);
+		if (direct) {
+			if (direct->shortcut) {
+				auto entry = std::find(shortcuts.begin(), shortcuts.end(), target);
+				if (entry != shortcuts.end()) {
+					shortcuts.splice(shortcuts.begin(), shortcuts, entry);
+				}
+			}
+			return;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (now - trafficWindowStart > std::chrono::milliseconds(shortcutIntervalMs)) {
+			trafficCounts.clear();
+			trafficWindowStart = now;
+			//attempts whose connection never finished the handshake, like one to a peer that answered with another id, are given up
+			for (auto entry = pendingShortcuts.begin(); entry != pendingShortcuts.end();) {
+				if (now - entry->second > std::chrono::milliseconds(shortcutTimeoutMs)) {
+					entry = pendingShortcuts.erase(entry);
+				}
+				else {
+					entry++;
+				}
+			}
+		}
+		if (++trafficCounts[target] < shortcutThreshold || pendingShortcuts.contains(target)) {
+			return;
+		}
+		pendingShortcuts[target] = now;
+		lock.unlock();
+
+		//the address of the destination is only known to the peers close to it
+		log(3, "shortcut lookup %s\n", idToStr(target).c_str());
+		findNodes(target, [this, target](std::vector<Peer>& closest) {
+			std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+			if (!closest.empty() && closest[0].id == target && !routingTable.has(target)) {
+				connectToPeer(closest[0].address, closest[0].port, [this, target](Connection* conn, ErrorCode error) {
+					if (!conn) {
+						std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+						pendingShortcuts.erase(target);
+					}
+				});
+				return;
+			}
+			pendingShortcuts.erase(target);
+		});
+	}
+
+	//routingTableMutex must be locked by the caller
+	void PeerNetwork::addShortcut(Peer* peer) {
+		pendingShortcuts.erase(peer->id);
+		peer->shortcut = true;
+		shortcuts.push_front(peer->id);
+		log(3, "shortcut %s\n", idToStr(peer->id).c_str());
+
+		while (shortcuts.size() > maxShortcuts) {
+			Peer* old = routingTable.get(shortcuts.back());
+			shortcuts.pop_back();
+			if (old && old->shortcut) {
+				//a shortcut that became the only peer of a bucket is kept as a regular peer
+				old->shortcut = false;
+				if (!isOnlyPeerInBucket(old)) {
+					disconnectFromPeer(old);
+				}
+			}
+		}
+	}
+
+	//routingTableMutex must be locked by the caller
+	void PeerNetwork::checkBucketCapacity(Peer* peer) {
+		if (peer->shortcut || peer == entryNode || !routingTable.isBucketFull(peer->id, peer)) {
+			return;
+		}
+
+		if (!peer->conn->outbound && bucketGracePeriodMs > 0) {
+			PeerId id = peer->id;
+			Connection* conn = peer->conn;
+			timers.add(bucketGracePeriodMs, [this, id, conn]() {
+				std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+				Peer* peer = routingTable.get(conn);
+				if (peer && peer->id == id && peer->state == Peer::CONNECTED && !peer->dropped && !peer->shortcut) {
+					if (routingTable.isBucketFull(id, peer)) {
+						evictFromBucket(peer);
+					}
+				}
+			});
+			return;
+		}
+		evictFromBucket(peer);
+	}
+
+	//routingTableMutex must be locked by the caller
+	void PeerNetwork::evictFromBucket(Peer* peer) {
+		//long lived peers keep their slot as long as they respond, only one liveness check per bucket runs at a time
+		int index = routingTable.getLookupIndex(peer->id);
+		Peer* oldest = routingTable.getLeastRecentlySeen(index, peer);
+		auto now = std::chrono::steady_clock::now();
+		if (!oldest || !oldest->conn || pendingBucketChecks.contains(index) || now - oldest->detector.getLastHeartbeat() < std::chrono::milliseconds(bucketPingTimeoutMs)) {
+			log(3, "bucket %i full, keeping %s as replacement\n", index, idToStr(peer->id).c_str());
+			dropPeer(peer, true);
+			return;
+		}
+
+		pendingBucketChecks.insert(index);
+		Buffer packet;
+		packet.write(Opcode::PING);
+		packet.write((int64_t)std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count());
+		oldest->conn->write(packet);
+
+		PeerId oldestId = oldest->id;
+		PeerId newId = peer->id;
+		timers.add(bucketPingTimeoutMs, [this, index, oldestId, newId, now]() {
+			std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+			pendingBucketChecks.erase(index);
+			Peer* oldest = routingTable.get(oldestId);
+			Peer* peer = routingTable.get(newId);
+			if (oldest && oldest != routingTable.localPeer.get() && oldest->state == Peer::CONNECTED && oldest->detector.getLastHeartbeat() <= now) {
+				log(3, "evicting unresponsive %s from bucket %i\n", idToStr(oldestId).c_str(), index);
+				dropPeer(oldest, false);
+			}
+			else if (peer && peer != routingTable.localPeer.get() && peer->state == Peer::CONNECTED && routingTable.isBucketFull(newId, peer)) {
+				dropPeer(peer, true);
+			}
+		});
+	}
+
+	//routingTableMutex must be locked by the caller
+	void PeerNetwork::dropPeer(Peer* peer, bool keepAsReplacement) {
+		if (keepAsReplacement) {
+			routingTable.addReplacement(*peer);
+		}
+		peer->dropped = true;
+		if (peer->conn) {
+			disconnectFromPeer(peer, keepAsReplacement ? DISCONNECT_BUCKET_FULL : DISCONNECT_NONE);
+		}
+	}
+
+	//routingTableMutex must be locked by the caller
+	void PeerNetwork::refreshBucket(PeerId id) {
+		//peers that joined after the bucket was looked up are only known to the peers they connected to
+		int index = routingTable.getLookupIndex(id);
+		if (routingTable.getBucketSize(index) > 0) {
+			return;
+		}
+		auto now = std::chrono::steady_clock::now();
+		auto last = bucketRefreshes.find(index);
+		if (last != bucketRefreshes.end() && now - last->second < std::chrono::milliseconds(bucketRefreshIntervalMs)) {
+			return;
+		}
+		bucketRefreshes[index] = now;
+		log(3, "refreshing empty bucket %i\n", index);
+		std::unique_lock<std::mutex> lock(lookupMutex);
+		startLookup(routingTable.getLookupTarget(index));
+	}
+
+	//routingTableMutex must be locked by the caller
+	bool PeerNetwork::isOnlyPeerInBucket(Peer* peer) {
+		int index = routingTable.getLookupIndex(peer->id);
+		for (auto& other : routingTable.peers) {
+			if (other.get() != peer && other->state == Peer::CONNECTED && !other->shortcut) {
+				if (routingTable.getLookupIndex(other->id) == index) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	void PeerNetwork::probeRtts() {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		for (auto& peer : routingTable.peers) {
+			if (peer->state == Peer::CONNECTED && peer->conn) {
+				Buffer packet;
+				packet.write(Opcode::PING);
+				packet.write(now);
+				peer->conn->write(packet);
+			}
+		}
+		lock.unlock();
+
+		if (timers.isRunning() && rttProbeIntervalMs > 0) {
+			timers.add(rttProbeIntervalMs, [this]() {
+				probeRtts();
+			});
+		}
+	}
+
+	void PeerNetwork::sendHeartbeats() {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		auto now = std::chrono::steady_clock::now();
+		Buffer packet;
+		packet.write(Opcode::HEARTBEAT);
+		for (auto& peer : routingTable.peers) {
+			if (peer->state != Peer::CONNECTED || !peer->conn) {
+				continue;
+			}
+
+			double phi = peer->detector.getPhi(now);
+			if (phi > phiThreshold) {
+				//the connection might be half open, the disconnect callback starts a replacement lookup
+				log(1, "peer %s suspected (phi %.1f), disconnecting\n", idToStr(peer->id).c_str(), phi);
+				peer->state = Peer::DISCONNECTED;
+				peer->conn->disconnect();
+				continue;
+			}
+
+			//any other packet send in the interval serves as heartbeat
+			if (now - peer->conn->getLastWriteTime() >= std::chrono::milliseconds(heartbeatIntervalMs)) {
+				peer->conn->write(packet);
+			}
+		}
+		lock.unlock();
+
+		if (timers.isRunning() && heartbeatIntervalMs > 0) {
+			timers.add(heartbeatIntervalMs, [this]() {
+				sendHeartbeats();
+			});
+		}
+	}
+
+	void PeerNetwork::updatePeerRtt(PeerId id, float sampleMs) {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		Peer* peer = routingTable.get(id);
+		if (!peer || peer->state != Peer::CONNECTED) {
+			return;
+		}
+		if (peer->rttMs == 0) {
+			peer->rttMs = sampleMs;
+		}
+		else {
+			peer->rttMs = 0.875f * peer->rttMs + 0.125f * sampleMs;
+		}
+
+		//contacts remember the rtt to prefer close peers when filling buckets
+		std::unique_lock<std::mutex> lookupLock(lookupMutex);
+		auto contact = contacts.find(id);
+		if (contact != contacts.end()) {
+			contact->second.rttMs = peer->rttMs;
+		}
+	}
+
+	void PeerNetwork::connectToPeer(const std::string& address, uint16_t port, const Server::ConnectCallback& callback) {
+		server.connectAsClientAsync(address, port, callback);
+	}
+
+	void PeerNetwork::disconnectFromPeer(Peer* peer, DisconnectReason reason) {
+		Buffer reply;
+		reply.write(Opcode::DISCONNECT);
+		reply.write(reason);
+		peer->conn->write(reply);
+		peer->conn->disconnect();
+	}
+
+	//routingTableMutex must be locked by the caller
+	bool PeerNetwork::closeDuplicate(Peer* peer) {
+		Peer* other = nullptr;
+		for (auto& p : routingTable.peers) {
+			if (p.get() != peer && p->id == peer->id && p->state == Peer::CONNECTED && !p->dropped) {
+				other = p.get();
+				break;
+			}
+		}
+		if (!other) {
+			return false;
+		}
+
+		//both sides keep the connection that was opened by the peer with the lower id
+		//when one peer opened both, that peer closes the newer one and the other side waits for it
+		PeerId opener = peer->conn->outbound ? localId : peer->id;
+		PeerId otherOpener = other->conn->outbound ? localId : other->id;
+		Peer* loser = nullptr;
+		if (opener != otherOpener) {
+			loser = opener < otherOpener ? other : peer;
+		}
+		else if (opener == localId) {
+			loser = peer;
+		}
+		if (!loser) {
+			return false;
+		}
+		Peer* winner = loser == peer ? other : peer;
+
+		log(3, "duplicate connection to %s\n", idToStr(peer->id).c_str());
+		if (loser == entryNode) {
+			entryNode = winner;
+			//the handshake of the kept connection already finished, so the join continues on it
+			if (getState() == State::CONNECTING_TO_ENTRY_NODE) {
+				onEntryNodeConnected();
+			}
+		}
+		if (loser->shortcut) {
+			winner->shortcut = true;
+			loser->shortcut = false;
+		}
+		if (loser == peer) {
+			pendingShortcuts.erase(peer->id);
+		}
+		if (winner->rttMs == 0) {
+			winner->rttMs = loser->rttMs;
+		}
+
+		//frames written before the disconnect are still delivered, the peer closes the connection when it reads it
+		loser->dropped = true;
+		loser->state = Peer::DISCONNECTED;
+		closeDropped(loser->conn, loser->id, std::chrono::steady_clock::now());
+		return loser == peer;
+	}
+
+	//routingTableMutex must be locked by the caller
+	void PeerNetwork::closeDropped(Connection* conn, PeerId id, std::chrono::steady_clock::time_point start) {
+		//the DISCONNECT is written on the control stream and would overtake frames still queued on the other streams
+		if (!conn->isWriteQueueEmpty() && std::chrono::steady_clock::now() - start < std::chrono::milliseconds(closeTimeoutMs)) {
+			timers.add(10, [this, conn, id, start]() {
+				std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+				Peer* peer = routingTable.get(conn);
+				if (peer && peer->dropped && peer->id == id) {
+					closeDropped(conn, id, start);
+				}
+			});
+			return;
+		}
+
+		Buffer packet;
+		packet.write(Opcode::DISCONNECT);
+		packet.write(DISCONNECT_DUPLICATE);
+		conn->write(packet);
+		conn->shutdown();
+		timers.add(closeTimeoutMs, [this, conn, id]() {
+			std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+			Peer* peer = routingTable.get(conn);
+			if (peer && peer->dropped && peer->id == id) {
+				conn->disconnect();
+			}
+		});
+	}
+
+	void PeerNetwork::onEntryNodeConnected() {
+		if (clientOnly) {
+			setState(State::CONNECTED);
+		}
+		else {
+			setState(State::SENDING_LOOKUPS);
+			performLookups();
+		}
+	}
+
+	void PeerNetwork::performLookups() {
+		//looking up the own id fills the close buckets, the remaining buckets are looked up when it finishes
+		std::unique_lock<std::mutex> lock(lookupMutex);
+		startLookup(localId);
+		setState(State::LOOKUPS_SEND);
+		if (lookups.empty()) {
+			lock.unlock();
+			onLookupsFinished();
+		}
+	}
+
+	//lookupMutex must be locked by the caller
+	void PeerNetwork::startLookup(PeerId target, bool fillBucket, const LookupCallback& callback) {
+		auto entry = lookups.find(target);
+		if (entry != lookups.end()) {
+			if (callback) {
+				entry->second.callbacks.push_back(callback);
+			}
+			return;
+		}
+
+		Lookup& lookup = lookups[target];
+		lookup.target = target;
+		lookup.fillBucket = fillBucket;
+		if (callback) {
+			lookup.callbacks.push_back(callback);
+		}
+		stepLookup(lookup);
+		if (lookup.pending.empty()) {
+			if (callback) {
+				lookupCompletions.push_back({ callback, {} });
+			}
+			lookups.erase(target);
+			return;
+		}
+
+		if (!lookupThreadRunning) {
+			if (lookupThread) {
+				lookupThread->join();
+				lookupThread = nullptr;
+			}
+			lookupThreadRunning = true;
+			lookupThread = std::make_shared<std::thread>([&]() {
+				runLookupTimer();
+			});
+		}
+	}
+
+	//lookupMutex must be locked by the caller
+	void PeerNetwork::stepLookup(Lookup& lookup) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(lookupTimeoutMs);
+		if (!lookup.closest.empty()) {
+			//queries through relays farther away than the closest contact would end at the same node
+			PeerId closestDist = lookup.target ^ lookup.closest.front();
+			for (auto i = lookup.pending.begin(); i != lookup.pending.end();) {
+				if ((lookup.target ^ i->first) >= closestDist) {
+					i = lookup.pending.erase(i);
+				}
+				else {
+					i++;
+				}
+			}
+		}
+
+		while (lookup.pending.size() < lookupConcurrency && lookup.queried.size() < lookupMaxQueries) {
+			//use the closest connected peer that was not asked yet as relay
+			Peer* relay = nullptr;
+			PeerId relayDist;
+			for (auto& peer : routingTable.peers) {
+				if (peer && peer->conn && peer->state == Peer::CONNECTED && !lookup.queried.contains(peer->id)) {
+					PeerId dist = lookup.target ^ peer->id;
+					if (!relay || dist < relayDist) {
+						relay = peer.get();
+						relayDist = dist;
+					}
+				}
+			}
+			if (!relay) {
+				break;
+			}
+
+			//converged, no relay is closer to the target than the closest known contact
+			if (!lookup.closest.empty() && relayDist >= (lookup.target ^ lookup.closest.front())) {
+				break;
+			}
+
+			Buffer packet;
+			createPacketRoute(packet, localId, lookup.target, 0);
+			createPacketFindNode(packet, localId, relay->id, lookup.target, lookupResultCount);
+			lookup.queried.insert(relay->id);
+			lookup.pending[relay->id] = deadline;
+			relay->conn->write(packet);
+		}
+	}
+
+	void PeerNetwork::stepAllLookups() {
+		std::unique_lock<std::mutex> lock(lookupMutex);
+		for (auto& i : lookups) {
+			stepLookup(i.second);
+		}
+	}
+
+	void PeerNetwork::onLookupReply(PeerId relay, PeerId target, std::vector<Peer>& replyContacts) {
+		std::vector<Peer> connects;
+		std::unique_lock<std::mutex> lock(lookupMutex);
+		for (auto& contact : replyContacts) {
+			if (contact.id != localId) {
+				Peer& known = contacts[contact.id];
+				float rttMs = known.rttMs;
+				known = contact;
+				known.rttMs = rttMs;
+			}
+		}
+
+		auto i = lookups.find(target);
+		if (i == lookups.end()) {
+			return;
+		}
+
+		//late replies of timed out queries only contribute their contacts, the queries in flight are not touched
+		Lookup& lookup = i->second;
+		lookup.pending.erase(relay);
+
+		for (auto& contact : replyContacts) {
+			if (contact.id == localId) {
+				continue;
+			}
+			if (std::find(lookup.closest.begin(), lookup.closest.end(), contact.id) == lookup.closest.end()) {
+				PeerId dist = target ^ contact.id;
+				auto pos = lookup.closest.begin();
+				while (pos != lookup.closest.end() && (target ^ *pos) < dist) {
+					pos++;
+				}
+				lookup.closest.insert(pos, contact.id);
+			}
+		}
+		if (lookup.closest.size() > lookupResultCount) {
+			lookup.closest.resize(lookupResultCount);
+		}
+
+		stepLookup(lookup);
+		bool finished = false;
+		if (lookup.pending.empty()) {
+			Lookup done = std::move(lookup);
+			lookups.erase(i);
+			finishLookup(done, connects);
+			finished = lookups.empty();
+		}
+		lock.unlock();
+
+		connectToContacts(connects);
+		if (finished) {
+			onLookupsFinished();
+		}
+	}
+
+	//lookupMutex must be locked by the caller
+	void PeerNetwork::finishLookup(Lookup& lookup, std::vector<Peer>& connects) {
+		auto addBest = [&](PeerId target) {
+			//connect to the known contact closest to the target that lies in the targets bucket
+			int index = routingTable.getLookupIndex(target);
+			Peer* best = nullptr;
+			auto now = std::chrono::steady_clock::now();
+			for (auto& i : contacts) {
+				auto rejection = rejectedBy.find(i.first);
+				if (rejection != rejectedBy.end()) {
+					if (rejection->second > now) {
+						continue;
+					}
+					rejectedBy.erase(rejection);
+				}
+				if (routingTable.getLookupIndex(i.first) == index) {
+					if (!best || (target ^ i.first) < (target ^ best->id)) {
+						best = &i.second;
+					}
+				}
+			}
+			if (best && proximityRouting) {
+				//a contact with a measured low rtt is preferred over a slightly closer one
+				int bit = PeerRoutingTable::getHighestBit(target ^ best->id);
+				for (auto& i : contacts) {
+					if (i.second.rttMs > 0 && (best->rttMs == 0 || i.second.rttMs < best->rttMs) && !rejectedBy.contains(i.first)) {
+						if (routingTable.getLookupIndex(i.first) == index && PeerRoutingTable::getHighestBit(target ^ i.first) == bit) {
+							best = &i.second;
+						}
+					}
+				}
+			}
+			if (best) {
+				if (entryNode && best->id == entryNode->id) {
+					wasEntryNodeLookedUp = true;
+				}
+				connects.push_back(*best);
+			}
+			return best != nullptr;
+		};
+
+		if (!lookup.callbacks.empty()) {
+			std::vector<Peer> closest;
+			for (auto& id : lookup.closest) {
+				closest.push_back(contacts[id]);
+			}
+			for (auto& callback : lookup.callbacks) {
+				lookupCompletions.push_back({ callback, closest });
+			}
+		}
+
+		if (!lookup.fillBucket) {
+			return;
+		}
+
+		if (lookup.target == localId) {
+			//buckets that are already covered by known contacts need no lookup of their own
+			for (int i = 0; i < lookupCountOnConnect; i++) {
+				PeerId target = routingTable.getLookupTarget(i);
+				if (!addBest(target)) {
+					startLookup(target);
+				}
+			}
+		}
+		else {
+			addBest(lookup.target);
+		}
+	}
+
+	void PeerNetwork::onLookupsFinished() {
+		if (getState() == State::LOOKUPS_SEND) {
+			if (entryNode && !wasEntryNodeLookedUp) {
+				disconnectFromPeer(entryNode);
+				entryNode = nullptr;
+			}
+			setState(State::CONNECTED);
+		}
+	}
+
+	void PeerNetwork::runLookupTimer() {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(lookupMutex);
+				if (lookups.empty()) {
+					lookupThreadRunning = false;
+					break;
+				}
+				lookupCondition.wait_for(lock, std::chrono::milliseconds(std::max(1, lookupTimeoutMs / 4)));
+			}
+
+			bool finished = false;
+			std::vector<Peer> connects;
+			std::unique_lock<std::recursive_mutex> routingLock(routingTableMutex);
+			std::unique_lock<std::mutex> lock(lookupMutex);
+
+			auto now = std::chrono::steady_clock::now();
+			for (auto i = lookups.begin(); i != lookups.end();) {
+				Lookup& lookup = i->second;
+				for (auto j = lookup.pending.begin(); j != lookup.pending.end();) {
+					if (j->second <= now) {
+						log(3, "lookup timeout %s relay %s\n", idToStr(lookup.target).c_str(), idToStr(j->first).c_str());
+						j = lookup.pending.erase(j);
+					}
+					else {
+						j++;
+					}
+				}
+
+				stepLookup(lookup);
+				if (lookup.pending.empty()) {
+					Lookup done = std::move(lookup);
+					i = lookups.erase(i);
+					finishLookup(done, connects);
+					finished = lookups.empty();
+				}
+				else {
+					i++;
+				}
+			}
+			lock.unlock();
+
+			connectToContacts(connects);
+			if (finished) {
+				onLookupsFinished();
+			}
+			routingLock.unlock();
+			runLookupCompletions();
+		}
+	}
+
+	void PeerNetwork::runLookupCompletions() {
+		std::vector<std::pair<LookupCallback, std::vector<Peer>>> completions;
+		lookupMutex.lock();
+		completions.swap(lookupCompletions);
+		lookupMutex.unlock();
+
+		for (auto& completion : completions) {
+			completion.first(completion.second);
+		}
+	}
+
+	void PeerNetwork::connectToContacts(std::vector<Peer>& connects) {
+		for (auto& contact : connects) {
+			if (!lookupReplyTargets.contains(contact.id)) {
+				lookupReplyTargets.insert(contact.id);
+				routingTableMutex.lock();
+				if (!routingTable.has(contact.id) && contact.id != localId) {
+					if (routingTable.isBucketFull(contact.id)) {
+						routingTable.addReplacement(contact);
+					}
+					else {
+						connectToPeer(contact.address, contact.port);
+					}
+				}
+				routingTableMutex.unlock();
+			}
+		}
+	}
+
+	void PeerNetwork::onConnect(Connection* conn) {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		Peer peer;
+		peer.conn = conn;
+		peer.address = conn->socket->getEndpoint().getAddress();
+		peer.port = conn->socket->getEndpoint().getPort();
+		peer.state = Peer::PRE_HANDSHAKE;
+		//a peer may skip heartbeats for up to two intervals when it wrote other packets in between
+		peer.detector.initialIntervalMs = (float)heartbeatIntervalMs;
+		peer.detector.acceptablePauseMs = 2.0f * heartbeatIntervalMs;
+		peer.detector.heartbeat(std::chrono::steady_clock::now());
+
+		routingTable.add(peer);
+		for (int i = 0; i < linkFlowStreams; i++) {
+			conn->setStreamPriority(LINK_FLOWS + i, Connection::PRIORITY_INTERACTIVE);
+		}
+
+		if (conn->outbound) {
+			Buffer packet;
+			createPacketHandshake(packet, localId, routingTable.localPeer->port, routingTable.localPeer->address);
+			conn->write(packet);
+		}
+	}
+
+	void PeerNetwork::onDisconnect(Connection* conn) {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		Peer* peer = routingTable.get(conn);
+		if (!peer) {
+			return;
+		}
+		peer->state = Peer::DISCONNECTED;
+		PeerId id = peer->id;
+		bool shortcut = peer->shortcut;
+		bool dropped = peer->dropped;
+		if (peer == entryNode) {
+			entryNode = nullptr;
+		}
+		routingTable.remove(conn);
+
+		if (shortcut) {
+			shortcuts.remove(id);
+		}
+		else if (!dropped && server.isRunning()) {
+			int index = routingTable.getLookupIndex(id);
+			Peer replacement;
+			if (routingTable.takeReplacement(index, replacement)) {
+				log(3, "replacing %s with %s\n", idToStr(id).c_str(), idToStr(replacement.id).c_str());
+				connectToPeer(replacement.address, replacement.port);
+			}
+			else {
+				std::unique_lock<std::mutex> lookupLock(lookupMutex);
+				startLookup(routingTable.getLookupTarget(index));
+			}
+		}
+	}
+
+	void PeerNetwork::processPacket(Peer* peer, Buffer& packet, PeerId routingSource, bool wasSendDirectly, std::unique_lock<std::recursive_mutex>& lock) {
+		if (!peer) {
+			return;
+		}
+
+		if (debugFakeLatency && wasSendDirectly) {
+			if (getState() == State::CONNECTED) {
+				uint32_t time;
+				randomBytes(time);
+				time = time % 1000;
+				std::this_thread::sleep_for(std::chrono::milliseconds(time));
+			}
+		}
+
+		int startReadIndex = packet.getReadIndex();
+		Opcode opcode = packet.read<Opcode>();
+
+		log(4, "packet: %s\n", getOpcodeName(opcode));
+
+		switch (opcode) {
+		case PING: {
+			//rtt probes carry a timestamp that is echoed back
+			Buffer reply;
+			createPacketRoute(reply, localId, routingSource, 1);
+			reply.write(Opcode::PONG);
+			if (packet.size() > 0) {
+				reply.writeBytes(packet.data(), packet.size());
+			}
+			writeUnlocked(peer->conn, reply, LINK_CONTROL, lock);
+			break;
+		}
+		case PONG: {
+			if (packet.size() >= sizeof(int64_t)) {
+				int64_t sendTime = packet.read<int64_t>();
+				int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+				if (routingSource == peer->id) {
+					updatePeerRtt(routingSource, (now - sendTime) / 1000.0f);
 				}
+				log(4, "rtt: %s %.3f ms\n", idToStr(routingSource).c_str(), peer->rttMs);
+			}
+			else {
+				log(2, "ping: %s\n", idToStr(routingSource).c_str());
 			}
+			break;
+		}
+		case HANDSHAKE: {
+			if (wasSendDirectly) {
+				peer->id = packet.read<PeerId>();
+				peer->port = packet.read<uint16_t>();
+				peer->address = packet.readStr();
 
+				log(4, "handshake %s %i %s\n", idToStr(peer->id).c_str(), peer->port, peer->address.c_str());
 
-			if (!lookupReplyTargets.contains(source)) {
-				lookupReplyTargets.insert(source);
-				routingTableMutex.lock();
-				if (!routingTable.has(source) && source != localId) {
-					connectToPeer(address, port);
+				Buffer reply;
+				reply.write(Opcode::HANDSHAKE_REPLY);
+				reply.write(localId);
+				reply.write(routingTable.localPeer->port);
+				reply.writeStr(routingTable.localPeer->address);
+				writeFeatures(reply);
+				//the peer is only removed by this thread, so it stays valid while the table is unlocked
+				//it is not used for routing before the reply was written, so the reply is the first frame the peer reads
+				writeUnlocked(peer->conn, reply, LINK_CONTROL, lock);
+				lock.lock();
+				peer->state = Peer::CONNECTED;
+				readFeatures(peer, packet);
+				if (closeDuplicate(peer)) {
+					break;
 				}
-				routingTableMutex.unlock();
+				checkBucketCapacity(peer);
+
+				if (getState() == State::CONNECTING_TO_ENTRY_NODE) {
+					if (peer == entryNode) {
+						setState(State::CONNECTED);
+					}
+				}
+				break;
 			}
+		}
+		case HANDSHAKE_REPLY: {
+			if (wasSendDirectly) {
+				peer->id = packet.read<PeerId>();
+				peer->port = packet.read<uint16_t>();
+				peer->address = packet.readStr();
+				peer->state = Peer::CONNECTED;
+				readFeatures(peer, packet);
+
+				log(4, "handshake reply %s %i %s\n", idToStr(peer->id).c_str(), peer->port, peer->address.c_str());
+				if (closeDuplicate(peer)) {
+					break;
+				}
+
+				if (pendingShortcuts.contains(peer->id)) {
+					addShortcut(peer);
+				}
+				checkBucketCapacity(peer);
 
-			lookupTargets.erase(target);
-			if (entryNode) {
-				if (lookupTargets.empty()) {
-					if (getState() == State::LOOKUPS_SEND) {
-						if (!wasEntryNodeLookedUp) {
-							disconnectFromPeer(entryNode);
-							entryNode = nullptr;
+				if (getState() == State::CONNECTING_TO_ENTRY_NODE) {
+					if (peer == entryNode) {
+						onEntryNodeConnected();
+					}
+				}
+				else if (getState() == State::CONNECTING_TO_CACHED_PEERS) {
+					int connected = 0;
+					for (auto& p : routingTable.peers) {
+						if (p->state == Peer::CONNECTED) {
+							connected++;
 						}
-						setState(State::CONNECTED);
 					}
+					if (connected >= std::min(peerCacheMinPeers, cachedPeersConnecting)) {
+						onCachedPeersConnected();
+					}
+				}
+				else {
+					//a new peer might be a closer relay for running lookups
+					stepAllLookups();
 				}
 			}
+			break;
+		}
+		case LOOKUP: {
+			PeerId source = packet.read<PeerId>();
+			PeerId relay = packet.read<PeerId>();
+			PeerId target = packet.read<PeerId>();
+
+			log(4, "lookup %s %s %s\n", idToStr(source).c_str(), idToStr(relay).c_str(), idToStr(target).c_str());
 
+			Buffer reply;
+			if (relay != localId) {
+				createPacketRelayedRoute(reply, localId, relay, source);
+			}
+			else {
+				createPacketRoute(reply, localId, source, 1);
+			}
+			createPacketLookupReply(reply, localId, target, routingTable.localPeer->port, routingTable.localPeer->address, relay);
+			writeUnlocked(peer->conn, reply, LINK_CONTROL, lock);
 			break;
 		}
-		case ROUTE: {
+		case LOOKUP_REPLY: {
+			Peer contact;
+			contact.id = packet.read<PeerId>();
+			PeerId target = packet.read<PeerId>();
+			contact.port = packet.read<uint16_t>();
+			contact.address = packet.readStr();
+			PeerId relay = packet.read<PeerId>();
+
+			log(4, "lookup reply %s %s %i %s\n", idToStr(contact.id).c_str(), idToStr(target).c_str(), contact.port, contact.address.c_str());
+
+			std::vector<Peer> replyContacts = { contact };
+			onLookupReply(relay, target, replyContacts);
+			lock.unlock();
+			runLookupCompletions();
+			break;
+		}
+		case FIND_NODE: {
 			PeerId source = packet.read<PeerId>();
+			PeerId relay = packet.read<PeerId>();
 			PeerId target = packet.read<PeerId>();
-			uint8_t exact = packet.read<uint8_t>();
+			uint8_t count = packet.read<uint8_t>();
 
-			log(4, "route %s %s %i\n", idToStr(source).c_str(), idToStr(target).c_str(), exact);
+			log(4, "find node %s %s %s\n", idToStr(source).c_str(), idToStr(relay).c_str(), idToStr(target).c_str());
 
-			Peer *next = routingTable.getNext(target, peer->id, true);
-			if (next == routingTable.localPeer.get()) {
-				if (!exact || target == localId) {
-					processPacket(peer, packet, source, false);
+			std::vector<Peer*> closest = routingTable.getClosest(target, count, true);
+			Buffer reply;
+			Peer* direct = routingTable.get(source);
+			if (direct && direct->conn && direct->state == Peer::CONNECTED) {
+				//reply directly when the source is a neighbor instead of routing over the relay
+				createPacketRoute(reply, localId, source, 1);
+				createPacketFindNodeReply(reply, localId, relay, target, closest);
+				writeUnlocked(direct->conn, reply, LINK_CONTROL, lock);
+				break;
+			}
+			if (relay != localId) {
+				createPacketRelayedRoute(reply, localId, relay, source);
+			}
+			else {
+				createPacketRoute(reply, localId, source, 1);
+			}
+			createPacketFindNodeReply(reply, localId, relay, target, closest);
+			writeUnlocked(peer->conn, reply, LINK_CONTROL, lock);
+			break;
+		}
+		case FIND_NODE_REPLY: {
+			PeerId source = packet.read<PeerId>();
+			PeerId relay = packet.read<PeerId>();
+			PeerId target = packet.read<PeerId>();
+			uint8_t count = packet.read<uint8_t>();
+
+			std::vector<Peer> replyContacts;
+			for (int i = 0; i < count; i++) {
+				Peer contact;
+				if (readContact(packet, contact)) {
+					replyContacts.push_back(contact);
+				}
+			}
+
+			log(4, "find node reply %s %s %i contacts\n", idToStr(source).c_str(), idToStr(target).c_str(), (int)replyContacts.size());
+
+			onLookupReply(relay, target, replyContacts);
+			lock.unlock();
+			runLookupCompletions();
+			break;
+		}
+		case ROUTE: {
+			//flat header, relays do not look at the packet behind it
+			PeerId source = packet.read<PeerId>();
+			PeerId target = packet.read<PeerId>();
+			uint8_t flags = packet.read<uint8_t>();
+			uint8_t ttl = packet.read<uint8_t>();
+			uint8_t hops = packet.read<uint8_t>();
+			PeerId relay = (flags & ROUTE_RELAY) ? packet.read<PeerId>() : target;
+			uint8_t* header = packet.data() - (packet.getReadIndex() - startReadIndex);
+
+			log(4, "route %s %s %i ttl %i hops %i\n", idToStr(source).c_str(), idToStr(target).c_str(), (int)flags, (int)ttl, (int)hops);
+
+			PeerId hopTarget = target;
+			bool exact = flags & ROUTE_EXACT;
+			if ((flags & ROUTE_RELAY) && !(flags & ROUTE_RELAYED)) {
+				if (relay == localId) {
+					header[routeFlagsOffset] = flags | ROUTE_RELAYED;
 				}
 				else {
-					log(3, "packt dropped\n");
+					hopTarget = relay;
+					exact = true;
 				}
 			}
-			else {
-				if (next) {
-					packet.unskip(packet.getReadIndex() - startReadIndex);
-					next->conn->write(packet);
+
+			Peer *next = routingTable.getNext(hopTarget, peer->id, true);
+			if (next == routingTable.localPeer.get()) {
+				if (!exact || hopTarget == localId) {
+					//routing headers are never stacked
+					Opcode inner = NONE;
+					if (packet.size() >= sizeof(Opcode)) {
+						memcpy(&inner, packet.data(), sizeof(inner));
+					}
+					if (inner == ROUTE) {
+						log(3, "packet dropped, nested route\n");
+						break;
+					}
+					processPacket(peer, packet, source, false, lock);
 				}
 				else {
 					log(3, "packt dropped\n");
+					refreshBucket(hopTarget);
+				}
+			}
+			else if (next) {
+				if (ttl <= 1) {
+					log(3, "packet dropped, ttl exceeded after %i hops\n", (int)hops);
+					break;
 				}
+				//the received frame is forwarded as is, only the ttl and hop count change
+				header[routeTtlOffset] = ttl - 1;
+				header[routeHopsOffset] = hops + 1;
+				packet.unskip(packet.getReadIndex() - startReadIndex);
+				writeUnlocked(next->conn, packet, getLinkStream(packet), lock);
+			}
+			else {
+				log(3, "packt dropped\n");
 			}
+			break;
+		}
+		case REQUEST: {
+			uint64_t requestId = packet.read<uint64_t>();
+			uint16_t service = packet.read<uint16_t>();
+			lock.unlock();
 
+			Buffer reply;
+			createPacketRoute(reply, localId, routingSource, 1);
+			reply.write(Opcode::RESPONSE);
+			reply.write(requestId);
+			handleRequest(routingSource, service, packet, reply);
+			sendReply(peer, routingSource, reply);
+			break;
+		}
+		case RESPONSE: {
+			uint64_t requestId = packet.read<uint64_t>();
+			ErrorCode error = (ErrorCode)packet.read<uint8_t>();
+			lock.unlock();
+			completeRequest(requestId, routingSource, error, packet);
 			break;
 		}
 		case MESSAGE: {
+			lock.unlock();
 			if (readCallback) {
 				readCallback(routingSource, packet);
 			}
 			break;
 		}
+		case RELIABLE_MESSAGE: {
+			uint64_t deliveryId = packet.read<uint64_t>();
+			lock.unlock();
+
+			//duplicates are acknowledged again, the previous ack might have been lost
+			Buffer reply;
+			createPacketRoute(reply, localId, routingSource, 1);
+			reply.write(Opcode::ACK);
+			reply.write(deliveryId);
+			sendReply(peer, routingSource, reply);
+
+			if (isNewDelivery(routingSource, deliveryId) && readCallback) {
+				readCallback(routingSource, packet);
+			}
+			break;
+		}
+		case HEARTBEAT: {
+			break;
+		}
+		case STREAM_CHUNK: {
+			uint64_t messageId = packet.read<uint64_t>();
+			int64_t offset = packet.read<int64_t>();
+			bool last = packet.read<uint8_t>();
+			lock.unlock();
+			onChunk(routingSource, messageId, offset, last, packet);
+
+			//acknowledged after the callback, so a slow receiver also slows down the sender
+			Buffer reply;
+			createPacketRoute(reply, localId, routingSource, 1);
+			reply.write(Opcode::STREAM_ACK);
+			reply.write(messageId);
+			sendReply(peer, routingSource, reply);
+			break;
+		}
+		case STREAM_ACK: {
+			uint64_t messageId = packet.read<uint64_t>();
+			std::unique_lock<std::mutex> lock(streamMutex);
+			auto entry = outgoingStreams.find(messageId);
+			if (entry != outgoingStreams.end()) {
+				auto stream = entry->second.lock();
+				if (!stream) {
+					outgoingStreams.erase(entry);
+				}
+				else if (stream->target == routingSource) {
+					stream->acked++;
+					streamCondition.notify_all();
+				}
+			}
+			break;
+		}
+		case MULTIPATH_MESSAGE: {
+			uint64_t messageId = packet.read<uint64_t>();
+			uint8_t path = packet.read<uint8_t>();
+			lock.unlock();
+
+			std::chrono::steady_clock::time_point firstArrival;
+			bool first = isNewDelivery(routingSource, messageId, &firstArrival);
+			onPathArrival(path, first, firstArrival);
+			if (first && readCallback) {
+				readCallback(routingSource, packet);
+			}
+			break;
+		}
+		case ACK: {
+			uint64_t deliveryId = packet.read<uint64_t>();
+			lock.unlock();
+			completeDelivery(deliveryId, routingSource, ErrorCode::NO_ERROR);
+			break;
+		}
 		case BROADCAST: {
 			PeerId source = packet.read<PeerId>();
 			uint64_t nonce = packet.read<uint64_t>();
@@ -551,16 +2155,29 @@ namespace net {
 					int endReadIndex = packet.getReadIndex();
 					packet.unskip(packet.getReadIndex() - startReadIndex);
 
-					sendToAllPeers(packet, peer->id);
+					PeerId from = peer->id;
+					lock.unlock();
+					sendToAllPeers(packet, from);
+					lock.lock();
 
 					packet.skip(endReadIndex - packet.getReadIndex());
-					processPacket(peer, packet, source, false);
+					processPacket(peer, packet, source, false, lock);
 				}
 			}
 			break;
 		}
 		case DISCONNECT: {
 			if(wasSendDirectly) {
+				DisconnectReason reason = packet.size() > 0 ? packet.read<DisconnectReason>() : DISCONNECT_NONE;
+				if (reason == DISCONNECT_BUCKET_FULL) {
+					//the bucket of a full peer is filled with another contact
+					std::unique_lock<std::mutex> lock(lookupMutex);
+					rejectedBy[peer->id] = std::chrono::steady_clock::now() + std::chrono::milliseconds(rejectionTimeoutMs);
+				}
+				else if (reason == DISCONNECT_DUPLICATE) {
+					peer->dropped = true;
+					peer->state = Peer::DISCONNECTED;
+				}
 				peer->conn->disconnect();
 			}
 			break;
@@ -572,21 +2189,137 @@ namespace net {
 
 	}
 
-	void PeerNetwork::sendToNextPeer(PeerId id, Buffer& packet, PeerId except) {
-		Peer* next = routingTable.getNext(id, except, false);
-		if (next) {
-			next->conn->write(packet);
+	std::shared_ptr<Connection> PeerNetwork::getConnection(Connection* conn) {
+		//the last reference would destroy the connection on its own read thread, which is still using it
+		//it is alive until its callback returned anyway, so it is not referenced
+		if (conn == processingConnection) {
+			return std::shared_ptr<Connection>(std::shared_ptr<Connection>(), conn);
+		}
+		return conn->weak_from_this().lock();
+	}
+
+	void PeerNetwork::writeUnlocked(Connection* conn, Buffer& packet, uint16_t stream, std::unique_lock<std::recursive_mutex>& lock) {
+		//the reference keeps the connection alive while it is written without the lock
+		std::shared_ptr<Connection> ref = getConnection(conn);
+		if (!ref) {
+			conn->write(packet, stream);
+			lock.unlock();
+			return;
+		}
+		lock.unlock();
+		ref->write(packet, stream);
+	}
+
+	bool PeerNetwork::sendToNextPeer(PeerId id, Buffer& packet, PeerId except, int alternate) {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		Peer* next = nullptr;
+		if (alternate > 0 && deliveryAlternateHops > 1) {
+			std::vector<Peer*> candidates = routingTable.getClosest(id, deliveryAlternateHops);
+			if (!candidates.empty()) {
+				next = candidates[alternate % candidates.size()];
+			}
+		}
+		else {
+			next = routingTable.getNext(id, except, false);
+		}
+		if (!next) {
+			return false;
+		}
+
+		//writing a large packet takes a while, other threads can use the routing table in the meantime
+		std::shared_ptr<Connection> conn = getConnection(next->conn);
+		if (!conn) {
+			return !next->conn->write(packet, getLinkStream(packet));
+		}
+		lock.unlock();
+		return !conn->write(packet, getLinkStream(packet));
+	}
+
+	int PeerNetwork::sendToNextPeers(PeerId id, Buffer& packet, int count, int pathOffset) {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		std::vector<Peer*> candidates = routingTable.getClosest(id, std::max(count, 1));
+		PeerId localDist = id ^ localId;
+		std::vector<std::shared_ptr<Connection>> conns;
+		for (int i = 0; i < candidates.size(); i++) {
+			//the closest hop is always used, other paths have to make progress towards the target
+			if (i > 0 && !((id ^ candidates[i]->id) < localDist)) {
+				break;
+			}
+			conns.push_back(getConnection(candidates[i]->conn));
+		}
+		lock.unlock();
+
+		uint16_t stream = getLinkStream(packet);
+		int sent = 0;
+		for (int i = 0; i < conns.size(); i++) {
+			if (!conns[i]) {
+				continue;
+			}
+			if (pathOffset >= 0) {
+				packet.data()[pathOffset] = (uint8_t)i;
+			}
+			if (!conns[i]->write(packet, stream)) {
+				sent++;
+			}
+		}
+		return sent;
+	}
+
+	void PeerNetwork::sendReply(Peer* peer, PeerId target, Buffer& packet) {
+		//reply directly when the target is a neighbor, otherwise back over the peer the packet came from
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		Peer* direct = routingTable.get(target);
+		std::shared_ptr<Connection> conn;
+		if (direct && direct->conn && direct->state == Peer::CONNECTED) {
+			conn = getConnection(direct->conn);
+		}
+		else if (peer && peer->conn) {
+			conn = getConnection(peer->conn);
+		}
+		lock.unlock();
+
+		if (conn) {
+			conn->write(packet, getLinkStream(packet));
+		}
+	}
+
+	uint16_t PeerNetwork::getLinkStream(Buffer& packet) {
+		//the stream is chosen by source and target, so relays keep the order of a flow
+		Opcode opcode;
+		if (linkFlowStreams <= 0 || packet.size() < routeFlagsOffset) {
+			return LINK_CONTROL;
+		}
+		memcpy(&opcode, packet.data(), sizeof(opcode));
+		if (opcode != Opcode::ROUTE) {
+			return LINK_CONTROL;
 		}
+		PeerId source;
+		PeerId target;
+		memcpy(&source, packet.data() + sizeof(Opcode), sizeof(source));
+		memcpy(&target, packet.data() + sizeof(Opcode) + sizeof(PeerId), sizeof(target));
+		uint64_t flow = (uint64_t)source.words[0] * 31 + target.words[0];
+		return LINK_FLOWS + (uint16_t)(flow % linkFlowStreams);
 	}
 
 	void PeerNetwork::sendToAllPeers(Buffer& packet, PeerId except) {
+		std::unique_lock<std::recursive_mutex> lock(routingTableMutex);
+		std::vector<std::shared_ptr<Connection>> conns;
 		for (auto& peer : routingTable.peers) {
 			if (peer && peer->conn) {
 				if (peer->id != except) {
-					peer->conn->write(packet);
+					if (auto conn = getConnection(peer->conn)) {
+						conns.push_back(conn);
+					}
 				}
 			}
 		}
+		lock.unlock();
+
+		//the packet is compressed once for all neighbors
+		Connection::CompressedFrame frame;
+		for (auto& conn : conns) {
+			conn->write(packet, LINK_CONTROL, &frame);
+		}
 	}
 
 	void PeerNetwork::setState(State newState) {
@@ -599,6 +2332,35 @@ namespace net {
 		packet.write(id);
 		packet.write(port);
 		packet.writeStr(address);
+		writeFeatures(packet);
+	}
+
+	void PeerNetwork::writeFeatures(Buffer& packet) {
+		packet.write((uint8_t)(compression ? FEATURE_COMPRESSION : 0));
+		if (compression) {
+			packet.write(compressionDictionaryHash);
+		}
+	}
+
+	void PeerNetwork::readFeatures(Peer* peer, Buffer& packet) {
+		uint8_t features = packet.size() >= sizeof(uint8_t) ? packet.read<uint8_t>() : 0;
+		uint64_t dictionaryHash = 0;
+		if ((features & FEATURE_COMPRESSION) && packet.size() >= sizeof(uint64_t)) {
+			dictionaryHash = packet.read<uint64_t>();
+		}
+		if (!compression || !(features & FEATURE_COMPRESSION) || !peer->conn) {
+			return;
+		}
+
+		peer->conn->compressionThreshold = compressionThreshold;
+		if (compressionDictionary && dictionaryHash == compressionDictionaryHash) {
+			peer->conn->setStreamDictionary(LINK_CONTROL, compressionDictionary);
+			for (int i = 0; i < linkFlowStreams; i++) {
+				peer->conn->setStreamDictionary(LINK_FLOWS + i, compressionDictionary);
+			}
+		}
+		peer->conn->compression = true;
+		log(4, "compression enabled for %s%s\n", idToStr(peer->id).c_str(), compressionDictionary && dictionaryHash == compressionDictionaryHash ? " with dictionary" : "");
 	}
 
 	void PeerNetwork::createPacketLookup(Buffer& packet, PeerId source, PeerId relay, PeerId target) {
@@ -608,19 +2370,109 @@ namespace net {
 		packet.write(target);
 	}
 
-	void PeerNetwork::createPacketLookupReply(Buffer& packet, PeerId source, PeerId target, uint16_t port, const std::string& address) {
+	void PeerNetwork::createPacketLookupReply(Buffer& packet, PeerId source, PeerId target, uint16_t port, const std::string& address, PeerId relay) {
 		packet.write(Opcode::LOOKUP_REPLY);
 		packet.write(source);
 		packet.write(target);
 		packet.write(port);
 		packet.writeStr(address);
+		packet.write(relay);
 	}
 
 	void PeerNetwork::createPacketRoute(Buffer& packet, PeerId source, PeerId target, uint8_t exact) {
 		packet.write(Opcode::ROUTE);
 		packet.write(source);
 		packet.write(target);
-		packet.write(exact);
+		packet.write((uint8_t)(exact ? ROUTE_EXACT : 0));
+		packet.write((uint8_t)routeTtl);
+		packet.write((uint8_t)0);
+	}
+
+	void PeerNetwork::createPacketRelayedRoute(Buffer& packet, PeerId source, PeerId relay, PeerId target) {
+		packet.write(Opcode::ROUTE);
+		packet.write(source);
+		packet.write(target);
+		packet.write((uint8_t)(ROUTE_EXACT | ROUTE_RELAY));
+		packet.write((uint8_t)routeTtl);
+		packet.write((uint8_t)0);
+		packet.write(relay);
+	}
+
+	void PeerNetwork::createPacketFindNode(Buffer& packet, PeerId source, PeerId relay, PeerId target, uint8_t count) {
+		packet.write(Opcode::FIND_NODE);
+		packet.write(source);
+		packet.write(relay);
+		packet.write(target);
+		packet.write(count);
+	}
+
+	void PeerNetwork::createPacketFindNodeReply(Buffer& packet, PeerId source, PeerId relay, PeerId target, std::vector<Peer*>& closest) {
+		packet.write(Opcode::FIND_NODE_REPLY);
+		packet.write(source);
+		packet.write(relay);
+		packet.write(target);
+		Buffer contacts;
+		uint8_t count = 0;
+		for (auto* contact : closest) {
+			if (writeContact(contacts, contact)) {
+				count++;
+			}
+		}
+		packet.write(count);
+		packet.writeBytes(contacts.data(), contacts.size());
+	}
+
+	bool PeerNetwork::writeContact(Buffer& packet, Peer* peer) {
+		//peers may advertise a host name, fall back to the address of the connection
+		Endpoint ep(peer->address, peer->port, false);
+		if (!ep.isValid() && peer->conn && peer->conn->socket) {
+			ep = peer->conn->socket->getEndpoint();
+			ep.setPort(peer->port);
+		}
+		if (!ep.isValid()) {
+			//host names are not resolved on the packet path, a missing cache entry is resolved for the next time
+			std::vector<Endpoint> endpoints;
+			if (Resolver::getDefault().getCached(peer->address, peer->port, endpoints)) {
+				ep = endpoints[0];
+			}
+			else {
+				Resolver::getDefault().resolve(peer->address, peer->port, [](ErrorCode error, std::vector<Endpoint>& endpoints) {});
+			}
+		}
+
+		uint8_t bytes[16];
+		uint8_t size = ep.getAddressBytes(bytes);
+		if (size == 0) {
+			//a contact without an address cannot be connected to, it is left out
+			return false;
+		}
+		packet.write(peer->id);
+		packet.write(size);
+		packet.writeBytes(bytes, size);
+		packet.write(peer->port);
+		return true;
+	}
+
+	bool PeerNetwork::readContact(Buffer& packet, Peer& peer) {
+		uint8_t bytes[16];
+		peer.id = packet.read<PeerId>();
+		uint8_t size = packet.read<uint8_t>();
+		if (size > sizeof(bytes)) {
+			//the entry is skipped, so the following contacts are read from the right offset
+			packet.skip(std::min((int)size, packet.size()));
+			packet.read<uint16_t>();
+			return false;
+		}
+		packet.readBytes(bytes, size);
+		peer.port = packet.read<uint16_t>();
+
+		Endpoint ep;
+		ep.setAddressBytes(bytes, size);
+		if (!ep.isValid()) {
+			return false;
+		}
+		peer.address = ep.getAddress();
+		return true;
 	}
 
 	void PeerNetwork::log(int level, const char* fmt, ...) {
@@ -628,7 +2480,7 @@ namespace net {
 			static char buffer[1024];
 			va_list args;
 			va_start(args, fmt);
-			vsprintf_s(buffer, sizeof(buffer), fmt, args);
+			vsnprintf(buffer, sizeof(buffer), fmt, args);
 			logCallback(buffer);
 			va_end(args);
 		}
@@ -6,8 +6,17 @@
 
 #include "PeerRoutingTable.h"
 #include "net/Server.h"
+#include "net/MessageWriter.h"
+#include "util/TimerWheel.h"
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <set>
+#include <map>
+#include <unordered_map>
+#include <deque>
+#include <list>
+#include <future>
 
 namespace net {
 
@@ -15,10 +24,126 @@ namespace net {
 	public:
 		std::function<void(PeerId, Buffer&)> readCallback;
 		std::function<void(const char *)> logCallback;
+		//chunks of streamed messages, complete is set for the chunk that completes the message
+		//chunks usually arrive in order, but can overtake each other when routes change
+		std::function<void(PeerId source, uint64_t messageId, int64_t offset, Buffer& chunk, bool complete)> chunkCallback;
 		int logVerbosity = 1;
 
+		//number of parallel in flight queries per lookup target (alpha)
+		int lookupConcurrency = 3;
+		//number of closest contacts a lookup converges on (k)
+		int lookupResultCount = 8;
+		int lookupMaxQueries = 8;
+		int lookupTimeoutMs = 500;
+
+		//peers per bucket, shortcuts are not counted
+		int bucketCapacity = 8;
+		//a newcomer to a full bucket only takes the slot of the least recently seen peer when it does not answer a ping within the timeout
+		int bucketPingTimeoutMs = 1000;
+		//inbound newcomers are only checked after this time, so joining peers can finish their lookups through them
+		int bucketGracePeriodMs = 5000;
+		//rejected newcomers are remembered without a connection and replace peers that disconnect
+		int replacementCacheSize = 8;
+
+		//connects run in the background, more than maxPendingConnects are queued
+		int connectTimeoutMs = 3000;
+		int maxPendingConnects = 16;
+		//entry nodes are tried in order with at most this many connects in flight
+		int entryNodeConcurrency = 2;
+
+		int requestTimeoutMs = 1000;
+		//requests that would exceed this number of outstanding requests fail with LIMIT_REACHED
+		int maxPendingRequests = 1 << 16;
+
+		//reliable sends are retransmitted until acknowledged, the timeout adapts to the measured round trip time to the target
+		int deliveryMaxRetries = 5;
+		int deliveryInitialTimeoutMs = 1000;
+		int deliveryMinTimeoutMs = 200;
+		int deliveryMaxTimeoutMs = 10000;
+		//retransmissions rotate through this many neighbors closest to the target
+		int deliveryAlternateHops = 2;
+		//how long received message ids are remembered to drop retransmitted duplicates
+		int deliveryDuplicateWindowMs = 60000;
+		int maxPendingDeliveries = 1 << 16;
+
+		//destinations that are sent at least shortcutThreshold messages within shortcutIntervalMs get a direct connection, 0 disables shortcuts
+		int shortcutThreshold = 100;
+		int shortcutIntervalMs = 1000;
+		//least recently used shortcuts are closed when there are more
+		int maxShortcuts = 16;
+
+		//neighbors are pinged in this interval to measure their round trip time, 0 disables probing
+		int rttProbeIntervalMs = 5000;
+		//prefer low latency neighbors among next hops that make comparable progress towards the target
+		bool proximityRouting = false;
+
+		int multipathCount = 2;
+
+		//streamed messages are send in chunks, at most streamWindow chunks of a message are unacknowledged, 0 disables the window
+		int streamChunkSize = 64 * 1024;
+		int streamWindow = 32;
+		//a writer fails when a chunk is not acknowledged within the timeout, incomplete received messages are dropped after it
+		int streamTimeoutMs = 10000;
+
+		//routed packets are spread over this many streams of a neighbor connection by source and target
+		//packets of one flow keep their order, a large transfer only delays other flows by single pieces
+		//all nodes have to use the same value when a compression dictionary is set
+		int linkFlowStreams = 8;
+
+		//routed packets are dropped after this many hops (at most 255), so routing loops do not circulate packets forever
+		int routeTtl = 64;
+
+		//options of the sockets to neighbors, nagle is disabled by default
+		SocketOptions socketOptions;
+		//links to neighbors run over udp instead when all nodes set it, idle links are cheaper and a loss on one stream does not stall the others
+		//packets of one source and target share a stream (linkFlowStreams) and keep their order, packets of different flows can overtake each other
+		Server::Transport transport = Server::TRANSPORT_TCP;
+
+		//frames to neighbors of at least compressionThreshold bytes are compressed, when both sides enable compression
+		bool compression = true;
+		int compressionThreshold = 256;
+
+		//neighbors that were not written to within this interval are sent a heartbeat, 0 disables failure detection
+		int heartbeatIntervalMs = 1000;
+		//neighbors whose suspicion level exceeds the threshold are disconnected and replaced
+		double phiThreshold = 8;
+
+		//connected neighbors are saved to this file and reconnected to on the next connect, empty disables the cache
+		std::string peerCacheFile;
+		int peerCacheIntervalMs = 30000;
+		//entry nodes are only used when fewer cached peers respond within the timeout
+		int peerCacheMinPeers = 3;
+		int peerCacheTimeoutMs = 2000;
+		int peerCacheMaxPeers = 64;
+		int64_t peerCacheMaxAgeMs = 7ll * 24 * 60 * 60 * 1000;
+
+		class Response {
+		public:
+			ErrorCode error = ErrorCode::NO_ERROR;
+			Buffer data;
+		};
+		//called once with the response payload, or with an error when the request failed or timed out
+		typedef std::function<void(ErrorCode error, Buffer& response)> ResponseCallback;
+		//fills the response payload that is send back to the requesting peer
+		typedef std::function<void(PeerId source, Buffer& request, Buffer& response)> RequestHandler;
+		//called with the closest contacts to the target that were found, sorted by distance
+		typedef std::function<void(std::vector<Peer>& closest)> LookupCallback;
+		//called once a reliable message was acknowledged by the target or could not be delivered
+		typedef std::function<void(ErrorCode error)> DeliveryCallback;
+
+		//arrivals of multipath copies at this peer, indexed by the rank of the first hop at the sender
+		class PathStats {
+		public:
+			uint64_t arrivals = 0;
+			//number of times the copy of this path arrived first
+			uint64_t wins = 0;
+			//sum of the delays of copies that arrived after the first one
+			double lagMs = 0;
+		};
+
 		enum State {
 			DISCONNECTED,
+			CONNECTING_TO_CACHED_PEERS,
 			CONNECTING_TO_ENTRY_NODE,
 			SENDING_LOOKUPS,
 			LOOKUPS_SEND,
@@ -37,6 +162,16 @@ namespace net {
 			MESSAGE,
 			BROADCAST,
 			DISCONNECT,
+			FIND_NODE,
+			FIND_NODE_REPLY,
+			REQUEST,
+			RESPONSE,
+			RELIABLE_MESSAGE,
+			ACK,
+			MULTIPATH_MESSAGE,
+			HEARTBEAT,
+			STREAM_CHUNK,
+			STREAM_ACK,
 		};
 
 		PeerNetwork();
@@ -53,46 +188,269 @@ namespace net {
 		State getState();
 
 		void send(PeerId id, Buffer& payload, bool exact = true);
+		//copies are send over the multipathCount closest next hops, the receiver delivers the first copy
+		void sendMultipath(PeerId id, Buffer& payload);
+		//retransmitted until the target acknowledges it, multipath sends every transmission over multiple hops
+		void sendReliable(PeerId id, Buffer& payload, const DeliveryCallback& callback = nullptr, bool multipath = false);
+		std::vector<PathStats> getPathStats();
 		void broadcast(Buffer& payload);
 		void broadcastPing();
 		std::string idToStr(PeerId id);
 
+		void setRequestHandler(uint16_t service, const RequestHandler& handler);
+		//returns the request id, the callback may be invoked before the function returns
+		uint64_t request(PeerId id, uint16_t service, Buffer& payload, const ResponseCallback& callback, int timeoutMs = 0);
+		std::future<Response> request(PeerId id, uint16_t service, Buffer& payload, int timeoutMs = 0);
+		//streams a message of any size to the target, writes block while the chunk window is full
+		//finish returns once all chunks were acknowledged
+		//the acks are processed on the network threads, so writes from a network callback fail with GENERAL_ERROR instead of timing out
+		std::shared_ptr<MessageWriter> openMessage(PeerId id);
+		//iterative lookup of the lookupResultCount closest peers to the target, the local peer is not part of the result
+		void findNodes(PeerId target, const LookupCallback& callback);
+		//used with neighbors that set the same dictionary, set it before connecting
+		void setCompressionDictionary(const std::vector<uint8_t>& dictionary);
+
 	private:
 		PeerRoutingTable routingTable;
 		std::vector<Peer> entryNodes;
 		PeerId localId;
 		Server server;
 
+		class Lookup {
+		public:
+			PeerId target;
+			std::vector<PeerId> closest;
+			std::set<PeerId> queried;
+			std::map<PeerId, std::chrono::steady_clock::time_point> pending;
+			bool fillBucket = true;
+			std::vector<LookupCallback> callbacks;
+		};
+
+		//sent with DISCONNECT so the peer knows whether the slot needs to be refilled
+		enum DisconnectReason : uint8_t {
+			DISCONNECT_NONE,
+			DISCONNECT_BUCKET_FULL,
+			//another connection to the same peer is kept
+			DISCONNECT_DUPLICATE,
+		};
+
+		//streams of a neighbor connection
+		enum LinkStream : uint16_t {
+			LINK_CONTROL,
+			//first of the linkFlowStreams streams for routed packets
+			LINK_FLOWS,
+		};
+
+		//capabilities exchanged in the handshake
+		enum Feature : uint8_t {
+			//followed by the hash of the compression dictionary, 0 without a dictionary
+			FEATURE_COMPRESSION = 1,
+		};
+
+		//flags of the routing header
+		enum RouteFlags : uint8_t {
+			//only the target processes the packet, otherwise the closest peer to the target does
+			ROUTE_EXACT = 1,
+			//a relay id follows the header, the packet is routed to the relay before the target
+			ROUTE_RELAY = 2,
+			//set in place by the relay when the packet passes it
+			ROUTE_RELAYED = 4,
+		};
+		//offsets into a routed packet of the fields relays rewrite in place
+		static const int routeFlagsOffset = sizeof(Opcode) + 2 * sizeof(PeerId);
+		static const int routeTtlOffset = routeFlagsOffset + 1;
+		static const int routeHopsOffset = routeFlagsOffset + 2;
+
 		bool debugFakeLatency = false;
+		std::shared_ptr<const std::vector<uint8_t>> compressionDictionary;
+		uint64_t compressionDictionaryHash = 0;
+		//a gracefully closed connection is closed forcefully when the peer did not close it within this time
+		int closeTimeoutMs = 2000;
 
 		int lookupCountOnConnect = 64;
 		bool clientOnly = false;
 		int maxPortOffset = 0;
 		Peer* entryNode = nullptr;
 		bool wasEntryNodeLookedUp = false;
+		int cachedPeersConnecting = 0;
 		State state = DISCONNECTED;
-		std::mutex routingTableMutex;
+		std::recursive_mutex routingTableMutex;
 		std::set<PeerId> lookupReplyTargets;
-		std::set<PeerId> lookupTargets;
 		int loopupRelysRecieved = 0;
 		std::set<uint64_t> seenBroadcastNonces;
+		std::map<PeerId, Lookup> lookups;
+		std::map<PeerId, Peer> contacts;
+		std::vector<std::pair<LookupCallback, std::vector<Peer>>> lookupCompletions;
+
+		class EntryNodeAttempts {
+		public:
+			std::vector<Peer> nodes;
+			int next = 0;
+			int running = 0;
+			bool connected = false;
+		};
+
+		class PendingRequest {
+		public:
+			PeerId target;
+			ResponseCallback callback;
+			TimerWheel::TimerId timer;
+			std::chrono::steady_clock::time_point sendTime;
+		};
+		TimerWheel timers;
+		std::unordered_map<uint64_t, PendingRequest> pendingRequests;
+		std::map<uint16_t, RequestHandler> requestHandlers;
+		std::mutex requestMutex;
+		uint64_t nextRequestId = 0;
+
+		class PendingDelivery {
+		public:
+			PeerId target;
+			std::vector<uint8_t> packet;
+			bool multipath = false;
+			int attempts = 0;
+			std::chrono::steady_clock::time_point sendTime;
+			DeliveryCallback callback;
+			TimerWheel::TimerId timer = 0;
+		};
+		class RttEstimate {
+		public:
+			float smoothedMs = 0;
+			float variationMs = 0;
+		};
+		std::unordered_map<uint64_t, PendingDelivery> pendingDeliveries;
+		std::map<PeerId, RttEstimate> deliveryRtts;
+		//first arrival time of received message ids
+		std::map<std::pair<PeerId, uint64_t>, std::chrono::steady_clock::time_point> seenDeliveries;
+		std::vector<PathStats> pathStats;
+		std::deque<std::pair<std::chrono::steady_clock::time_point, std::pair<PeerId, uint64_t>>> seenDeliveryOrder;
+		std::mutex deliveryMutex;
+		uint64_t nextDeliveryId = 0;
+
+		class OutgoingStream {
+		public:
+			PeerId target;
+			int sent = 0;
+			int acked = 0;
+		};
+		class IncomingStream {
+		public:
+			int64_t received = 0;
+			//known once the last chunk arrived
+			int64_t size = -1;
+			std::chrono::steady_clock::time_point lastChunk;
+		};
+		//owned by the writers, entries of destroyed writers are removed lazily
+		std::unordered_map<uint64_t, std::weak_ptr<OutgoingStream>> outgoingStreams;
+		std::map<std::pair<PeerId, uint64_t>, IncomingStream> incomingStreams;
+		std::mutex streamMutex;
+		std::condition_variable streamCondition;
+		uint64_t nextStreamId = 0;
+
+		std::map<PeerId, int> trafficCounts;
+		std::chrono::steady_clock::time_point trafficWindowStart;
+		//start time of the shortcut attempts, an attempt is given up after shortcutTimeoutMs
+		std::map<PeerId, std::chrono::steady_clock::time_point> pendingShortcuts;
+		int shortcutTimeoutMs = 10000;
+		//most recently used first
+		std::list<PeerId> shortcuts;
+		//buckets with a running liveness check of their least recently seen peer
+		std::set<int> pendingBucketChecks;
+		//peers that rejected a connection because their bucket was full, they are not chosen to fill a bucket until the time passed
+		std::map<PeerId, std::chrono::steady_clock::time_point> rejectedBy;
+		int rejectionTimeoutMs = 60000;
+		//empty buckets that packets could not be routed into are looked up again, at most once per interval
+		std::map<int, std::chrono::steady_clock::time_point> bucketRefreshes;
+		int bucketRefreshIntervalMs = 1000;
+		std::mutex lookupMutex;
+		std::condition_variable lookupCondition;
 		std::shared_ptr<std::thread> lookupThread;
+		bool lookupThreadRunning = false;
 		
-		bool connectToPeer(const std::string& address, uint16_t port);
-		void disconnectFromPeer(Peer *peer);
+		//connects in the background, onConnect is called before the callback
+		void connectToPeer(const std::string& address, uint16_t port, const Server::ConnectCallback& callback = nullptr);
+		void connectToEntryNodes();
+		void connectToNextEntryNode(std::shared_ptr<EntryNodeAttempts> attempts);
+		//conn is nullptr when the attempt failed, connections after the first one are closed
+		void onEntryNodeAttempt(std::shared_ptr<EntryNodeAttempts> attempts, Connection* conn);
+		void connectToCachedPeers(std::vector<Peer>& peers);
+		void onCachedPeersConnected();
+		void onPeerCacheTimeout();
+		void savePeerCache();
+		void runPeerCacheTimer();
+		bool loadPeerCache(std::vector<Peer>& peers);
+		void disconnectFromPeer(Peer *peer, DisconnectReason reason = DISCONNECT_NONE);
+		//returns true when the peer is a second connection to an already connected peer and is being closed
+		bool closeDuplicate(Peer* peer);
+		//writes DISCONNECT once the frames queued on the connection are written, then closes it
+		void closeDropped(Connection* conn, PeerId id, std::chrono::steady_clock::time_point start);
+		void onEntryNodeConnected();
 		void performLookups();
+		void startLookup(PeerId target, bool fillBucket = true, const LookupCallback& callback = nullptr);
+		void stepLookup(Lookup& lookup);
+		void stepAllLookups();
+		void onLookupReply(PeerId relay, PeerId target, std::vector<Peer>& replyContacts);
+		void finishLookup(Lookup& lookup, std::vector<Peer>& connects);
+		void onLookupsFinished();
+		void runLookupCompletions();
+		void runLookupTimer();
+		void connectToContacts(std::vector<Peer>& connects);
 		void onConnect(Connection* conn);
 		void onDisconnect(Connection *conn);
-		void processPacket(Peer *peer, Buffer &packet, PeerId routingSource, bool wasSendDirectly);
+		//called with the routing table locked, the lock is released before user callbacks are invoked and before writes to neighbors
+		void processPacket(Peer *peer, Buffer &packet, PeerId routingSource, bool wasSendDirectly, std::unique_lock<std::recursive_mutex>& lock);
+		//a reference that keeps the connection alive while it is written without the routing table lock
+		std::shared_ptr<Connection> getConnection(Connection* conn);
+		//unlocks the routing table before writing, so a neighbor with a full socket does not stall the processing of other packets
+		//the lock is released afterwards
+		void writeUnlocked(Connection* conn, Buffer& packet, uint16_t stream, std::unique_lock<std::recursive_mutex>& lock);
+		void handleRequest(PeerId source, uint16_t service, Buffer& request, Buffer& reply);
+		void completeRequest(uint64_t requestId, PeerId source, ErrorCode error, Buffer& response);
+		void failAllRequests(ErrorCode error);
+		void sendDelivery(uint64_t deliveryId);
+		void completeDelivery(uint64_t deliveryId, PeerId source, ErrorCode error);
+		void failAllDeliveries(ErrorCode error);
+		bool isNewDelivery(PeerId source, uint64_t deliveryId, std::chrono::steady_clock::time_point* firstArrival = nullptr);
+		ErrorCode sendChunk(std::shared_ptr<OutgoingStream> stream, uint64_t messageId, int64_t offset, Buffer& chunk, bool last);
+		void onChunk(PeerId source, uint64_t messageId, int64_t offset, bool last, Buffer& chunk);
+		void onPathArrival(int path, bool first, std::chrono::steady_clock::time_point firstArrival);
+		int getDeliveryTimeout(PeerId target);
+		void trackTraffic(PeerId target);
+		void addShortcut(Peer* peer);
+		void checkBucketCapacity(Peer* peer);
+		void evictFromBucket(Peer* peer);
+		void dropPeer(Peer* peer, bool keepAsReplacement);
+		bool isOnlyPeerInBucket(Peer* peer);
+		//looks up the bucket of the id again when no peer of it is connected
+		void refreshBucket(PeerId id);
+		void probeRtts();
+		void sendHeartbeats();
+		void updatePeerRtt(PeerId id, float sampleMs);
 
-		void sendToNextPeer(PeerId id, Buffer& packet, PeerId except = PeerId(0));
+		//the send helpers write after unlocking the routing table, so the caller must not hold it
+		//alternate > 0 selects one of the other neighbors closest to the target
+		bool sendToNextPeer(PeerId id, Buffer& packet, PeerId except = PeerId(0), int alternate = 0);
+		//sends over up to count next hops that get closer to the target, the byte at pathOffset is set to the rank of the hop
+		int sendToNextPeers(PeerId id, Buffer& packet, int count, int pathOffset = -1);
+		void sendReply(Peer* peer, PeerId target, Buffer& packet);
+		uint16_t getLinkStream(Buffer& packet);
 		void sendToAllPeers(Buffer& packet, PeerId except = PeerId(0));
 		void setState(State newState);
 
 		void createPacketHandshake(Buffer& packet, PeerId id, uint16_t port, const std::string& address);
+		void writeFeatures(Buffer& packet);
+		//peers without features do not send them, so the fields are optional
+		void readFeatures(Peer* peer, Buffer& packet);
 		void createPacketLookup(Buffer& packet, PeerId source, PeerId relay, PeerId target);
-		void createPacketLookupReply(Buffer& packet, PeerId source, PeerId target, uint16_t port, const std::string& address);
+		void createPacketLookupReply(Buffer& packet, PeerId source, PeerId target, uint16_t port, const std::string& address, PeerId relay);
 		void createPacketRoute(Buffer& packet, PeerId source, PeerId target, uint8_t exact = 1);
+		//reaches peers that are not in the routing tables of others yet, like joining peers, over the peer they are connected to
+		void createPacketRelayedRoute(Buffer& packet, PeerId source, PeerId relay, PeerId target);
+		void createPacketFindNode(Buffer& packet, PeerId source, PeerId relay, PeerId target, uint8_t count);
+		void createPacketFindNodeReply(Buffer& packet, PeerId source, PeerId relay, PeerId target, std::vector<Peer*>& closest);
+		//returns false and writes nothing if the contact has no resolved address
+		bool writeContact(Buffer& packet, Peer* peer);
+		bool readContact(Buffer& packet, Peer& peer);
 
 		void log(int level, const char* fmt, ...);
 	};
@@ -9,6 +9,7 @@
 //
 
 #include "PeerRoutingTable.h"
+#include <algorithm>
 
 namespace net {
 	
@@ -22,7 +23,7 @@ namespace net {
 		int peerIndex = -1;
 
 		for (int i = 0; i < peers.size(); i++) {
-			if (peers[i]->id != except) {
+			if (peers[i]->id != except && peers[i]->state == Peer::CONNECTED) {
 				PeerId dist = id ^ peers[i]->id;
 				if (dist < minDist || peerIndex == -1) {
 					minDist = dist;
@@ -31,10 +32,10 @@ namespace net {
 			}
 		}
 
+		PeerId localDist = id ^ localPeer->id;
 		if (includeLocalPeer) {
-			PeerId dist = id ^ localPeer->id;
-			if (dist < minDist || peerIndex == -1) {
-				minDist = dist;
+			if (localDist < minDist || peerIndex == -1) {
+				minDist = localDist;
 				return localPeer.get();
 			}
 		}
@@ -42,9 +43,56 @@ namespace net {
 		if (peerIndex == -1) {
 			return nullptr;
 		}
-		else {
-			return peers[peerIndex].get();
+
+		Peer* next = peers[peerIndex].get();
+		if (proximityRouting && minDist != PeerId(0)) {
+			//close to the target only the closest peer reliably knows the target, so proximity is only used on the far hops
+			int bit = getHighestBit(minDist);
+			PeerId nearDist = PeerId(0);
+			for (int i = 0; i < peers.size(); i++) {
+				PeerId dist = localPeer->id ^ peers[i]->id;
+				if (i == 0 || dist < nearDist) {
+					nearDist = dist;
+				}
+			}
+			if (bit <= getHighestBit(nearDist) + proximityNearBits) {
+				return next;
+			}
+
+			//comparable progress means the distance to the target has the same magnitude, every hop still gets closer than the current peer
+			for (int i = 0; i < peers.size(); i++) {
+				Peer* peer = peers[i].get();
+				if (peer->id != except && peer->state == Peer::CONNECTED && peer->rttMs > 0) {
+					if (next->rttMs == 0 || peer->rttMs < next->rttMs) {
+						PeerId dist = id ^ peer->id;
+						if (getHighestBit(dist) == bit && dist < localDist) {
+							next = peer;
+						}
+					}
+				}
+			}
 		}
+		return next;
+	}
+
+	std::vector<Peer*> PeerRoutingTable::getClosest(const PeerId& id, int count, bool includeLocalPeer) {
+		std::vector<Peer*> result;
+		for (int i = 0; i < peers.size(); i++) {
+			if (peers[i]->state == Peer::CONNECTED) {
+				result.push_back(peers[i].get());
+			}
+		}
+		if (includeLocalPeer) {
+			result.push_back(localPeer.get());
+		}
+
+		std::sort(result.begin(), result.end(), [&](Peer* a, Peer* b) {
+			return (id ^ a->id) < (id ^ b->id);
+		});
+		if (result.size() > count) {
+			result.resize(count);
+		}
+		return result;
 	}
 
 	void PeerRoutingTable::add(const Peer& peer) {
@@ -70,11 +118,21 @@ namespace net {
 	}
 
 	Peer* PeerRoutingTable::get(const PeerId& id) {
+		//a connection that is being closed is only returned when there is no other one
+		Peer* closing = nullptr;
 		for (int i = 0; i < peers.size(); i++) {
 			if (peers[i]->id == id) {
-				return peers[i].get();
+				if (peers[i]->state != Peer::DISCONNECTED) {
+					return peers[i].get();
+				}
+				if (!closing) {
+					closing = peers[i].get();
+				}
 			}
 		}
+		if (closing) {
+			return closing;
+		}
 		if (localPeer->id == id) {
 			return localPeer.get();
 		}
@@ -142,4 +200,87 @@ namespace net {
 		return index;
 	}
 
+	int PeerRoutingTable::getBucketSize(int index, const Peer* except) {
+		int count = 0;
+		for (int i = 0; i < peers.size(); i++) {
+			if (peers[i].get() != except && peers[i]->state == Peer::CONNECTED && !peers[i]->shortcut) {
+				if (getLookupIndex(peers[i]->id) == index) {
+					count++;
+				}
+			}
+		}
+		return count;
+	}
+
+	bool PeerRoutingTable::isBucketFull(const PeerId& id, const Peer* except) {
+		return bucketCapacity > 0 && getBucketSize(getLookupIndex(id), except) >= bucketCapacity;
+	}
+
+	Peer* PeerRoutingTable::getLeastRecentlySeen(int index, const Peer* except) {
+		Peer* oldest = nullptr;
+		for (int i = 0; i < peers.size(); i++) {
+			Peer* peer = peers[i].get();
+			if (peer != except && peer->state == Peer::CONNECTED && !peer->shortcut && !peer->dropped) {
+				if (getLookupIndex(peer->id) == index) {
+					if (!oldest || peer->detector.getLastHeartbeat() < oldest->detector.getLastHeartbeat()) {
+						oldest = peer;
+					}
+				}
+			}
+		}
+		return oldest;
+	}
+
+	void PeerRoutingTable::addReplacement(const Peer& contact) {
+		if (replacementCacheSize <= 0) {
+			return;
+		}
+		auto& cache = replacements[getLookupIndex(contact.id)];
+		for (int i = 0; i < cache.size(); i++) {
+			if (cache[i].id == contact.id) {
+				cache.erase(cache.begin() + i);
+				break;
+			}
+		}
+
+		Peer replacement;
+		replacement.id = contact.id;
+		replacement.address = contact.address;
+		replacement.port = contact.port;
+		replacement.rttMs = contact.rttMs;
+		cache.push_front(replacement);
+		if (cache.size() > replacementCacheSize) {
+			cache.pop_back();
+		}
+	}
+
+	bool PeerRoutingTable::takeReplacement(int index, Peer& contact) {
+		auto entry = replacements.find(index);
+		if (entry == replacements.end()) {
+			return false;
+		}
+		while (!entry->second.empty()) {
+			contact = entry->second.front();
+			entry->second.pop_front();
+			if (!has(contact.id)) {
+				return true;
+			}
+		}
+		replacements.erase(entry);
+		return false;
+	}
+
+	int PeerRoutingTable::getHighestBit(const PeerId& id) {
+		for (int i = PeerId::byteCount - 1; i >= 0; i--) {
+			if (id.bytes[i] != 0) {
+				int bit = 7;
+				while (!(id.bytes[i] & (1 << bit))) {
+					bit--;
+				}
+				return i * 8 + bit;
+			}
+		}
+		return -1;
+	}
+
 }
@@ -6,8 +6,11 @@
 
 #include "util/Blob.h"
 #include "net/Connection.h"
+#include "FailureDetector.h"
 #include <string>
 #include <vector>
+#include <map>
+#include <deque>
 
 namespace net {
 
@@ -23,19 +26,38 @@ namespace net {
 
 		PeerId id;
 		std::string address;
-		uint16_t port;
-		Connection* conn;
+		uint16_t port = 0;
+		Connection* conn = nullptr;
 		State state = DISCONNECTED;
+		//direct connection to a frequent destination, not part of the bucket structure
+		bool shortcut = false;
+		//smoothed round trip time, 0 when not measured yet
+		float rttMs = 0;
+		//every packet received from the peer counts as a heartbeat
+		FailureDetector detector;
+		//closed to keep its bucket within capacity, the slot needs no replacement
+		bool dropped = false;
 	};
 
 	class PeerRoutingTable {
 	public:
 		int bucketSizeBits;
+		//among neighbors that make comparable progress towards the target the one with the lowest rtt is chosen
+		bool proximityRouting = false;
+		//hops this many bits above the distance to the closest neighbor are considered close to the target
+		int proximityNearBits = 4;
+		//maximum number of peers per bucket, shortcuts are not counted, 0 disables the limit
+		int bucketCapacity = 8;
+		//contacts without a connection per bucket, they take the slots of disconnected peers
+		int replacementCacheSize = 8;
+		std::map<int, std::deque<Peer>> replacements;
 		std::vector< std::shared_ptr<Peer>> peers;
 		std::shared_ptr<Peer> localPeer;
 
 		PeerRoutingTable();
 		Peer* getNext(const PeerId& id, const PeerId& except = PeerId(0), bool includeLocalPeer = false);
+		//up to count connected peers sorted by distance to id
+		std::vector<Peer*> getClosest(const PeerId& id, int count, bool includeLocalPeer = false);
 		void add(const Peer& peer);
 		void remove(const PeerId& id);
 		void remove(Connection *conn);
@@ -45,6 +67,16 @@ namespace net {
 		bool hasLookupIndexInTable(int index);
 		PeerId getLookupTarget(int index);
 		int getLookupIndex(const PeerId& id);
+		//number of connected peers in the bucket, shortcuts are not counted
+		int getBucketSize(int index, const Peer* except = nullptr);
+		bool isBucketFull(const PeerId& id, const Peer* except = nullptr);
+		//connected peer of the bucket that was not heard from for the longest time
+		Peer* getLeastRecentlySeen(int index, const Peer* except = nullptr);
+		//most recently added candidates are preferred, the oldest is dropped when the cache is full
+		void addReplacement(const Peer& contact);
+		bool takeReplacement(int index, Peer& contact);
+		//index of the most significant set bit, -1 for zero
+		static int getHighestBit(const PeerId& id);
 	};
 
 }
@@ -0,0 +1,144 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <csignal>
+
+#include "peer/Dht.h"
+
+//measures put and get throughput and latency of a local multi node dht cluster
+//usage: bench_dht [nodes] [operations] [value size] [base port] [in flight]
+
+class Stats {
+public:
+	std::vector<double> latencies;
+	int success = 0;
+	int failed = 0;
+	double seconds = 0;
+
+	void print(const char* name) {
+		std::sort(latencies.begin(), latencies.end());
+		double sum = 0;
+		for (double latency : latencies) {
+			sum += latency;
+		}
+		double count = (double)latencies.size();
+		printf("%s: %i ok, %i failed, %.0f ops/s, avg %.3f ms, p50 %.3f ms, p99 %.3f ms\n", name, success, failed,
+			count / seconds, sum / std::max(count, 1.0), getPercentile(0.5), getPercentile(0.99));
+	}
+
+	double getPercentile(double percentile) {
+		if (latencies.empty()) {
+			return 0;
+		}
+		return latencies[std::min((size_t)(latencies.size() * percentile), latencies.size() - 1)];
+	}
+};
+
+//runs count operations with at most inFlight outstanding at any time
+void run(Stats& stats, int count, int inFlight, const std::function<void(int index, const std::function<void(bool ok)>& done)>& operation) {
+	std::mutex mutex;
+	std::condition_variable condition;
+	int pending = 0;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < count; i++) {
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [&]() { return pending < inFlight; });
+		pending++;
+		lock.unlock();
+
+		auto opStart = std::chrono::high_resolution_clock::now();
+		operation(i, [&, opStart](bool ok) {
+			double time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - opStart).count() / 1000.0;
+			std::unique_lock<std::mutex> lock(mutex);
+			stats.latencies.push_back(time);
+			if (ok) {
+				stats.success++;
+			}
+			else {
+				stats.failed++;
+			}
+			pending--;
+			condition.notify_all();
+		});
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	condition.wait(lock, [&]() { return pending == 0; });
+	stats.seconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000000.0;
+}
+
+int main(int argc, char* argv[]) {
+	int nodeCount = argc > 1 ? std::stoi(argv[1]) : 16;
+	int operations = argc > 2 ? std::stoi(argv[2]) : 10000;
+	int valueSize = argc > 3 ? std::stoi(argv[3]) : 256;
+	int basePort = argc > 4 ? std::stoi(argv[4]) : 7000;
+	int inFlight = argc > 5 ? std::stoi(argv[5]) : 64;
+
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	std::vector<std::unique_ptr<net::PeerNetwork>> networks;
+	std::vector<std::unique_ptr<net::Dht>> dhts;
+	for (int i = 0; i < nodeCount; i++) {
+		auto network = std::make_unique<net::PeerNetwork>();
+		network->setLocalPeer("127.0.0.1", basePort + i);
+		network->addEntryNode("127.0.0.1", basePort);
+		dhts.push_back(std::make_unique<net::Dht>(*network));
+		networks.push_back(std::move(network));
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < nodeCount; i++) {
+		networks[i]->connect();
+		while (i > 0 && networks[i]->getState() != net::PeerNetwork::CONNECTED) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		dhts[i]->start();
+	}
+	double joinTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+	printf("%i nodes joined in %.0f ms\n", nodeCount, joinTime);
+
+	std::vector<uint8_t> value(valueSize, 0xab);
+	auto getKey = [](int index) {
+		return net::Dht::getKey("key" + std::to_string(index));
+	};
+
+	Stats putStats;
+	run(putStats, operations, inFlight, [&](int index, const std::function<void(bool ok)>& done) {
+		Buffer buffer(value.data(), (int)value.size());
+		dhts[index % nodeCount]->put(getKey(index), buffer, [done](net::ErrorCode error, int replicas) {
+			done(error == net::ErrorCode::NO_ERROR);
+		});
+	});
+	putStats.print("put");
+
+	//read every value from a different node than the one that stored it
+	Stats getStats;
+	run(getStats, operations, inFlight, [&](int index, const std::function<void(bool ok)>& done) {
+		dhts[(index + 1) % nodeCount]->get(getKey(index), [done, valueSize](net::ErrorCode error, Buffer& result) {
+			done(error == net::ErrorCode::NO_ERROR && result.size() == valueSize);
+		});
+	});
+	getStats.print("get");
+
+	for (auto& dht : dhts) {
+		dht->stop();
+	}
+	for (auto& network : networks) {
+		network->disconnect();
+	}
+	dhts.clear();
+	networks.clear();
+	return 0;
+}
@@ -35,6 +35,10 @@ int main(int argc, char* argv[]) {
 		printf("%s: %s\n", network.idToStr(id).c_str(), buffer.readStr().c_str());
 	};
 
+	network.setRequestHandler(1, [&](net::PeerId id, Buffer& request, Buffer& response) {
+		response.writeStr(request.readStr());
+	});
+
 	if (!network.loadConfigFile("peer.cfg")) {
 		if (!network.loadConfigFile("../peer.cfg")) {
 			if (!network.loadConfigFile("../../peer.cfg")) {
@@ -59,6 +63,15 @@ int main(int argc, char* argv[]) {
 			network.broadcastPing();
 			continue;
 		}
+		else if (str == "request") {
+			Buffer buffer;
+			buffer.writeStr("echo");
+			auto start = std::chrono::high_resolution_clock::now();
+			auto response = network.request(network.getRandomNeighborPeer(), 1, buffer).get();
+			auto time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count();
+			printf("response: %s %s %.3f ms\n", net::getErrorString(response.error), response.data.readStr().c_str(), time / 1000.0);
+			continue;
+		}
 		else if (str == "state") {
 			printf("state: %i\n", network.getState());
 			continue;
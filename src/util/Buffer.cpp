@@ -82,7 +82,9 @@ void Buffer::reserve(int bytes) {
 	}
 	else {
 		buffer.resize(bytes);
-		memcpy(buffer.data(), dataPtr, dataSize);
+		if (dataSize > 0) {
+			memcpy(buffer.data(), dataPtr, dataSize);
+		}
 		dataSize = (int)buffer.size();
 		dataPtr = buffer.data();
 	}
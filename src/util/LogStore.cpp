@@ -0,0 +1,431 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include "LogStore.h"
+#include <cstring>
+#include <cstddef>
+#include <filesystem>
+#include <algorithm>
+
+#if WIN32
+#include <windows.h>
+#undef NO_ERROR
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+LogStore::LogStore() {
+	activeSegment = nullptr;
+}
+
+LogStore::~LogStore() {
+	close();
+}
+
+bool LogStore::open(const std::string& directory) {
+	close();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+	if (!std::filesystem::is_directory(directory, error)) {
+		return false;
+	}
+	this->directory = directory;
+
+	for (auto& entry : std::filesystem::directory_iterator(directory, error)) {
+		std::string name = entry.path().filename().string();
+		uint32_t id = 0;
+		if (sscanf(name.c_str(), "segment_%u.log", &id) == 1) {
+			Segment* segment = new Segment();
+			segment->id = id;
+			segment->path = entry.path().string();
+			if (!mapSegment(segment, false)) {
+				delete segment;
+				continue;
+			}
+			segments[id] = segment;
+		}
+	}
+
+	//replay segments from oldest to newest, later records replace earlier ones
+	for (auto& i : segments) {
+		recoverSegment(i.second);
+	}
+
+	if (segments.empty()) {
+		activeSegment = createSegment(0);
+		if (!activeSegment) {
+			this->directory.clear();
+			return false;
+		}
+	}
+	else {
+		activeSegment = segments.rbegin()->second;
+	}
+	return true;
+}
+
+void LogStore::close() {
+	std::unique_lock<std::mutex> lock(mutex);
+	for (auto& i : segments) {
+		syncRange(i.second, 0, i.second->writeOffset);
+		unmapSegment(i.second);
+		delete i.second;
+	}
+	segments.clear();
+	index.clear();
+	activeSegment = nullptr;
+	directory.clear();
+}
+
+bool LogStore::isOpen() {
+	return activeSegment != nullptr;
+}
+
+bool LogStore::put(const Key& key, const void* data, int bytes) {
+	std::unique_lock<std::mutex> lock(mutex);
+	Location location;
+	if (!append(key, data, bytes, 0, location)) {
+		return false;
+	}
+
+	auto entry = index.find(key);
+	if (entry != index.end()) {
+		RecordHeader* old = (RecordHeader*)(entry->second.segment->data + entry->second.offset);
+		entry->second.segment->liveBytes -= getRecordBytes(old->size);
+		entry->second = location;
+	}
+	else {
+		index[key] = location;
+	}
+	location.segment->liveBytes += getRecordBytes(bytes);
+	return true;
+}
+
+bool LogStore::get(const Key& key, Buffer& value) {
+	std::unique_lock<std::mutex> lock(mutex);
+	auto entry = index.find(key);
+	if (entry == index.end()) {
+		return false;
+	}
+	RecordHeader* header = (RecordHeader*)(entry->second.segment->data + entry->second.offset);
+	value.setData(header + 1, header->size);
+	return true;
+}
+
+bool LogStore::has(const Key& key) {
+	std::unique_lock<std::mutex> lock(mutex);
+	return index.contains(key);
+}
+
+bool LogStore::remove(const Key& key) {
+	std::unique_lock<std::mutex> lock(mutex);
+	auto entry = index.find(key);
+	if (entry == index.end()) {
+		return false;
+	}
+
+	//the tombstone hides older records of the key during recovery
+	Location location;
+	if (!append(key, nullptr, 0, DELETED, location)) {
+		return false;
+	}
+	RecordHeader* old = (RecordHeader*)(entry->second.segment->data + entry->second.offset);
+	entry->second.segment->liveBytes -= getRecordBytes(old->size);
+	index.erase(entry);
+	return true;
+}
+
+int LogStore::compact() {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	std::vector<Segment*> candidates;
+	for (auto& i : segments) {
+		Segment* segment = i.second;
+		if (segment != activeSegment && segment->liveBytes <= segment->writeOffset * (1.0f - compactionThreshold)) {
+			candidates.push_back(segment);
+		}
+	}
+	if (candidates.empty()) {
+		return 0;
+	}
+
+	//tombstones are only needed while an older segment that is kept might still contain the key
+	uint32_t oldestKept = UINT32_MAX;
+	for (auto& i : segments) {
+		if (std::find(candidates.begin(), candidates.end(), i.second) == candidates.end()) {
+			oldestKept = std::min(oldestKept, i.first);
+		}
+	}
+
+	for (Segment* segment : candidates) {
+		int64_t offset = 0;
+		while (offset < segment->writeOffset) {
+			RecordHeader* header = (RecordHeader*)(segment->data + offset);
+			Location location;
+			if (header->flags & DELETED) {
+				if (oldestKept < segment->id && !index.contains(header->key)) {
+					append(header->key, nullptr, 0, DELETED, location);
+				}
+			}
+			else {
+				auto entry = index.find(header->key);
+				if (entry != index.end() && entry->second.segment == segment && entry->second.offset == offset) {
+					if (append(header->key, header + 1, header->size, 0, location)) {
+						entry->second = location;
+						location.segment->liveBytes += getRecordBytes(header->size);
+					}
+				}
+			}
+			offset += getRecordBytes(header->size);
+		}
+	}
+
+	//the copies have to be on disk before the old segments are deleted
+	for (auto& i : segments) {
+		if (std::find(candidates.begin(), candidates.end(), i.second) == candidates.end()) {
+			syncRange(i.second, 0, i.second->writeOffset);
+		}
+	}
+
+	for (Segment* segment : candidates) {
+		segments.erase(segment->id);
+		unmapSegment(segment);
+		std::error_code error;
+		std::filesystem::remove(segment->path, error);
+		delete segment;
+	}
+	return (int)candidates.size();
+}
+
+void LogStore::sync() {
+	std::unique_lock<std::mutex> lock(mutex);
+	for (auto& i : segments) {
+		syncRange(i.second, 0, i.second->writeOffset);
+	}
+}
+
+std::vector<LogStore::Key> LogStore::getKeys() {
+	std::unique_lock<std::mutex> lock(mutex);
+	std::vector<Key> keys;
+	keys.reserve(index.size());
+	for (auto& i : index) {
+		keys.push_back(i.first);
+	}
+	return keys;
+}
+
+int LogStore::getCount() {
+	std::unique_lock<std::mutex> lock(mutex);
+	return (int)index.size();
+}
+
+int64_t LogStore::getLiveBytes() {
+	std::unique_lock<std::mutex> lock(mutex);
+	int64_t bytes = 0;
+	for (auto& i : segments) {
+		bytes += i.second->liveBytes;
+	}
+	return bytes;
+}
+
+int64_t LogStore::getTotalBytes() {
+	std::unique_lock<std::mutex> lock(mutex);
+	int64_t bytes = 0;
+	for (auto& i : segments) {
+		bytes += i.second->size;
+	}
+	return bytes;
+}
+
+LogStore::Segment* LogStore::createSegment(uint32_t id) {
+	char name[32];
+	snprintf(name, sizeof(name), "segment_%08u.log", id);
+
+	Segment* segment = new Segment();
+	segment->id = id;
+	segment->path = (std::filesystem::path(directory) / name).string();
+	if (!mapSegment(segment, true)) {
+		delete segment;
+		return nullptr;
+	}
+	segments[id] = segment;
+	return segment;
+}
+
+bool LogStore::mapSegment(Segment* segment, bool create) {
+#if WIN32
+	HANDLE file = CreateFileA(segment->path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER size;
+	if (create) {
+		size.QuadPart = segmentSize;
+	}
+	else if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, size.HighPart, size.LowPart, nullptr);
+	CloseHandle(file);
+	if (!mapping) {
+		return false;
+	}
+	void* data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!data) {
+		return false;
+	}
+	segment->size = size.QuadPart;
+#else
+	int file = ::open(segment->path.c_str(), O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+	if (file == -1) {
+		return false;
+	}
+	int64_t size = 0;
+	if (create) {
+		size = segmentSize;
+		if (ftruncate(file, size) != 0) {
+			::close(file);
+			return false;
+		}
+	}
+	else {
+		struct stat status;
+		if (fstat(file, &status) != 0 || status.st_size == 0) {
+			::close(file);
+			return false;
+		}
+		size = status.st_size;
+	}
+	//the mapping stays valid after the file is closed
+	void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	::close(file);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	segment->size = size;
+#endif
+	segment->data = (uint8_t*)data;
+	return true;
+}
+
+void LogStore::unmapSegment(Segment* segment) {
+	if (segment->data) {
+#if WIN32
+		UnmapViewOfFile(segment->data);
+#else
+		munmap(segment->data, segment->size);
+#endif
+		segment->data = nullptr;
+	}
+}
+
+void LogStore::recoverSegment(Segment* segment) {
+	int64_t offset = 0;
+	while (offset + (int64_t)sizeof(RecordHeader) <= segment->size) {
+		RecordHeader* header = (RecordHeader*)(segment->data + offset);
+		if (header->size > segment->size - offset - sizeof(RecordHeader) || header->checksum != getChecksum(header)) {
+			break;
+		}
+
+		auto entry = index.find(header->key);
+		if (entry != index.end()) {
+			RecordHeader* old = (RecordHeader*)(entry->second.segment->data + entry->second.offset);
+			entry->second.segment->liveBytes -= getRecordBytes(old->size);
+			index.erase(entry);
+		}
+		if (!(header->flags & DELETED)) {
+			index[header->key] = { segment, offset };
+			segment->liveBytes += getRecordBytes(header->size);
+		}
+		offset += getRecordBytes(header->size);
+	}
+
+	//a torn record after the last valid one is overwritten by the next append
+	segment->writeOffset = offset;
+	if (offset + (int64_t)sizeof(RecordHeader) <= segment->size) {
+		memset(segment->data + offset, 0, sizeof(RecordHeader));
+	}
+}
+
+bool LogStore::append(const Key& key, const void* data, int bytes, uint32_t flags, Location& location) {
+	int64_t recordBytes = getRecordBytes(bytes);
+	if (!activeSegment || bytes < 0 || recordBytes > segmentSize) {
+		return false;
+	}
+
+	if (activeSegment->writeOffset + recordBytes > activeSegment->size) {
+		Segment* segment = createSegment(activeSegment->id + 1);
+		if (!segment) {
+			return false;
+		}
+		activeSegment = segment;
+	}
+
+	//the checksum is written last, a record interrupted by a crash fails validation on recovery
+	RecordHeader* header = (RecordHeader*)(activeSegment->data + activeSegment->writeOffset);
+	header->size = bytes;
+	header->flags = flags;
+	header->reserved = 0;
+	header->key = key;
+	if (bytes > 0) {
+		memcpy(header + 1, data, bytes);
+	}
+	header->checksum = getChecksum(header);
+
+	location.segment = activeSegment;
+	location.offset = activeSegment->writeOffset;
+	activeSegment->writeOffset += recordBytes;
+	if (syncOnWrite) {
+		syncRange(activeSegment, location.offset, recordBytes);
+	}
+	return true;
+}
+
+void LogStore::syncRange(Segment* segment, int64_t offset, int64_t bytes) {
+	if (!segment->data || bytes <= 0) {
+		return;
+	}
+#if WIN32
+	FlushViewOfFile(segment->data + offset, bytes);
+#else
+	int64_t pageSize = sysconf(_SC_PAGESIZE);
+	int64_t begin = offset - offset % pageSize;
+	msync(segment->data + begin, offset + bytes - begin, MS_SYNC);
+#endif
+}
+
+int64_t LogStore::getRecordBytes(int valueSize) {
+	//records are 8 byte aligned
+	return (sizeof(RecordHeader) + valueSize + 7) & ~(int64_t)7;
+}
+
+uint32_t LogStore::getChecksum(const RecordHeader* header) {
+	static uint32_t table[256] = {};
+	static bool tableInitialized = [&]() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t crc = i;
+			for (int j = 0; j < 8; j++) {
+				crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+			}
+			table[i] = crc;
+		}
+		return true;
+	}();
+
+	//crc32 over everything except the checksum itself
+	const uint8_t* data = (const uint8_t*)header + offsetof(RecordHeader, size);
+	int64_t bytes = sizeof(RecordHeader) - offsetof(RecordHeader, size) + header->size;
+	uint32_t crc = 0xFFFFFFFF;
+	for (int64_t i = 0; i < bytes; i++) {
+		crc = (crc >> 8) ^ table[(crc ^ data[i]) & 0xFF];
+	}
+	return ~crc;
+}
@@ -0,0 +1,103 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#pragma once
+
+#include "Blob.h"
+#include "Buffer.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+
+//persistent key value store, records are appended to memory mapped segment files and located by an in memory index
+//values written before a crash are recovered on open, torn records at the end of a segment are discarded
+class LogStore {
+public:
+	typedef Blob<256> Key;
+
+	int64_t segmentSize = 64 * 1024 * 1024;
+	//sealed segments with at least this fraction of dead bytes are rewritten by compact()
+	float compactionThreshold = 0.5f;
+	//flush every record to disk before put/remove return
+	bool syncOnWrite = false;
+
+	LogStore();
+	~LogStore();
+
+	bool open(const std::string& directory);
+	void close();
+	bool isOpen();
+
+	bool put(const Key& key, const void* data, int bytes);
+	//sets value to a read only view into the mapped segment without copying,
+	//the view stays valid until the record is compacted or the store is closed
+	bool get(const Key& key, Buffer& value);
+	bool has(const Key& key);
+	bool remove(const Key& key);
+
+	//rewrites the live records of sparse segments and deletes them, returns the number of deleted segments
+	int compact();
+	void sync();
+
+	std::vector<Key> getKeys();
+	int getCount();
+	//bytes of live records including headers
+	int64_t getLiveBytes();
+	//bytes of all segments on disk
+	int64_t getTotalBytes();
+
+private:
+	class KeyHash {
+	public:
+		size_t operator()(const Key& key) const {
+			return (size_t)key.words[0];
+		}
+	};
+
+	class RecordHeader {
+	public:
+		uint32_t checksum;
+		uint32_t size;
+		uint32_t flags;
+		uint32_t reserved;
+		Key key;
+	};
+
+	enum RecordFlags : uint32_t {
+		DELETED = 1,
+	};
+
+	class Segment {
+	public:
+		uint32_t id = 0;
+		std::string path;
+		uint8_t* data = nullptr;
+		int64_t size = 0;
+		int64_t writeOffset = 0;
+		int64_t liveBytes = 0;
+	};
+
+	class Location {
+	public:
+		Segment* segment;
+		int64_t offset;
+	};
+
+	std::string directory;
+	std::map<uint32_t, Segment*> segments;
+	Segment* activeSegment;
+	std::unordered_map<Key, Location, KeyHash> index;
+	std::mutex mutex;
+
+	Segment* createSegment(uint32_t id);
+	bool mapSegment(Segment* segment, bool create);
+	void unmapSegment(Segment* segment);
+	void recoverSegment(Segment* segment);
+	bool append(const Key& key, const void* data, int bytes, uint32_t flags, Location& location);
+	void syncRange(Segment* segment, int64_t offset, int64_t bytes);
+	static int64_t getRecordBytes(int valueSize);
+	static uint32_t getChecksum(const RecordHeader* header);
+};
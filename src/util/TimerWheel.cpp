@@ -0,0 +1,151 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include "TimerWheel.h"
+
+TimerWheel::TimerWheel(int resolutionMs, int slotCount) {
+	this->resolutionMs = resolutionMs > 0 ? resolutionMs : 1;
+	slots.resize(slotCount > 0 ? slotCount : 1);
+	currentTick = 0;
+	nextId = 1;
+	startTime = std::chrono::steady_clock::now();
+	thread = nullptr;
+	running = false;
+	generation = 0;
+}
+
+TimerWheel::~TimerWheel() {
+	stop();
+}
+
+TimerWheel::TimerId TimerWheel::add(int delayMs, const std::function<void()>& callback) {
+	std::unique_lock<std::mutex> lock(mutex);
+	uint64_t expireTick = getTick(std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs)) + 1;
+	if (expireTick <= currentTick) {
+		expireTick = currentTick + 1;
+	}
+
+	Timer timer;
+	timer.id = nextId++;
+	timer.expireTick = expireTick;
+	timer.callback = callback;
+
+	int slot = (int)(expireTick % slots.size());
+	slots[slot].push_back(timer);
+	timerSlots[timer.id] = slot;
+	return timer.id;
+}
+
+bool TimerWheel::cancel(TimerId id) {
+	std::unique_lock<std::mutex> lock(mutex);
+	auto entry = timerSlots.find(id);
+	if (entry == timerSlots.end()) {
+		return false;
+	}
+
+	auto& slot = slots[entry->second];
+	for (int i = 0; i < slot.size(); i++) {
+		if (slot[i].id == id) {
+			if (i != slot.size() - 1) {
+				slot[i] = std::move(slot.back());
+			}
+			slot.pop_back();
+			break;
+		}
+	}
+	timerSlots.erase(entry);
+	return true;
+}
+
+void TimerWheel::start() {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (running) {
+		return;
+	}
+
+	running = true;
+	thread = new std::thread([&]() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (running) {
+			condition.wait_for(lock, std::chrono::milliseconds(resolutionMs));
+			if (!running) {
+				break;
+			}
+			lock.unlock();
+			tick();
+			lock.lock();
+		}
+	});
+}
+
+void TimerWheel::stop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	running = false;
+	generation++;
+	condition.notify_all();
+	std::thread* joinThread = thread;
+	thread = nullptr;
+	lock.unlock();
+
+	if (joinThread) {
+		if (joinThread->get_id() == std::this_thread::get_id()) {
+			joinThread->detach();
+		}
+		else {
+			joinThread->join();
+		}
+		delete joinThread;
+	}
+
+	//callbacks are done once the thread was joined, timers they added are dropped as well
+	lock.lock();
+	for (auto& slot : slots) {
+		slot.clear();
+	}
+	timerSlots.clear();
+}
+
+bool TimerWheel::isRunning() {
+	return running;
+}
+
+int TimerWheel::tick() {
+	std::vector<Timer> expired;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	uint64_t tickGeneration = generation;
+	uint64_t targetTick = getTick(std::chrono::steady_clock::now());
+	while (currentTick < targetTick) {
+		currentTick++;
+		auto& slot = slots[currentTick % slots.size()];
+		for (int i = 0; i < slot.size();) {
+			if (slot[i].expireTick <= currentTick) {
+				timerSlots.erase(slot[i].id);
+				expired.push_back(std::move(slot[i]));
+				if (i != slot.size() - 1) {
+					slot[i] = std::move(slot.back());
+				}
+				slot.pop_back();
+			}
+			else {
+				i++;
+			}
+		}
+	}
+	lock.unlock();
+
+	for (auto& timer : expired) {
+		if (generation != tickGeneration) {
+			break;
+		}
+		if (timer.callback) {
+			timer.callback();
+		}
+	}
+	return (int)expired.size();
+}
+
+uint64_t TimerWheel::getTick(std::chrono::steady_clock::time_point time) {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(time - startTime).count() / resolutionMs;
+}
@@ -0,0 +1,59 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+//hashed timing wheel, adding and canceling a timer is O(1) independent of the number of timers
+class TimerWheel {
+public:
+	typedef uint64_t TimerId;
+
+	TimerWheel(int resolutionMs = 10, int slotCount = 512);
+	~TimerWheel();
+
+	TimerId add(int delayMs, const std::function<void()>& callback);
+	bool cancel(TimerId id);
+
+	//runs the wheel on its own thread, callbacks are invoked on that thread
+	void start();
+	//pending timers are dropped, so self rescheduling timers do not run twice after the next start
+	void stop();
+	bool isRunning();
+
+	//advance the wheel to the current time and invoke expired callbacks, returns the number of invoked callbacks
+	int tick();
+
+private:
+	class Timer {
+	public:
+		TimerId id;
+		uint64_t expireTick;
+		std::function<void()> callback;
+	};
+
+	int resolutionMs;
+	std::vector<std::vector<Timer>> slots;
+	std::unordered_map<TimerId, int> timerSlots;
+	uint64_t currentTick;
+	TimerId nextId;
+	std::chrono::steady_clock::time_point startTime;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::thread* thread;
+	std::atomic<bool> running;
+	//bumped by stop, expired timers of an older generation are not invoked anymore
+	std::atomic<uint64_t> generation;
+
+	uint64_t getTick(std::chrono::steady_clock::time_point time);
+};
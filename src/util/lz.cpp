@@ -0,0 +1,211 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#include "lz.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+//a sequence is a token with the literal count and match length, the literals and the offset of the match
+//counts of 15 and more continue in following bytes that are added up until a byte is not 255
+
+static const int lzMinMatch = 4;
+static const int lzMaxOffset = 65535;
+static const int lzHashBits = 14;
+
+static uint32_t lzRead32(const uint8_t* ptr) {
+	uint32_t value;
+	memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+static uint32_t lzHash(uint32_t value, int bits) {
+	return (value * 2654435761u) >> (32 - bits);
+}
+
+static void lzWriteCount(uint8_t*& out, int count) {
+	while (count >= 255) {
+		*out++ = 255;
+		count -= 255;
+	}
+	*out++ = (uint8_t)count;
+}
+
+static bool lzReadCount(const uint8_t*& in, const uint8_t* end, int& count) {
+	uint8_t byte;
+	do {
+		if (in >= end || count > (1 << 30)) {
+			return false;
+		}
+		byte = *in++;
+		count += byte;
+	} while (byte == 255);
+	return true;
+}
+
+static bool lzWriteSequence(uint8_t*& out, uint8_t* end, const uint8_t* literals, int literalCount, int offset, int matchLength) {
+	int needed = 1 + literalCount / 255 + 1 + literalCount + (matchLength > 0 ? 2 + matchLength / 255 + 1 : 0);
+	if (needed > end - out) {
+		return false;
+	}
+	uint8_t* token = out++;
+	*token = (uint8_t)(std::min(literalCount, 15) << 4);
+	if (literalCount >= 15) {
+		lzWriteCount(out, literalCount - 15);
+	}
+	if (literalCount > 0) {
+		memcpy(out, literals, literalCount);
+		out += literalCount;
+	}
+	if (matchLength > 0) {
+		int length = matchLength - lzMinMatch;
+		*token |= (uint8_t)std::min(length, 15);
+		uint16_t offset16 = (uint16_t)offset;
+		memcpy(out, &offset16, sizeof(offset16));
+		out += sizeof(offset16);
+		if (length >= 15) {
+			lzWriteCount(out, length - 15);
+		}
+	}
+	return true;
+}
+
+//compresses base[start, end), the bytes before start are history that matches can refer to
+static int lzCompressBlock(const uint8_t* base, int start, int end, uint8_t* out, int capacity) {
+	//small inputs use a smaller table, so clearing it does not dominate
+	int bits = 8;
+	while (bits < lzHashBits && (1 << bits) < end) {
+		bits++;
+	}
+	int table[1 << lzHashBits];
+	std::fill(table, table + (1 << bits), -1);
+	for (int i = std::max(0, start - lzMaxOffset); i + lzMinMatch <= start; i++) {
+		table[lzHash(lzRead32(base + i), bits)] = i;
+	}
+
+	uint8_t* op = out;
+	uint8_t* oend = out + capacity;
+	int anchor = start;
+	int i = start;
+	while (i + lzMinMatch <= end) {
+		uint32_t sequence = lzRead32(base + i);
+		uint32_t hash = lzHash(sequence, bits);
+		int candidate = table[hash];
+		table[hash] = i;
+		if (candidate < 0 || i - candidate > lzMaxOffset || lzRead32(base + candidate) != sequence) {
+			//skip faster through data that does not compress
+			i += 1 + ((i - anchor) >> 6);
+			continue;
+		}
+
+		int length = lzMinMatch;
+		while (i + length < end && base[candidate + length] == base[i + length]) {
+			length++;
+		}
+		while (i > anchor && candidate > 0 && base[i - 1] == base[candidate - 1]) {
+			i--;
+			candidate--;
+			length++;
+		}
+
+		if (!lzWriteSequence(op, oend, base + anchor, i - anchor, i - candidate, length)) {
+			return 0;
+		}
+		i += length;
+		anchor = i;
+		if (i - 2 + lzMinMatch <= end) {
+			table[lzHash(lzRead32(base + i - 2), bits)] = i - 2;
+		}
+	}
+
+	if (!lzWriteSequence(op, oend, base + anchor, end - anchor, 0, 0)) {
+		return 0;
+	}
+	return (int)(op - out);
+}
+
+//decompresses into base[start, start + capacity), the bytes before start are history that matches can refer to
+static int lzDecompressBlock(const uint8_t* in, int bytes, uint8_t* base, int start, int capacity) {
+	const uint8_t* ip = in;
+	const uint8_t* iend = in + bytes;
+	int op = start;
+	int oend = start + capacity;
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		int literals = token >> 4;
+		if (literals == 15 && !lzReadCount(ip, iend, literals)) {
+			return -1;
+		}
+		if (literals > iend - ip || literals > oend - op) {
+			return -1;
+		}
+		memcpy(base + op, ip, literals);
+		ip += literals;
+		op += literals;
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		uint16_t offset;
+		memcpy(&offset, ip, sizeof(offset));
+		ip += sizeof(offset);
+		int length = token & 15;
+		if (length == 15 && !lzReadCount(ip, iend, length)) {
+			return -1;
+		}
+		length += lzMinMatch;
+		if (offset == 0 || offset > op || length > oend - op) {
+			return -1;
+		}
+
+		//matches can overlap the bytes they produce
+		uint8_t* dst = base + op;
+		const uint8_t* src = dst - offset;
+		if (offset >= length) {
+			memcpy(dst, src, length);
+		}
+		else {
+			for (int j = 0; j < length; j++) {
+				dst[j] = src[j];
+			}
+		}
+		op += length;
+	}
+	return op - start;
+}
+
+int lzCompressBound(int bytes) {
+	return bytes + bytes / 255 + 16;
+}
+
+int lzCompress(const void* data, int bytes, void* out, int capacity, const void* dictionary, int dictionaryBytes) {
+	if (dictionary && dictionaryBytes > 0) {
+		int history = std::min(dictionaryBytes, lzMaxOffset);
+		std::vector<uint8_t> window(history + bytes);
+		memcpy(window.data(), (const uint8_t*)dictionary + dictionaryBytes - history, history);
+		if (bytes > 0) {
+			memcpy(window.data() + history, data, bytes);
+		}
+		return lzCompressBlock(window.data(), history, history + bytes, (uint8_t*)out, capacity);
+	}
+	return lzCompressBlock((const uint8_t*)data, 0, bytes, (uint8_t*)out, capacity);
+}
+
+int lzDecompress(const void* data, int bytes, void* out, int capacity, const void* dictionary, int dictionaryBytes) {
+	if (dictionary && dictionaryBytes > 0) {
+		int history = std::min(dictionaryBytes, lzMaxOffset);
+		std::vector<uint8_t> window(history + capacity);
+		memcpy(window.data(), (const uint8_t*)dictionary + dictionaryBytes - history, history);
+		int size = lzDecompressBlock((const uint8_t*)data, bytes, window.data(), history, capacity);
+		if (size > 0) {
+			memcpy(out, window.data() + history, size);
+		}
+		return size;
+	}
+	return lzDecompressBlock((const uint8_t*)data, bytes, (uint8_t*)out, 0, capacity);
+}
@@ -0,0 +1,15 @@
+//
+// Copyright (c) 2023 Julian Hinxlage. All rights reserved.
+//
+
+#pragma once
+
+//byte oriented lz77 codec in the style of lz4, fast but without entropy coding
+//a dictionary is data that precedes the input, both sides have to use the same dictionary
+
+//maximum compressed size of an input of the given size
+int lzCompressBound(int bytes);
+//returns the compressed size, or 0 when the output does not fit into the capacity
+int lzCompress(const void* data, int bytes, void* out, int capacity, const void* dictionary = nullptr, int dictionaryBytes = 0);
+//returns the decompressed size, or -1 when the input is invalid or the output does not fit into the capacity
+int lzDecompress(const void* data, int bytes, void* out, int capacity, const void* dictionary = nullptr, int dictionaryBytes = 0);